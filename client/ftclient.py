@@ -9,12 +9,20 @@
 # connection and the FTP session is managed over a control connection.
 
 # -------------------------- modules and packages ----------------------------
+# print() is a function in Python 2 as in Python 3, the client runs on both
+from __future__ import print_function
+# buffered binary files, the same in Python 2 and 3
+import io
 # miscellaneous operating system interfaces
 import os   
 # regular expressions operations                   
 import re       
 # system specific parameters and functions               
 import sys 
+# transfer times
+import time
+# deflate streams of compressed files
+import zlib
 # socket low-level interface (socket API)
 # https://docs.python.org/2/library/socket.html                     
 from socket import (            
@@ -25,7 +33,46 @@ from socket import (
     SOL_SOCKET,
     SO_REUSEADDR
 )
-from struct import pack, unpack 
+from struct import pack, unpack_from 
+
+# packet format used after the server's OKAY: 1 (16 bit length, the default)
+# or 2 (32 bit length), see controlConnection()
+version = 1
+# FILE payload size asked for with version 2 packets
+chunkSize = 1048576
+# the server keeps the session open for all the commands (DPORT option keep=1)
+keepOpen = False
+# commands sent ahead of the one being transferred in a kept session
+PIPELINE_WINDOW = 16
+# most bytes of a command payload the server takes
+PAYLOAD_LENGTH = 512
+# stream ID of the current transfer (version 3 packets), and packets of other
+# streams received while waiting for it
+dataStream = 0
+otherPackets = []
+# a striped GET writes its range into this file (made by the parent process),
+# the file length a RANGE packet reported, and transfers that failed
+stripeFile = None
+rangeTotal = None
+transferErrors = 0
+# the server sends files as deflate streams (DPORT option z=deflate)
+compressed = False
+# a delta GET sends the signatures of the local copy's blocks: the smallest
+# block size, doubled until there are at most DELTA_MAX_BLOCKS blocks, and the
+# block size of the current delta GET
+DELTA_MIN_BLOCK = 4096
+DELTA_MAX_BLOCKS = 16384
+SIGNATURES_PER_PACKET = 64
+deltaBlock = DELTA_MIN_BLOCK
+# the local file a PUT sends, see uploadFile()
+putFile = None
+# received bytes of each socket, as [buffer, memoryview of it, start, end]:
+# bytes [start, end) are not parsed yet; many packets are parsed out of each
+# recv_into(), and a raw file body goes from the buffer straight to the file
+RECEIVE_BUFFER_SIZE = 1048576
+receiveBuffers = {}
+# files are written in batches of this many bytes
+WRITE_BATCH = 1048576
 
 # --------------------------- main function ----------------------------------
 def main():
@@ -34,61 +81,108 @@ def main():
     # declare global variables for command line arguments
     global serverHost
     global serverPort
-    global command
-    global filename
     global dataPort
+    global options
+    global chunkSize
+
+    # take the long options (--name or --name=value) out of the arguments
+    args, options = parseOptions(sys.argv)
 
     # check for command line arguments
-	# -l command is 5 agruments, -g command is 6 arguments
+	# -l command is 5 agruments, -g command is 6 arguments (or more, for more files)
 	# source for command line: http://www.tutorialspoint.com/python/python_command_line_arguments.htm
-    if len(sys.argv) not in (5, 6):
+    if len(args) < 5:
         print (
-            "Error: Use python2 ftclient <server-hostname> <server-port> " +
-            "-l OR -g <filename> <data-port>"
+            "Error: Use python ftclient [--chunk=<bytes>] [--no-stream] [--mux] [--resume] [--stripes=<n>] " +
+            "[--compress[=deflate]] [--level=<1-9>] [--delta] " +
+            "[--offset=<n>] [--limit=<n>] [--prefix=<name>] <server-hostname> <server-port> " +
+            "-l OR -g <filename> [<filename> ...] OR -b <name-or-pattern> [...] OR -p <filename> [...] " +
+            "OR -s <data-port>"
         )
         sys.exit(1)
 	# get data from the command line and place in vars
 	# set the server hostname to var
-    serverHost = gethostbyname(sys.argv[1])
-    serverPort = sys.argv[2]
-    command = sys.argv[3]
-    filename = sys.argv[4] if len(sys.argv) == 6 else None
-    dataPort = sys.argv[5] if len(sys.argv) == 6 else sys.argv[4]
+    serverHost = gethostbyname(args[1])
+    serverPort = args[2]
+    dataPort = args[-1]
 
 	# ---------- check for client user input errors -------------
     # check server port number, make sure it is an actual number
     # call isNumber to check if the string entered is numbers or letters
     if not isNumber(serverPort):
-        print "ftclient: Server port must be a number!"
+        print("ftclient: Server port must be a number!")
         sys.exit(1)
     serverPort = int(serverPort)
 	
-	# check if -g (file transfer) command has a filename
-    if command == "-g" and filename is None:
-        print (
-            "Error: Use python2 ftclient <server-hostname> <server-port> " +
-            "-l|-g <filename> <data-port>"
-        )
-        sys.exit(1)
-
-    # user command must be either -l (list) or -g (get)
-    if command not in ("-l", "-g"):
-        print "ftclient: Command must be either -l or -g"
-        sys.exit(1)
+    # the commands between the server port and the data port
+    commands = parseCommands(args[3:-1])
 
    # check data port number, make sure it is an actual number
     if not isNumber(dataPort):
-        print "ftclient: Data port must be a number!"
+        print("ftclient: Data port must be a number!")
         sys.exit(1)
     dataPort = int(dataPort)
 
     # the server and data ports cannot be the same number
     if serverPort == dataPort:
-        print "ftclient: Server port and data port cannot be the same!"
+        print("ftclient: Server port and data port cannot be the same!")
+        sys.exit(1)
+
+    # check the chunk size, make sure it is an actual number
+    if "chunk" in options:
+        if not isNumber(options["chunk"]) or int(options["chunk"]) == 0:
+            print("ftclient: Chunk size must be a positive number!")
+            sys.exit(1)
+        chunkSize = int(options["chunk"])
+
+    # check the listing page, make sure the numbers are actual numbers
+    for name in ("offset", "limit"):
+        if name in options and not isNumber(options[name]):
+            print("ftclient: List " + name + " must be a number!")
+            sys.exit(1)
+
+    # deflate is the only compression this client reads
+    if "compress" in options and options["compress"] not in ("", "deflate"):
+        print("ftclient: Compression must be deflate!")
         sys.exit(1)
+    if "level" in options:
+        if not isNumber(options["level"]) or not 1 <= int(options["level"]) <= 9:
+            print("ftclient: Compression level must be a number from 1 to 9!")
+            sys.exit(1)
+
+    # striped GETs run first, each as parallel sessions of its own
+    if "stripes" in options:
+        if not isNumber(options["stripes"]) or int(options["stripes"]) == 0:
+            print("ftclient: Stripes must be a positive number!")
+            sys.exit(1)
+        for outtag, outdata in commands:
+            if outtag == "GET":
+                stripedGet(outdata, int(options["stripes"]))
+        commands = [command for command in commands if command[0] != "GET"]
+
+    # so are delta GETs: their signatures go ahead of the transfer, and are
+    # not held up behind the transfers of commands sent before them
+    for command in commands:
+        if command[0] == "DELTA":
+            initiateContact([command])
+    commands = [command for command in commands if command[0] != "DELTA"]
+
+    # uploads too, the server takes one file per session
+    for command in commands:
+        if command[0] == "PUT":
+            uploadFile(command[1])
+    commands = [command for command in commands if command[0] != "PUT"]
+
+    # the server statistics are a session of their own
+    for outtag, outdata in commands:
+        if outtag == "STATS":
+            showStats()
+    commands = [command for command in commands if command[0] != "STATS"]
 
     # --- start a control connection between the FTP client and server ---
-    initiateContact()
+    # an older server runs one command per session, the rest get sessions of their own
+    while commands:
+        commands = initiateContact(commands)
 
     sys.exit(0)
 
@@ -107,88 +201,376 @@ def isNumber(string):
     # see if the user entered numbers or letters
     return re.match("^[0-9]+$", string) is not None
 
+# -----------------------------------------------------------------------------
+# parseOptions()
+# Description: A function that separates the long options (--name or
+# --name=value) from the other command line arguments.
+# Parameters: command line arguments
+# Output: (arguments, options) tuple, options maps names to values
+# -----------------------------------------------------------------------------
+
+def parseOptions(argv):
+    args = []
+    options = {}
+    for arg in argv:
+        if arg.startswith("--"):
+            name, _, value = arg[2:].partition("=")
+            if name not in ("chunk", "no-stream", "offset", "limit", "prefix", "mux", "resume", "stripes", "compress", "level",
+                "delta"):
+                print("ftclient: Unknown option --" + name)
+                sys.exit(1)
+            options[name] = value
+        else:
+            args.append(arg)
+    return args, options
+
+# -----------------------------------------------------------------------------
+# parseCommands()
+# Description: A function that turns the command line commands into request
+# packets: -l is one LIST, -g is one GET for each filename after it, -b is a
+# batch GET of the names and patterns after it (one per line, as many MGETs as
+# their payloads need), -p is one PUT for each local file after it, -s asks for
+# the server statistics, e.g. "-g a.txt b.txt -b 'logs-*' -l". Exits on a bad
+# command.
+# Parameters: command line words between the server port and the data port
+# Output: list of (tag, data) tuples
+# -----------------------------------------------------------------------------
+
+def parseCommands(words):
+    commands = []
+    command = None
+    for word in words:
+        if word.startswith("-"):
+            # user command must be either -l (list), -g (get), -b (batch get), -p (put) or -s (stats)
+            if word not in ("-l", "-g", "-b", "-p", "-s"):
+                print("ftclient: Command must be either -l, -g, -b, -p or -s")
+                sys.exit(1)
+            command = word
+            if word == "-s":
+                commands.append(("STATS", ""))
+            elif word == "-l":
+                # a page of the listing and a name prefix, as options after an empty first line
+                listOptions = [name + "=" + options[name] for name in ("offset", "limit", "prefix")
+                    if name in options]
+                commands.append(("LIST", "\n" + " ".join(listOptions) if listOptions else ""))
+            elif word == "-b":
+                commands.append(("MGET", None))
+            elif word == "-p":
+                commands.append(("PUT", None))
+            else:
+                commands.append(("GET", None))
+        elif command == "-g":
+            # resume a partial local file: ask for the rest of the file
+            tag, data = "GET", word
+            if "resume" in options and "stripes" not in options and os.path.exists(word):
+                data += "\noffset=" + str(os.path.getsize(word))
+            # or ask only for the changes to a local copy, in blocks of its own
+            elif "delta" in options and "stripes" not in options and os.path.exists(word):
+                block = DELTA_MIN_BLOCK
+                while os.path.getsize(word) // block > DELTA_MAX_BLOCKS:
+                    block *= 2
+                tag = "DELTA"
+                data += "\nblock={0} blocks={1}".format(block, os.path.getsize(word) // block)
+            # the first filename fills in the GET, the others add more
+            if commands[-1] == ("GET", None):
+                commands[-1] = (tag, data)
+            else:
+                commands.append((tag, data))
+        elif command == "-b":
+            # the names go one per line, a full payload starts the next MGET
+            if commands[-1] == ("MGET", None):
+                commands[-1] = ("MGET", word)
+            elif len(raw(commands[-1][1] + "\n" + word)) <= PAYLOAD_LENGTH:
+                commands[-1] = ("MGET", commands[-1][1] + "\n" + word)
+            else:
+                commands.append(("MGET", word))
+        elif command == "-p":
+            # the local path, the payload is made when the file is sent
+            if commands[-1] == ("PUT", None):
+                commands[-1] = ("PUT", word)
+            else:
+                commands.append(("PUT", word))
+        else:
+            commands = []
+            break
+    # every -g, -b and -p needs a filename
+    if not commands or ("GET", None) in commands or ("MGET", None) in commands or ("PUT", None) in commands:
+        print (
+            "Error: Use python ftclient <server-hostname> <server-port> " +
+            "-l|-g <filename> [<filename> ...]|-b <name-or-pattern> [...]|-p <filename> [...]|-s <data-port>"
+        )
+        sys.exit(1)
+    return commands
+
+# -----------------------------------------------------------------------------
+# text(), raw()
+# Description: Functions that turn packet bytes into a string and back. In
+# Python 2 both are the same str; in Python 3 tags, names and messages are
+# UTF-8 text, while file bytes stay bytes.
+# Parameters: bytes (text) or string (raw)
+# Output: string (text) or bytes (raw)
+# -----------------------------------------------------------------------------
+
+def text(data):
+    return data if str is bytes else data.decode("utf-8", "replace")
+
+def raw(string):
+    return string if isinstance(string, bytes) else string.encode("utf-8")
+
+# -----------------------------------------------------------------------------
+# bufferPiece()
+# Description: A function that gives bytes of a receive buffer without copying
+# them: a memoryview slice, or a buffer in Python 2, whose zlib.crc32() does
+# not take a memoryview.
+# Parameters: buffer state, start, number of bytes
+# Output: the bytes, as a buffer object
+# -----------------------------------------------------------------------------
+
+def bufferPiece(state, start, length):
+    if str is bytes:
+        return buffer(state[0], start, length)
+    return state[1][start:start + length]
+
+# -----------------------------------------------------------------------------
+# bufferData()
+# Description: A function that makes sure the next bytesNumber bytes of a
+# socket are in its receive buffer. It receives with recv_into() into the free
+# end of the buffer, as much as the socket has, so that one system call
+# usually brings many packets. The bytes not parsed yet move to the front when
+# the end is too small, and the buffer grows for a packet larger than it.
+# Parameters: current socket endpoint to receive data, number of bytes
+# Output: the buffer state [buffer, view, start, end] of the socket
+# source: https://docs.python.org/2/library/socket.html#socket.socket.recv_into
+# -----------------------------------------------------------------------------
+
+def bufferData(socket, bytesNumber):
+    state = receiveBuffers.get(socket)
+    if state is None:
+        buffer = bytearray(RECEIVE_BUFFER_SIZE)
+        state = receiveBuffers[socket] = [buffer, memoryview(buffer), 0, 0]
+    while state[3] - state[2] < bytesNumber:
+        if len(state[0]) - state[2] < bytesNumber:
+            left = state[1][state[2]:state[3]].tobytes()
+            if len(state[0]) < bytesNumber:
+                buffer = bytearray(bytesNumber)
+                state[0], state[1] = buffer, memoryview(buffer)
+            state[0][:len(left)] = left
+            state[2], state[3] = 0, len(left)
+        try:
+            received = socket.recv_into(state[1][state[3]:])
+        except Exception as e:
+            print(e.strerror)
+            sys.exit(1)
+        # server closed the connection early
+        if received == 0:
+            print("ftclient: Connection closed by the server")
+            sys.exit(1)
+        state[3] += received
+    return state
+
 # -------------------------------------------------------------------------------
 	# receiveData()
-	# Description: A function that uses the recv() function to collect all the data
-	# that is being sent.This function is used in the receiveFile function below.
+	# Description: A function that collects the next bytes of a socket, from its
+	# receive buffer. This function is used in the receiveFile function below.
 	# Parameters: current socket endpoint to receive data, number of bytes to receive
 	# Output: buffer of received data
 #---------------------------------------------------------------------------------
 
 def receiveData(socket, bytesNumber):
-   # data will collect the number of bytes
-	# will be called a number of times
-	# source: http://stackoverflow.com/questions/7174927/when-does-socket-recvrecv-size-return
-    data = "";
-    while len(data) < bytesNumber:
-        try:
-            data += socket.recv(bytesNumber - len(data))
-        except Exception as e:
-            print e.strerror
-            sys.exit(1);
-
+    state = bufferData(socket, bytesNumber)
+    data = state[1][state[2]:state[2] + bytesNumber].tobytes()
+    state[2] += bytesNumber
     return data
 
 # -----------------------------------------------------------------------------
 # receiveFile()
 # Description: A function that receives a file(packet) from the socket after the
 # connection is made.The tag and data are returned in the control connection.
-# Parameters: current socket endpoint to receive data
+# With version 3 packets, control and transfers share the socket: packets of
+# other streams are kept for later, until one of the asked stream arrives.
+# The payload of a FILE packet stays bytes, the others are text.
+# Parameters: current socket endpoint to receive data, stream ID (version 3
+# only, 0 is the control stream)
 # Output: (tag, data) tuple
 # Sources: http://www.tutorialspoint.com/python/python_tuples.htm
 # http://beej.us/guide/bgnet/output/html/singlepage/bgnet.html#sonofdataencap
 # -----------------------------------------------------------------------------
 
-def receiveFile(socket):
-    # get the file length
-	# the first 2 bytes are the packet length
-	# https://docs.python.org/2/library/struct.html
-    packetLength = unpack(">H", receiveData(socket, 2))[0]
+def receiveFile(socket, stream = 0):
+    # a packet of this stream may have arrived while waiting for another one
+    for packet in otherPackets:
+        if packet[0] == stream:
+            otherPackets.remove(packet)
+            return packet[1], packet[2]
+
+    # the packet length is 2 bytes (4 bytes in version 2, 4 bytes and the 4
+    # byte stream ID in version 3), then the 8 byte tag
+    lengthSize = 8 if version == 3 else 4 if version == 2 else 2
+    while True:
+        # get the packet length and tag, read in place from the buffer
+		# https://docs.python.org/2/library/struct.html
+        state = bufferData(socket, lengthSize + 8)
+        packetStream = stream
+        if version == 3:
+            packetLength, packetStream = unpack_from(">II", state[0], state[2])
+        elif version == 2:
+            packetLength = unpack_from(">I", state[0], state[2])[0]
+        else:
+            packetLength = unpack_from(">H", state[0], state[2])[0]
+        tag = text(state[1][state[2] + lengthSize:state[2] + lengthSize + 8].tobytes().rstrip(b"\0"))
+        state[2] += lengthSize + 8
+
+        # get the encapsulated data(rest of the bytes from receiveData)
+        data = receiveData(socket, packetLength - 8 - lengthSize)
+        if tag != "FILE":
+            data = text(data)
 
-    # get the tag field
-	# the 8 bytes after the packet length are the packet tag
-	# http://www.tutorialspoint.com/python/string_rstrip.htm
-    tag = receiveData(socket, 8).rstrip("\0")
+        if packetStream == stream:
+            return tag, data
+        otherPackets.append((packetStream, tag, data))
 
-    # get the encapsulated data(rest of the bytes from receiveData)
-    data = receiveData(socket, packetLength - 8 - 2)
+# -----------------------------------------------------------------------------
+# receiveBody()
+# Description: A function that receives a raw file body of a known length
+# (sent after a SIZE packet) and writes it to the output file as it arrives:
+# first what came in with the packets before it, then the rest straight from
+# the socket into the receive buffer and out to the file, with no copies.
+# Parameters: current socket endpoint to receive data, output file, number of
+# bytes in the body, CRC32 of the file bytes before it
+# Output : CRC32 of the file bytes including the body
+# -----------------------------------------------------------------------------
 
-    return tag, data
+def receiveBody(socket, outfile, bytesNumber, checksum = 0):
+    state = bufferData(socket, 0)
+    buffered = min(bytesNumber, state[3] - state[2])
+    if buffered > 0:
+        piece = bufferPiece(state, state[2], buffered)
+        outfile.write(piece)
+        checksum = zlib.crc32(piece, checksum)
+        state[2] += buffered
+        bytesNumber -= buffered
+    if bytesNumber > 0:
+        state[2] = state[3] = 0
+    while bytesNumber > 0:
+        try:
+            received = socket.recv_into(state[1], min(bytesNumber, len(state[0])))
+        except Exception as e:
+            print(e.strerror)
+            sys.exit(1)
+        # server closed the connection early
+        if received == 0:
+            print("ftclient: Connection closed during file transfer")
+            sys.exit(1)
+        piece = bufferPiece(state, 0, received)
+        outfile.write(piece)
+        checksum = zlib.crc32(piece, checksum)
+        bytesNumber -= received
+    return checksum
+
+# -----------------------------------------------------------------------------
+# receiveFilePackets()
+# Description: A function that receives the FILE packets of a file sent as it
+# is (not compressed, not multiplexed) and writes their payloads straight from
+# the receive buffer, parsing the packets in place; a payload larger than half
+# the buffer goes from the socket to the file like a raw body. It stops in
+# front of the first packet that is not a FILE packet.
+# Parameters: current socket endpoint to receive data, output file, CRC32 of
+# the file bytes before them
+# Output : (CRC32 of the file bytes including the payloads, number of bytes)
+# -----------------------------------------------------------------------------
+
+def receiveFilePackets(socket, outfile, checksum):
+    lengthSize, lengthFormat = (4, ">I") if version == 2 else (2, ">H")
+    fileTag = b"FILE".ljust(8, b"\0")
+    count = 0
+    while True:
+        state = bufferData(socket, lengthSize + 8)
+        start = state[2]
+        if state[0][start + lengthSize:start + lengthSize + 8] != fileTag:
+            return checksum, count
+        payload = unpack_from(lengthFormat, state[0], start)[0] - lengthSize - 8
+        if payload > len(state[0]) // 2:
+            state[2] += lengthSize + 8
+            checksum = receiveBody(socket, outfile, payload, checksum)
+        else:
+            state = bufferData(socket, lengthSize + 8 + payload)
+            piece = bufferPiece(state, state[2] + lengthSize + 8, payload)
+            outfile.write(piece)
+            checksum = zlib.crc32(piece, checksum)
+            state[2] += lengthSize + 8 + payload
+        count += payload
 
 # -----------------------------------------------------------------------------
 # controlConnection()
 # Description: A function that runs a control connection between the client
 # and server. Communication is initiated in the initiateContact function.
-# Parameters: socket of client side endpoint
+# Parameters: socket of client side endpoint, (tag, data) of the first command,
+# and whether more commands follow
 # Output : -1 error, 0 success
 # -----------------------------------------------------------------------------
 
-def controlConnection(controlSocket):
+def controlConnection(controlSocket, firstCommand, moreCommands):
+    global version
+    global keepOpen
+    global compressed
+
+    global dataStream
+
+    # a new session starts with version 1 packets
+    version = 1
+    keepOpen = False
+    compressed = False
+    dataStream = 0
+    del otherPackets[:]
+
     # send data port to server
-    print "  Sending client data port..."
+	# options follow the port on a new line (older servers ignore them):
+	# stream=1 lets the server send a file as one SIZE packet and the raw bytes,
+	# v=2 asks for 32 bit packet lengths and FILE payloads of chunk bytes,
+	# keep=1 asks to run more commands on the same connections,
+	# mux=1 asks for the transfers on the control connection (version 3 packets),
+	# z=deflate asks for files as deflate streams, zlevel=N at that level,
+	# sum=crc32 asks for the CRC32 of the file bytes in DONE
+    print("  Sending client data port...")
     outtag = "DPORT"
-    outdata = str(dataPort)
+    outdata = str(dataPort) + "\nv=2 chunk=" + str(chunkSize) + " sum=crc32"
+    if "no-stream" not in options:
+        outdata += " stream=1"
+    # (an upload needs the data connection)
+    if "mux" in options and putFile is None:
+        outdata += " mux=1"
+    if moreCommands:
+        outdata += " keep=1"
+    if "compress" in options:
+        outdata += " z=deflate"
+        if "level" in options:
+            outdata += " zlevel=" + options["level"]
     makeRequest(controlSocket, outtag, outdata)
 	
 	# send command to server
 	# name the tag field, 8 byte limit
-    print "  Sending user command ..."
-    outtag = "NULL"
-    outdata = ""
-    if command == "-l":
-        outtag = "LIST"
-    elif command == "-g":
-        outtag = "GET"
-        outdata = filename
+    print("  Sending user command ...")
+    outtag, outdata = firstCommand
     makeRequest(controlSocket, outtag, outdata)
+    if outtag == "DELTA":
+        sendSignatures(controlSocket, outdata)
 
     # recieve the server's response
     inTag, inData = receiveFile(controlSocket)
 
     # if server-side error, alert user
     if inTag == "ERROR":
-        print "ftclient: " + inData
+        print("ftclient: " + inData)
         return -1
+
+    # the OKAY payload lists the options the server accepted, every packet
+    # after it uses the agreed packet format
+    if "v=2" in inData.split():
+        version = 2
+    if "mux=1" in inData.split():
+        version = 3
+    keepOpen = "keep=1" in inData.split()
+    compressed = "z=deflate" in inData.split()
     return 0
 
 # -----------------------------------------------------------------------------
@@ -200,47 +582,385 @@ def controlConnection(controlSocket):
 # -----------------------------------------------------------------------------
 
 def dataConnection(controlSocket, dataSocket):
+    global dataStream
+    global rangeTotal
+    global transferErrors
     ret = 0 
 
+    # each transfer is a new stream (seen in version 3 packets only)
+    dataStream += 1
+
     # get packet(s) from the server
-    inTag, inData = receiveFile(dataSocket)
+    inTag, inData = receiveFile(dataSocket, dataStream)
 
     # if tag field indicates filename, list the filenames to transfer
 	# source for format https://docs.python.org/2/library/string.html
     if inTag == "FNAME":
-        print "ftclient: List of files on \"{0}\"".format(serverHost, serverPort)
+        print("ftclient: List of files on \"{0}\"".format(serverHost, serverPort))
 
         # print received filenames
         while inTag != "DONE":
-            print "  " + inData
-            inTag, inData = receiveFile(dataSocket)
+            print("  " + inData)
+            inTag, inData = receiveFile(dataSocket, dataStream)
 
     # if tag field indicates file, then file is being transferred
 	# source: https://docs.python.org/2/library/os.path.html
     elif inTag == "FILE":
         # Don't allow files to be overwritten.
-        filename = inData
-        if os.path.exists(filename):
-           print "ftclient: File \"{0}\" already exists!".format(filename)
+        # the file is still received (and dropped), so the next one lines up
+        # a stripe, or the rest of a resumed file, goes into the file at the
+        # offset the server confirms in the RANGE packet
+        filename = name = text(inData)
+        mode = "wb"
+        if stripeFile is not None:
+            filename = stripeFile
+            mode = "r+b"
+        elif "resume" in options and os.path.exists(filename):
+            mode = "r+b"
+        elif os.path.exists(filename):
+           print("ftclient: File \"{0}\" already exists!".format(filename))
+           filename = os.devnull
            ret = -1
 
         # write the received data to file
-        else:
-            with open(filename, "w") as outfile:
-                while inTag != "DONE":
-                    inTag, inData = receiveFile(dataSocket)
+        # (a compressed file is one deflate stream across the FILE packets)
+        inflater = zlib.decompressobj() if compressed else None
+        checksum = 0
+        received = 0
+        start = time.time()
+        # the file is written in WRITE_BATCH blocks, whatever the packet sizes
+        with io.open(filename, mode, WRITE_BATCH) as outfile:
+            while inTag != "DONE":
+                # the FILE packets of a plain file are written as they are parsed
+                if inflater is None and version != 3:
+                    checksum, count = receiveFilePackets(dataSocket, outfile, checksum)
+                    received += count
+                inTag, inData = receiveFile(dataSocket, dataStream)
+                # the server announced the length, the raw file follows
+                if inTag == "SIZE":
+                    checksum = receiveBody(dataSocket, outfile, int(inData), checksum)
+                    received += int(inData)
+                elif inTag == "RANGE":
+                    offset, length, rangeTotal = [int(n) for n in inData.split()]
+                    outfile.seek(offset)
+                elif inTag == "FILE":
+                    if inflater is not None:
+                        inData = inflater.decompress(inData)
                     outfile.write(inData)
-            print "ftclient: Success, file transfer completed!"
+                    checksum = zlib.crc32(inData, checksum)
+                    received += len(inData)
+        seconds = max(time.time() - start, 1e-6)
+
+        # DONE carries the CRC32 of the file bytes the server sent
+        if inData.startswith("crc32=") and int(inData[6:], 16) != checksum & 0xffffffff:
+            print("ftclient: Checksum mismatch, file \"{0}\" is damaged!".format(name))
+            ret = -1
+        if ret == 0:
+            print("ftclient: Success, file transfer completed!")
+            print("ftclient: {0} bytes in {1:.3f} s ({2:.1f} MB/s)".format(received, seconds, received / seconds / 1e6))
+
+    # a delta GET: FILE packets bring the bytes the local copy does not have,
+    # COPY packets ("first count") name runs of its blocks; the new file is
+    # built next to the local copy and replaces it once its checksum matches
+    elif inTag == "PATCH":
+        name = inData
+        partName = name + ".part"
+        checksum = 0
+        received = 0
+        reused = 0
+        start = time.time()
+        with io.open(name, "rb") as oldfile, io.open(partName, "wb", WRITE_BATCH) as outfile:
+            while inTag != "DONE":
+                if version != 3:
+                    checksum, count = receiveFilePackets(dataSocket, outfile, checksum)
+                    received += count
+                inTag, inData = receiveFile(dataSocket, dataStream)
+                if inTag == "FILE":
+                    outfile.write(inData)
+                    checksum = zlib.crc32(inData, checksum)
+                    received += len(inData)
+                elif inTag == "COPY":
+                    first, count = [int(n) for n in inData.split()]
+                    oldfile.seek(first * deltaBlock)
+                    left = count * deltaBlock
+                    while left > 0:
+                        piece = oldfile.read(min(left, WRITE_BATCH))
+                        # the local copy got shorter meanwhile
+                        if not piece:
+                            break
+                        outfile.write(piece)
+                        checksum = zlib.crc32(piece, checksum)
+                        reused += len(piece)
+                        left -= len(piece)
+        seconds = max(time.time() - start, 1e-6)
+
+        # DONE carries the CRC32 of the whole new file
+        if inData.startswith("crc32=") and int(inData[6:], 16) != checksum & 0xffffffff:
+            print("ftclient: Checksum mismatch, file \"{0}\" is kept as it was!".format(name))
+            os.remove(partName)
+            ret = -1
+        else:
+            os.rename(partName, name)
+            print("ftclient: Success, file \"{0}\" updated!".format(name))
+            print("ftclient: {0} bytes received, {1} bytes reused in {2:.3f} s".format(received, reused, seconds))
+
+    # a batch GET: each file is an ENTRY packet ("length name") and its raw
+    # body, written out as it arrives; DONE ends the batch
+    elif inTag == "ENTRY":
+        checksum = 0
+        received = 0
+        files = 0
+        start = time.time()
+        while inTag == "ENTRY":
+            length, _, name = inData.partition(" ")
+            length = int(length)
+            # only names in this folder, and none overwritten
+            filename = os.path.basename(name)
+            if not filename or os.path.exists(filename):
+                print("ftclient: File \"{0}\" already exists!".format(filename))
+                filename = os.devnull
+                ret = -1
+            with io.open(filename, "wb", min(WRITE_BATCH, max(length, io.DEFAULT_BUFFER_SIZE))) as outfile:
+                checksum = receiveBody(dataSocket, outfile, length, checksum)
+            received += length
+            files += 1
+            inTag, inData = receiveFile(dataSocket, dataStream)
+        seconds = max(time.time() - start, 1e-6)
+
+        # DONE carries the CRC32 of all the bodies, one after the other
+        if inData.startswith("crc32=") and int(inData[6:], 16) != checksum & 0xffffffff:
+            print("ftclient: Checksum mismatch, the batch is damaged!")
+            ret = -1
+        if ret == 0:
+            print("ftclient: Success, {0} files transferred!".format(files))
+            print("ftclient: {0} bytes in {1:.3f} s ({2:.1f} MB/s)".format(received, seconds, received / seconds / 1e6))
+
+    # a PUT: the server is ready for the file, which goes as it is (as many
+    # bytes as announced); DONE tells the CRC32 of the bytes the server wrote
+    elif inTag == "READY":
+        length = int(inData)
+        checksum = 0
+        sent = 0
+        start = time.time()
+        with io.open(putFile, "rb") as infile:
+            while sent < length:
+                piece = infile.read(min(WRITE_BATCH, length - sent))
+                # the file got shorter meanwhile, the server drops the upload
+                if not piece:
+                    break
+                try:
+                    dataSocket.sendall(piece)
+                except Exception as e:
+                    print(e.strerror)
+                    sys.exit(1)
+                checksum = zlib.crc32(piece, checksum)
+                sent += len(piece)
+        inTag, inData = receiveFile(dataSocket, dataStream)
+        seconds = max(time.time() - start, 1e-6)
+        if inTag != "DONE" or inData.startswith("crc32=") and int(inData[6:], 16) != checksum & 0xffffffff:
+            print("ftclient: Checksum mismatch, file \"{0}\" is damaged on the server!".format(putFile))
+            ret = -1
+        else:
+            print("ftclient: Success, file \"{0}\" uploaded!".format(putFile))
+            print("ftclient: {0} bytes in {1:.3f} s ({2:.1f} MB/s)".format(sent, seconds, sent / seconds / 1e6))
 
     # if we get here, something went terribly wrong
     else:
         ret = -1
 
-    # send ACK of all packets
-    makeRequest(controlSocket, "ACK", "")
+    if ret == -1:
+        transferErrors += 1
+
+    # send ACK of all packets (a kept session goes on with the next command instead)
+    if not keepOpen:
+        makeRequest(controlSocket, "ACK", "")
 
     return ret
 
+# -----------------------------------------------------------------------------
+# stripedGet()
+# Description: A function that downloads a file in parallel ranges. An empty
+# range tells the file length, the file is made at full length, and then one
+# process per stripe runs its own session (on its own data port), fetches a
+# disjoint range and writes it at its offset.
+# Parameters: filename, number of stripes
+# Output : none
+# -----------------------------------------------------------------------------
+
+def stripedGet(filename, stripes):
+    global stripeFile
+    global dataPort
+
+    # Don't allow files to be overwritten.
+    if os.path.exists(filename):
+        print("ftclient: File \"{0}\" already exists!".format(filename))
+        return
+
+    # learn the file length
+    stripeFile = os.devnull
+    initiateContact([("GET", filename + "\noffset=0 length=0")])
+    if rangeTotal is None:
+        return
+    with open(filename, "wb") as outfile:
+        outfile.truncate(rangeTotal)
+
+    # one process per stripe, each writing its range into the file
+    stripeFile = filename
+    stripeSize = (rangeTotal + stripes - 1) // stripes
+    children = []
+    for i in range(stripes):
+        offset = i * stripeSize
+        if offset >= rangeTotal and i > 0:
+            break
+        pid = os.fork()
+        if pid == 0:
+            dataPort += i + 1
+            initiateContact([("GET", filename + "\noffset={0} length={1}".format(offset, stripeSize))])
+            os._exit(1 if transferErrors else 0)
+        children.append(pid)
+
+    # the file is complete once every stripe is
+    failed = 0
+    for pid in children:
+        if os.waitpid(pid, 0)[1] != 0:
+            failed += 1
+    if failed:
+        print("ftclient: {0} of {1} stripes failed".format(failed, len(children)))
+    else:
+        print("ftclient: Success, {0} bytes in {1} stripes!".format(rangeTotal, len(children)))
+    stripeFile = None
+
+# -----------------------------------------------------------------------------
+# uploadFile()
+# Description: A function that sends a local file to the server in a session
+# of its own. The server stores it under its name (without the folders) once
+# all of it came in, replacing a file of that name.
+# Parameters: local path of the file
+# Output : none
+# -----------------------------------------------------------------------------
+
+def uploadFile(path):
+    global putFile
+
+    if not os.path.isfile(path):
+        print("ftclient: File \"{0}\" does not exist!".format(path))
+        return
+    putFile = path
+    initiateContact([("PUT", os.path.basename(path) + "\nsize=" + str(os.path.getsize(path)))])
+    putFile = None
+
+# -----------------------------------------------------------------------------
+# showStats()
+# Description: A function that asks the server for its statistics (sessions,
+# bytes sent, cache hits, latency percentiles) and prints them. The reply comes
+# on the control connection, there is no data connection.
+# Parameters: none
+# Output : none
+# -----------------------------------------------------------------------------
+
+def showStats():
+    global version
+    version = 1
+
+    try:
+        controlSocket = socket(AF_INET, SOCK_STREAM, 0)
+        controlSocket.connect((serverHost, serverPort))
+    except Exception as e:
+        print(e.strerror)
+        sys.exit(1)
+
+    makeRequest(controlSocket, "DPORT", str(dataPort))
+    makeRequest(controlSocket, "STATS", "")
+    inTag, inData = receiveFile(controlSocket)
+    # an older server does not know the command
+    if inTag == "STATS":
+        print("ftclient: Statistics of \"{0}\"".format(serverHost))
+        for line in inData.splitlines():
+            print("  " + line)
+        receiveReplies(controlSocket, "CLOSE")
+    else:
+        print("ftclient: " + inData)
+
+    # the receive buffers go with the sockets
+    receiveBuffers.clear()
+    try:
+        controlSocket.close()
+    except Exception as e:
+        print(e.strerror)
+        sys.exit(1)
+
+# -----------------------------------------------------------------------------
+# receiveReplies()
+# Description: A function that receives control packets up to the one that
+# ends a command (NEXT in a kept session) or the session (CLOSE), and prints
+# the server errors on the way.
+# Parameters: socket of client side endpoint, tag to wait for
+# Output : none
+# -----------------------------------------------------------------------------
+
+def receiveReplies(controlSocket, lastTag):
+    while True:
+        inTag, inData = receiveFile(controlSocket)
+        if inTag == "ERROR":
+            print("ftclient: " + inData)
+        if inTag == lastTag or inTag == "CLOSE":
+            break
+
+# -----------------------------------------------------------------------------
+# sendSignatures()
+# Description: A function that sends the signatures of the whole blocks of the
+# local copy of a delta GET, in file order: the adler32 (weak, the server rolls
+# it along its file) and the CRC32 (strong, confirms a match) of each block,
+# SIGNATURES_PER_PACKET of them to a SIGS packet, all in one send.
+# Parameters: socket of client side endpoint, DELTA payload (filename, then
+# the block size and number of blocks)
+# Output : none
+# -----------------------------------------------------------------------------
+
+def sendSignatures(controlSocket, payload):
+    global deltaBlock
+    filename, _, blockOptions = payload.partition("\n")
+    blockOptions = dict(option.split("=") for option in blockOptions.split())
+    deltaBlock = int(blockOptions["block"])
+    blocks = int(blockOptions["blocks"])
+
+    packets = []
+    signatures = []
+    with io.open(filename, "rb", WRITE_BATCH) as infile:
+        for i in range(blocks):
+            block = infile.read(deltaBlock)
+            signatures.append(pack(">II", zlib.adler32(block) & 0xffffffff, zlib.crc32(block) & 0xffffffff))
+            if len(signatures) == SIGNATURES_PER_PACKET or i == blocks - 1:
+                packets.append(makePacket("SIGS", b"".join(signatures)))
+                signatures = []
+    try:
+        controlSocket.sendall(b"".join(packets))
+    except Exception as e:
+        print(e.strerror)
+        sys.exit(1)
+
+# -----------------------------------------------------------------------------
+# makePacket()
+# Description: A function that builds a packet in the current packet format.
+# Parameters: tag field and the data
+# Output : the packet bytes
+# -----------------------------------------------------------------------------
+
+def makePacket(tag, data):
+    # calculate the packet length, data + tag(8 bytes) + length bytes(2 bytes,
+    # or 4 bytes in version 2, 4 bytes and the control stream ID in version 3)
+    # construct the packet
+	# sources: https://docs.python.org/2/library/struct.html
+	# http://www.tutorialspoint.com/python/string_ljust.htm
+    data = raw(data)
+    if version == 3:
+        packet = pack(">II", 4 + 4 + 8 + len(data), 0)
+    elif version == 2:
+        packet = pack(">I", 4 + 8 + len(data))
+    else:
+        packet = pack(">H", 2 + 8 + len(data))
+    return packet + raw(tag.ljust(8, "\0")) + data
+
 # -----------------------------------------------------------------------------
 # makeRequest()
 # Description: A function that makes a data or connection request from the client 
@@ -251,107 +971,128 @@ def dataConnection(controlSocket, dataSocket):
 # -----------------------------------------------------------------------------
 
 def makeRequest(socket, tag = "", data = ""):
-    # calculate the packet length, data + tag(8 bytes) + length bytes(2 bytes)
-    packetLength = 2 + 8 + len(data)
-
-    # construct the packet
-	# sources: https://docs.python.org/2/library/struct.html
-	# http://www.tutorialspoint.com/python/string_ljust.htm
-    packet = pack(">H", packetLength)
-    packet += tag.ljust(8, "\0")
-    packet += data
+    packet = makePacket(tag, data)
 
     # send packet to server
 	# https://docs.python.org/2/tutorial/errors.html
     try:
         socket.sendall(packet)
     except Exception as e:
-        print e.strerror
+        print(e.strerror)
         sys.exit(1)
 
 
 # -----------------------------------------------------------------------------
 # initiateContact()
 # Description: A function that initiates and establishes the FTP connection
-# between the client and server.Invoked in the main function.
-# Parameters: none
-# Output : none
+# between the client and server.Invoked in the main function. When the server
+# keeps the session open, all the commands run on it: they are sent ahead
+# (up to PIPELINE_WINDOW at a time) and their transfers follow one another on
+# the same data connection.
+# Parameters: list of (tag, data) commands
+# Output : the commands left for another session (an older server runs one)
 # -----------------------------------------------------------------------------
 
-def initiateContact():
+def initiateContact(commands):
     # create client-side endpoint of control connection
     try:
         controlSocket = socket(AF_INET, SOCK_STREAM, 0)
     except Exception as e:
-        print e.strerror
+        print(e.strerror)
         sys.exit(1)
 
     # establish FTP control connection
     try:
         controlSocket.connect((serverHost, serverPort))
     except Exception as e:
-        print e.strerror
+        print(e.strerror)
         sys.exit(1)
     print ("ftclient: Control connection established with " +
            "\"{0}\"".format(serverHost, serverPort)          )
 
-    # run the FTP control connection
-    status = controlConnection(controlSocket)
-
-   # if control returns with success 0, start data connection
-   # build client-side socket
-    if status != -1:
-        try:
-            clientSocket = socket(AF_INET, SOCK_STREAM, 0)
-        except Exception as e:
-            print e.strerror
-            sys.exit(1)
+    # build client-side socket, listening before DPORT names its port, so the
+    # server's connect back finds it at once
+    try:
+        clientSocket = socket(AF_INET, SOCK_STREAM, 0)
+    except Exception as e:
+        print(e.strerror)
+        sys.exit(1)
 
-        # attach client-side socket to given data port
+    # attach client-side socket to given data port
 		# source for below: https://docs.python.org/2/library/socket.html
-        try:
-            clientSocket.setsockopt(SOL_SOCKET, SO_REUSEADDR, 1)
-            clientSocket.bind(("", dataPort))
-        except Exception as e:
-            print e.strerror
-            sys.exit(1)
+    try:
+        clientSocket.setsockopt(SOL_SOCKET, SO_REUSEADDR, 1)
+        clientSocket.bind(("", dataPort))
+    except Exception as e:
+        print(e.strerror)
+        sys.exit(1)
 
-        # listen for connections
+    # listen for connections
 		# set the max number to listen for to 5 (random choice)
-        try:
-            clientSocket.listen(5)
-        except Exception as e:
-            print e.strerror
-            sys.exit(1)
+    try:
+        clientSocket.listen(5)
+    except Exception as e:
+        print(e.strerror)
+        sys.exit(1)
+
+    # run the FTP control connection
+    status = controlConnection(controlSocket, commands[0], len(commands) > 1)
+    left = commands[1:]
 
+    # multiplexed: no data connection, the transfers come on the control connection
+    if status != -1 and version == 3:
+        dataSocket = controlSocket
+        print("ftclient: Transfers multiplexed on the control connection")
+
+   # if control returns with success 0, start data connection
+    elif status != -1:
         # run FTP data connection
 		# source for below: http://stackoverflow.com/questions/12454675/whats-the-return-value-of-socket-accept-in-python
         try:
             dataSocket = clientSocket.accept()[0]
         except Exception as e:
-            print e.strerror
+            print(e.strerror)
             sys.exit(1)
         print ("ftclient: Data connection established with " +
                "\"{0}\"".format(serverHost)                       )
 
+    # the data connection is open (or not needed), stop listening
+    clientSocket.close()
+
+    if status != -1:
+        # send the next commands ahead, QUIT after the last one
+        if keepOpen:
+            pending = left + [("QUIT", "")]
+            for outtag, outdata in pending[:PIPELINE_WINDOW]:
+                makeRequest(controlSocket, outtag, outdata)
+            pending = pending[PIPELINE_WINDOW:]
+            for i in range(len(left)):
+                # transfer file data over FTP data connection
+                dataConnection(controlSocket, dataSocket)
+                receiveReplies(controlSocket, "NEXT")
+                if pending:
+                    makeRequest(controlSocket, pending[0][0], pending[0][1])
+                    pending = pending[1:]
+            left = []
+
         # transfer file data over FTP data connection
         dataConnection(controlSocket, dataSocket)
 
         # print error messages from control connection
-        while True:
-            inTag, inData = receiveFile(controlSocket)
-            if inTag == "ERROR":
-                print "ftclient: " + inData
-            if inTag == "CLOSE":
-                break
+        receiveReplies(controlSocket, "NEXT" if keepOpen else "CLOSE")
+        if keepOpen:
+            receiveReplies(controlSocket, "CLOSE")
 
     # client must close the connection
+    # the receive buffers go with the sockets
+    receiveBuffers.clear()
     try:
         controlSocket.close()
     except Exception as e:
-        print e.strerror
+        print(e.strerror)
         sys.exit(1)
-    print "ftclient: File transfer connections closed, have a nice day!"
+    print("ftclient: File transfer connections closed, have a nice day!")
+    return left
 
 
 # Define script point of entry.
@@ -0,0 +1,1206 @@
+/******************************************************************************************
+** Load generator																  ftbench.c
+** Description: A benchmark client for ftserver. It runs many simulated clients at once,
+** each on its own thread, sending a mix of LIST and GET commands with the same tag/length
+** packets as ftclient.py, one session per command. At the end it reports the commands per
+** second, the bytes per second, the latency percentiles and the CPU time per GB of the
+** client and of the server. It also makes synthetic directories of files to serve, and can
+** start the server itself, so that "make bench" gives the same numbers on every run.
+** Go to sources: (detailed citing within program):
+** http://beej.us/guide/bgnet/output/html/multipage/index.html
+** http://hdrhistogram.org/
+******************************************************************************************/
+
+// accept4(), the CPU time of other processes and the other Linux extensions used below
+#define _GNU_SOURCE
+
+#include <assert.h>
+
+#include <errno.h>
+
+#include <fcntl.h>
+
+#include <getopt.h>
+
+#include <netdb.h>
+
+#include <poll.h>
+
+#include <pthread.h>
+
+#include <signal.h>
+
+#include <stdio.h>
+
+#include <stdlib.h>
+
+#include <string.h>
+
+#include <sys/resource.h>
+
+#include <sys/socket.h>
+
+#include <sys/stat.h>
+
+#include <sys/wait.h>
+
+#include <time.h>
+
+#include <unistd.h>
+
+#include <netinet/in.h>
+
+#include <netinet/tcp.h>
+
+#include <arpa/inet.h>
+
+#include <zlib.h>
+
+/************************************ Constants *****************************************/
+
+// packet header: length field (2 bytes in version 1, 4 bytes after "v=2"),
+// stream ID (version 3, after "mux=1") and the tag
+#define PACKET_SIZE           2
+#define PACKET_SIZE_V2        4
+#define STREAM_ID_LENGTH      4
+#define TAG_LENGTH            8
+// the DPORT and command payloads
+#define PAYLOAD_LENGTH      512
+#define DEFAULT_CHUNK_SIZE 65536
+// bytes read from a socket at once, fewer while the link is throttled
+#define READ_BUFFER_SIZE  262144
+#define THROTTLED_READ     16384
+// inflated bytes of a compressed FILE payload, a piece at a time
+#define INFLATE_BUFFER_SIZE 262144
+// a server that stops answering fails the command after this long
+#define TIMEOUT_SECONDS      10
+#define DEFAULT_CLIENTS       8
+#define DEFAULT_REQUESTS    100
+#define DEFAULT_LIST_PERCENT 10
+// sizes of the synthetic files, when -s is not given
+#define DEFAULT_FILE_COUNT   64
+#define MAX_FILE_SIZES       16
+// client counts -c runs one after the other
+#define MAX_CLIENT_COUNTS    16
+// the server gets this long to start listening
+#define SERVER_START_MS    5000
+
+/******************************** Data Structures ****************************************/
+
+// commands a simulated client sends
+enum commandType { LIST_COMMAND, GET_COMMAND };
+
+// buffered input from one socket, with the bytes received so far (the wire
+// bytes); a throttled reader paces its reads to rate bytes per second
+struct reader {
+	int socket;
+	char *buffer;
+	int start, end;
+	long long received;
+	long long rate;
+	long long startTime;
+};
+
+// one finished command: what it was, when its first packet came and when it ended
+struct sample {
+	enum commandType type;
+	long long firstByte;
+	long long latency;
+};
+
+// one simulated client, run by its own thread
+struct client {
+	int index;
+	pthread_t thread;
+	// random number state, seeded with the client number so runs repeat
+	unsigned long long seed;
+	// listening socket the server connects the data connections to, and its port
+	int listener;
+	int dataPort;
+	// packet payloads, and the inflated bytes of compressed files
+	char *payload;
+	int payloadSize;
+	char *inflated;
+	// the commands run, and the bytes they moved
+	struct sample *samples;
+	int numberSamples, samplesSize;
+	long long errors;
+	long long fileBytes;
+	long long wireBytes;
+};
+
+// benchmark settings from the command line
+struct settings {
+	char *host;
+	int port;
+	struct sockaddr_in serverAddress;
+	// clients of the current run, from the counts of -c (e.g. "1,4,16") that
+	// are run one after the other against the same server
+	int clients;
+	int clientCounts[MAX_CLIENT_COUNTS];
+	int numberCounts;
+	// commands per client, or the seconds to run for (0 counts commands)
+	int requests;
+	int seconds;
+	int listPercent;
+	// DPORT options: transfers on the control connection, deflate level (0 none),
+	// FILE payload size, and the CRC32 in DONE checked against the bytes received
+	int mux;
+	int compressLevel;
+	int chunkSize;
+	int verify;
+	// bytes per second each client reads at most, 0 for no limit
+	long long rate;
+	// server command to start in serverDir (-S and -D), or the pid of a running one (-P)
+	char *serverCommand;
+	char *serverDir;
+	pid_t serverPid;
+	// synthetic files made by -G: count, sizes (one after the other) and text content
+	char *generateDir;
+	int fileCount;
+	long long fileSizes[MAX_FILE_SIZES];
+	int numberSizes;
+	int textFiles;
+};
+
+// settings are set in main() and only read afterwards
+struct settings settings;
+// the files the server lists, picked at random by each GET
+char **fileNames;
+int numberNames;
+// the clients wait for each other, and start at once
+pthread_barrier_t startBarrier;
+
+/***************************** Function Declarations *************************************/
+
+int isNumber(char *str, int *n);
+long long parseSize(char *str);
+long long currentMicros(void);
+unsigned long long nextRandom(unsigned long long *seed);
+void generateFiles(void);
+double processSeconds(pid_t pid);
+void startServer(void);
+void stopServer(void);
+int openDataListener(struct client *client);
+int connectServer(void);
+int sendPacket(int socket, int version, char *tag, char *data, int dataLength);
+int fillReader(struct reader *reader);
+int takeBytes(struct reader *reader, char **data, long long count);
+int readBytes(struct reader *reader, char *data, int count);
+int receivePacket(struct reader *reader, int version, char *tag, struct client *client, int *dataLength, unsigned int *stream);
+int receiveBody(struct reader *reader, long long count, struct client *client, uLong *checksum);
+int inflatePayload(z_stream *inflater, struct client *client, int length, uLong *checksum);
+int runCommand(struct client *client, enum commandType type, char *name, int collectNames);
+void *runClient(void *arg);
+int compareLatency(const void *a, const void *b);
+int compareFirstByte(const void *a, const void *b);
+void printPercentiles(char *label, struct sample *samples, int numberSamples, int firstByte);
+void runBenchmark(double *commandRate, double *fileRate);
+
+/********************************** Main Function ****************************************/
+
+int main(int argc, char **argv){
+	int option;
+	char *size, *next;
+	struct addrinfo hints, *found;
+	double commandRates[MAX_CLIENT_COUNTS], fileRates[MAX_CLIENT_COUNTS];
+	settings.clientCounts[0] = DEFAULT_CLIENTS;
+	settings.numberCounts = 1;
+	settings.requests = DEFAULT_REQUESTS;
+	settings.listPercent = DEFAULT_LIST_PERCENT;
+	settings.chunkSize = DEFAULT_CHUNK_SIZE;
+	settings.fileCount = DEFAULT_FILE_COUNT;
+	// read the options in front of the host and port
+	// source: https://www.gnu.org/software/libc/manual/html_node/Using-Getopt.html
+	while ((option = getopt(argc, argv, "c:n:d:l:mz:k:r:VS:D:P:G:f:s:T")) != -1) {
+		switch (option) {
+		case 'c':
+			// client counts are given as a list, e.g. "1,4,16"
+			settings.numberCounts = 0;
+			for (size = strtok_r(optarg, ",", &next); size != NULL; size = strtok_r(NULL, ",", &next)) {
+				if (settings.numberCounts == MAX_CLIENT_COUNTS || !isNumber(size, &settings.clientCounts[settings.numberCounts]) ||
+					settings.clientCounts[settings.numberCounts++] < 1) {
+					fprintf(stderr, "ftbench: Clients must be up to %d positive numbers!\n", MAX_CLIENT_COUNTS);
+					exit(1);
+				}
+			}
+			if (settings.numberCounts == 0) {
+				fprintf(stderr, "ftbench: Clients must be up to %d positive numbers!\n", MAX_CLIENT_COUNTS);
+				exit(1);
+			}
+			break;
+		case 'n':
+			if (!isNumber(optarg, &settings.requests) || settings.requests < 1) {
+				fprintf(stderr, "ftbench: Commands must be a positive number!\n");
+				exit(1);
+			}
+			break;
+		case 'd':
+			if (!isNumber(optarg, &settings.seconds) || settings.seconds < 1) {
+				fprintf(stderr, "ftbench: Duration must be a positive number of seconds!\n");
+				exit(1);
+			}
+			break;
+		case 'l':
+			if (!isNumber(optarg, &settings.listPercent) || settings.listPercent > 100) {
+				fprintf(stderr, "ftbench: LIST share must be a percentage!\n");
+				exit(1);
+			}
+			break;
+		case 'm':
+			settings.mux = 1;
+			break;
+		case 'z':
+			if (!isNumber(optarg, &settings.compressLevel) || settings.compressLevel < 1 || settings.compressLevel > 9) {
+				fprintf(stderr, "ftbench: Compression level must be a number from 1 to 9!\n");
+				exit(1);
+			}
+			break;
+		case 'k':
+			if ((settings.chunkSize = parseSize(optarg)) < 1) {
+				fprintf(stderr, "ftbench: Chunk size must be a positive size!\n");
+				exit(1);
+			}
+			break;
+		case 'r':
+			if ((settings.rate = parseSize(optarg)) < 1) {
+				fprintf(stderr, "ftbench: Rate must be a positive number of bytes per second!\n");
+				exit(1);
+			}
+			break;
+		case 'V':
+			settings.verify = 1;
+			break;
+		case 'S':
+			settings.serverCommand = optarg;
+			break;
+		case 'D':
+			settings.serverDir = optarg;
+			break;
+		case 'P':
+			settings.serverPid = atoi(optarg);
+			break;
+		case 'G':
+			settings.generateDir = optarg;
+			break;
+		case 'f':
+			if (!isNumber(optarg, &settings.fileCount) || settings.fileCount < 1) {
+				fprintf(stderr, "ftbench: File count must be a positive number!\n");
+				exit(1);
+			}
+			break;
+		case 's':
+			// sizes are given as a list, e.g. "4k,64k,1m"
+			settings.numberSizes = 0;
+			for (size = strtok_r(optarg, ",", &next); size != NULL; size = strtok_r(NULL, ",", &next)) {
+				if (settings.numberSizes == MAX_FILE_SIZES || (settings.fileSizes[settings.numberSizes++] = parseSize(size)) < 0) {
+					fprintf(stderr, "ftbench: File sizes must be up to %d sizes!\n", MAX_FILE_SIZES);
+					exit(1);
+				}
+			}
+			break;
+		case 'T':
+			settings.textFiles = 1;
+			break;
+		default:
+			fprintf(stderr, "Error: Use ftbench [-c <clients>,...] [-n <commands> | -d <seconds>] [-l <list-percent>] [-m] "
+				"[-z <level>] [-k <chunk>] [-r <bytes-per-second>] [-V] [-S <server-command> [-D <dir>] | -P <pid>] "
+				"<server-host> <server-port>\n"
+				"    or ftbench -G <dir> [-f <count>] [-s <size>,...] [-T]\n");
+			exit(1);
+		}
+	}
+	// make the files to serve, and nothing else
+	if (settings.generateDir != NULL) {
+		generateFiles();
+		exit(0);
+	}
+	if (optind != argc - 2) {
+		fprintf(stderr, "Error: Use ftbench [options] <server-host> <server-port>\n");
+		exit(1);
+	}
+	settings.host = argv[optind];
+	if (!isNumber(argv[optind + 1], &settings.port)) {
+		fprintf(stderr, "ftbench: Server port must be a number!\n");
+		exit(1);
+	}
+	// look up the server once, every session connects to the same address
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(settings.host, NULL, &hints, &found) != 0) {
+		fprintf(stderr, "ftbench: Cannot find host \"%s\"\n", settings.host);
+		exit(1);
+	}
+	settings.serverAddress = *(struct sockaddr_in *) found->ai_addr;
+	settings.serverAddress.sin_port = htons(settings.port);
+	freeaddrinfo(found);
+	// a client that hangs up must not stop the benchmark with SIGPIPE
+	signal(SIGPIPE, SIG_IGN);
+	if (settings.serverCommand != NULL) {
+		startServer();
+	}
+	for (int i = 0; i < settings.numberCounts; i++) {
+		settings.clients = settings.clientCounts[i];
+		runBenchmark(&commandRates[i], &fileRates[i]);
+	}
+	// the aggregate throughput at each client count, against the first
+	if (settings.numberCounts > 1) {
+		printf("ftbench: scaling with clients\n");
+		for (int i = 0; i < settings.numberCounts; i++) {
+			printf("  %d clients: %.1f commands/s, %.3f GB/s of files (x%.2f)\n", settings.clientCounts[i],
+				commandRates[i], fileRates[i], commandRates[0] > 0 ? commandRates[i] / commandRates[0] : 0.0);
+		}
+	}
+	if (settings.serverCommand != NULL) {
+		stopServer();
+	}
+	exit(0);
+}
+
+/****************************** Function Definitions ************************************/
+
+/******************************************************************************
+** isNumber()
+** Description: A function that determines if the input string contains only
+** digits, and converts it.
+** Parameters: string, number (set)
+** Output: 1 a number, 0 not a number
+******************************************************************************/
+int isNumber(char *str, int *n){
+	if (*str == '\0' || strspn(str, "0123456789") != strlen(str)) {
+		return 0;
+	}
+	*n = atoi(str);
+	return 1;
+}
+
+/******************************************************************************
+** parseSize()
+** Description: A function that reads a number of bytes, with an optional k,
+** m or g suffix (KiB, MiB, GiB), e.g. "64k".
+** Parameters: string
+** Output: number of bytes, -1 when it is not a size
+******************************************************************************/
+long long parseSize(char *str){
+	char *end;
+	long long size = strtoll(str, &end, 10);
+	if (end == str || size < 0) {
+		return -1;
+	}
+	switch (*end) {
+	case 'k': case 'K': size <<= 10; end++; break;
+	case 'm': case 'M': size <<= 20; end++; break;
+	case 'g': case 'G': size <<= 30; end++; break;
+	}
+	return *end == '\0' ? size : -1;
+}
+
+/******************************************************************************
+** currentMicros()
+** Description: A function that reads the monotonic clock in microseconds.
+** Parameters: none
+** Output: microseconds since an arbitrary fixed point
+** Source: http://man7.org/linux/man-pages/man2/clock_gettime.2.html
+******************************************************************************/
+long long currentMicros(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/******************************************************************************
+** nextRandom()
+** Description: A function that steps a xorshift64* random number generator.
+** The same seed gives the same numbers, so runs send the same commands.
+** Parameters: generator state
+** Output: next random number
+** Source: https://en.wikipedia.org/wiki/Xorshift#xorshift*
+******************************************************************************/
+unsigned long long nextRandom(unsigned long long *seed){
+	*seed ^= *seed >> 12;
+	*seed ^= *seed << 25;
+	*seed ^= *seed >> 27;
+	return *seed * 0x2545F4914F6CDD1DULL;
+}
+
+/******************************************************************************
+** generateFiles()
+** Description: A function that makes the synthetic files of -G: -f files,
+** taking their sizes from the -s list in turn, filled with random bytes or,
+** with -T, with random words (text that compresses about as well as prose).
+** The content only depends on the file number, and a file that is already
+** there with the right size is kept, so the same command makes the same
+** directory.
+** Parameters: none, the directory, count and sizes are in settings
+** Output: none
+******************************************************************************/
+void generateFiles(void){
+	static const char *words[] = { "the", "file", "server", "sends", "a", "packet", "to", "each", "client",
+		"over", "data", "connection", "and", "waits", "for", "an", "ack", "of", "transfer", "list" };
+	char name[4096];
+	char buffer[65536];
+	struct stat info;
+	if (settings.numberSizes == 0) {
+		settings.fileSizes[0] = 65536;
+		settings.numberSizes = 1;
+	}
+	if (mkdir(settings.generateDir, 0755) == -1 && errno != EEXIST) {
+		perror("mkdir");
+		exit(1);
+	}
+	for (int i = 0; i < settings.fileCount; i++) {
+		long long size = settings.fileSizes[i % settings.numberSizes];
+		unsigned long long seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+		FILE *outfile;
+		snprintf(name, sizeof(name), "%s/file-%04d.%s", settings.generateDir, i, settings.textFiles ? "txt" : "dat");
+		if (stat(name, &info) == 0 && info.st_size == size) {
+			continue;
+		}
+		outfile = fopen(name, "w");
+		if (outfile == NULL) {
+			perror(name);
+			exit(1);
+		}
+		for (long long written = 0; written < size; ) {
+			int length = 0;
+			if (settings.textFiles) {
+				// words up to the end of the buffer, a line break now and then
+				while (length < (int) sizeof(buffer) - 16) {
+					unsigned long long pick = nextRandom(&seed);
+					length += sprintf(buffer + length, "%s%c", words[pick % 20], pick % 11 == 0 ? '\n' : ' ');
+				}
+			}
+			else {
+				for (; length < (int) sizeof(buffer); length += sizeof(unsigned long long)) {
+					unsigned long long random = nextRandom(&seed);
+					memcpy(buffer + length, &random, sizeof(random));
+				}
+			}
+			if (length > size - written) {
+				length = size - written;
+			}
+			if (fwrite(buffer, 1, length, outfile) != (size_t) length) {
+				perror("fwrite");
+				exit(1);
+			}
+			written += length;
+		}
+		fclose(outfile);
+	}
+	printf("ftbench: %d files in \"%s\"\n", settings.fileCount, settings.generateDir);
+}
+
+/******************************************************************************
+** processSeconds()
+** Description: A function that reads the CPU time (user and system) a process
+** has used so far, from /proc.
+** Parameters: process ID, 0 for this process
+** Output: seconds of CPU time, -1 when it cannot be read
+** Source: http://man7.org/linux/man-pages/man5/proc.5.html
+******************************************************************************/
+double processSeconds(pid_t pid){
+	char path[64];
+	char stat[1024];
+	char *fields;
+	unsigned long userTicks, systemTicks;
+	FILE *infile;
+	size_t length;
+	if (pid == 0) {
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+	}
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+	infile = fopen(path, "r");
+	if (infile == NULL) {
+		return -1;
+	}
+	length = fread(stat, 1, sizeof(stat) - 1, infile);
+	fclose(infile);
+	stat[length] = '\0';
+	// the fields after the command name (which may hold spaces); utime and
+	// stime are the 12th and 13th of them
+	fields = strrchr(stat, ')');
+	if (fields == NULL || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+		&userTicks, &systemTicks) != 2) {
+		return -1;
+	}
+	return (double) (userTicks + systemTicks) / sysconf(_SC_CLK_TCK);
+}
+
+/******************************************************************************
+** startServer()
+** Description: A function that starts the server of -S in the directory of
+** -D, on the benchmark port, with its output thrown away, and waits until it
+** accepts connections.
+** Parameters: none, the command, directory and port are in settings
+** Output: none
+******************************************************************************/
+void startServer(void){
+	char *args[64];
+	char port[16];
+	char *word, *next;
+	int numberArgs = 0;
+	pid_t pid;
+	// the command is split at spaces, the port goes last
+	for (word = strtok_r(settings.serverCommand, " ", &next); word != NULL && numberArgs < 62;
+		word = strtok_r(NULL, " ", &next)) {
+		args[numberArgs++] = word;
+	}
+	snprintf(port, sizeof(port), "%d", settings.port);
+	args[numberArgs++] = port;
+	args[numberArgs] = NULL;
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		int devNull = open("/dev/null", O_WRONLY);
+		if (settings.serverDir != NULL && chdir(settings.serverDir) == -1) {
+			perror(settings.serverDir);
+			_exit(1);
+		}
+		dup2(devNull, STDOUT_FILENO);
+		execvp(args[0], args);
+		perror(args[0]);
+		_exit(1);
+	}
+	settings.serverPid = pid;
+	// the server is up once a connection goes through
+	for (long long deadline = currentMicros() + SERVER_START_MS * 1000LL; ; ) {
+		int probe = connectServer();
+		if (probe != -1) {
+			close(probe);
+			return;
+		}
+		if (currentMicros() > deadline || waitpid(pid, NULL, WNOHANG) == pid) {
+			fprintf(stderr, "ftbench: Server \"%s\" did not start\n", args[0]);
+			exit(1);
+		}
+		usleep(10000);
+	}
+}
+
+/******************************************************************************
+** stopServer()
+** Description: A function that stops the server started by startServer(),
+** with the interrupt signal it expects.
+** Parameters: none
+** Output: none
+******************************************************************************/
+void stopServer(void){
+	kill(settings.serverPid, SIGINT);
+	waitpid(settings.serverPid, NULL, 0);
+}
+
+/******************************************************************************
+** openDataListener()
+** Description: A function that opens the socket a client listens on for its
+** data connections, on a port the kernel picks. It is opened again after a
+** failed command, so that a late connection from the server cannot be taken
+** for the next command's.
+** Parameters: simulated client
+** Output: 0 success, -1 error
+******************************************************************************/
+int openDataListener(struct client *client){
+	struct sockaddr_in address;
+	socklen_t length = sizeof(address);
+	if (client->listener != -1) {
+		close(client->listener);
+	}
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = INADDR_ANY;
+	client->listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (client->listener == -1 || bind(client->listener, (struct sockaddr *) &address, sizeof(address)) == -1 ||
+		listen(client->listener, 4) == -1 || getsockname(client->listener, (struct sockaddr *) &address, &length) == -1) {
+		perror("data listener");
+		return -1;
+	}
+	client->dataPort = ntohs(address.sin_port);
+	return 0;
+}
+
+/******************************************************************************
+** connectServer()
+** Description: A function that opens a control connection to the server, with
+** Nagle's algorithm off (commands are small and answered at once) and a
+** receive timeout, so a stuck server fails the command instead of the run.
+** Parameters: none, the server address is in settings
+** Output: socket, -1 error
+******************************************************************************/
+int connectServer(void){
+	int optionValue = 1;
+	struct timeval timeout = { TIMEOUT_SECONDS, 0 };
+	int controlSocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (controlSocket == -1) {
+		return -1;
+	}
+	if (connect(controlSocket, (struct sockaddr *) &settings.serverAddress, sizeof(settings.serverAddress)) == -1) {
+		close(controlSocket);
+		return -1;
+	}
+	setsockopt(controlSocket, IPPROTO_TCP, TCP_NODELAY, &optionValue, sizeof(optionValue));
+	setsockopt(controlSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	return controlSocket;
+}
+
+/******************************************************************************
+** sendPacket()
+** Description: A function that sends one packet: the length field (16 bit in
+** version 1, 32 bit after "v=2", and the control stream ID 0 after "mux=1"),
+** the tag padded to 8 bytes, and the payload.
+** Parameters: socket, packet version, tag, payload and its length
+** Output: 0 success, -1 error
+******************************************************************************/
+int sendPacket(int socket, int version, char *tag, char *data, int dataLength){
+	char packet[PACKET_SIZE_V2 + STREAM_ID_LENGTH + TAG_LENGTH + PAYLOAD_LENGTH];
+	int header = version == 3 ? PACKET_SIZE_V2 + STREAM_ID_LENGTH + TAG_LENGTH :
+		version == 2 ? PACKET_SIZE_V2 + TAG_LENGTH : PACKET_SIZE + TAG_LENGTH;
+	if (version >= 2) {
+		unsigned int length = htonl(header + dataLength);
+		memcpy(packet, &length, PACKET_SIZE_V2);
+		memset(packet + PACKET_SIZE_V2, 0, version == 3 ? STREAM_ID_LENGTH : 0);
+	}
+	else {
+		unsigned short length = htons(header + dataLength);
+		memcpy(packet, &length, PACKET_SIZE);
+	}
+	memset(packet + header - TAG_LENGTH, '\0', TAG_LENGTH);
+	strncpy(packet + header - TAG_LENGTH, tag, TAG_LENGTH);
+	memcpy(packet + header, data, dataLength);
+	return send(socket, packet, header + dataLength, MSG_NOSIGNAL) == header + dataLength ? 0 : -1;
+}
+
+/******************************************************************************
+** fillReader()
+** Description: A function that receives the next bytes of a socket into its
+** (empty) reader buffer. A throttled reader receives small pieces and sleeps
+** until its average rate is back to the limit; the socket buffers fill up and
+** TCP slows the server down, as a slow link would.
+** Parameters: reader
+** Output: number of bytes received, 0 the connection was closed, -1 error
+******************************************************************************/
+int fillReader(struct reader *reader){
+	int count = reader->rate ? THROTTLED_READ : READ_BUFFER_SIZE;
+	int received = recv(reader->socket, reader->buffer, count, 0);
+	if (received <= 0) {
+		return received;
+	}
+	reader->start = 0;
+	reader->end = received;
+	reader->received += received;
+	if (reader->rate) {
+		long long due = reader->startTime + reader->received * 1000000 / reader->rate;
+		long long now = currentMicros();
+		if (due > now) {
+			usleep(due - now);
+		}
+	}
+	return received;
+}
+
+/******************************************************************************
+** takeBytes()
+** Description: A function that gives the next received bytes of a reader, at
+** most count of them, without copying them.
+** Parameters: reader, start of the bytes (set), largest number of bytes
+** Output: number of bytes, -1 the connection failed or closed
+******************************************************************************/
+int takeBytes(struct reader *reader, char **data, long long count){
+	int length;
+	if (reader->start == reader->end && fillReader(reader) <= 0) {
+		return -1;
+	}
+	length = reader->end - reader->start;
+	if (length > count) {
+		length = count;
+	}
+	*data = reader->buffer + reader->start;
+	reader->start += length;
+	return length;
+}
+
+/******************************************************************************
+** readBytes()
+** Description: A function that copies the next count received bytes.
+** Parameters: reader, destination, number of bytes
+** Output: 0 success, -1 the connection failed or closed
+******************************************************************************/
+int readBytes(struct reader *reader, char *data, int count){
+	char *piece;
+	while (count > 0) {
+		int length = takeBytes(reader, &piece, count);
+		if (length == -1) {
+			return -1;
+		}
+		memcpy(data, piece, length);
+		data += length;
+		count -= length;
+	}
+	return 0;
+}
+
+/******************************************************************************
+** receivePacket()
+** Description: A function that receives one packet into the client payload
+** buffer (grown for large FILE packets), with a null byte after it.
+** Parameters: reader, packet version, tag (set), simulated client, payload
+** length (set), stream ID (set, 0 before version 3)
+** Output: 0 success, -1 the connection failed or the packet is malformed
+******************************************************************************/
+int receivePacket(struct reader *reader, int version, char *tag, struct client *client, int *dataLength, unsigned int *stream){
+	char header[PACKET_SIZE_V2 + STREAM_ID_LENGTH];
+	unsigned int length;
+	int headerLength;
+	*stream = 0;
+	if (version >= 2) {
+		headerLength = version == 3 ? PACKET_SIZE_V2 + STREAM_ID_LENGTH : PACKET_SIZE_V2;
+		if (readBytes(reader, header, headerLength) == -1) {
+			return -1;
+		}
+		memcpy(&length, header, PACKET_SIZE_V2);
+		length = ntohl(length);
+		if (version == 3) {
+			memcpy(stream, header + PACKET_SIZE_V2, STREAM_ID_LENGTH);
+			*stream = ntohl(*stream);
+		}
+	}
+	else {
+		unsigned short shortLength;
+		headerLength = PACKET_SIZE;
+		if (readBytes(reader, header, PACKET_SIZE) == -1) {
+			return -1;
+		}
+		memcpy(&shortLength, header, PACKET_SIZE);
+		length = ntohs(shortLength);
+	}
+	if (length < (unsigned int) (headerLength + TAG_LENGTH) || length > (1U << 30)) {
+		return -1;
+	}
+	*dataLength = length - headerLength - TAG_LENGTH;
+	if (*dataLength >= client->payloadSize) {
+		client->payloadSize = *dataLength + 1;
+		client->payload = realloc(client->payload, client->payloadSize);
+		assert(client->payload != NULL);
+	}
+	if (readBytes(reader, tag, TAG_LENGTH) == -1 || readBytes(reader, client->payload, *dataLength) == -1) {
+		return -1;
+	}
+	tag[TAG_LENGTH] = '\0';
+	client->payload[*dataLength] = '\0';
+	return 0;
+}
+
+/******************************************************************************
+** receiveBody()
+** Description: A function that receives the raw file body after a SIZE packet
+** and drops it, counting it (and taking its CRC32 with -V).
+** Parameters: reader, number of bytes, simulated client, CRC32 so far (changed)
+** Output: 0 success, -1 the connection failed or closed
+******************************************************************************/
+int receiveBody(struct reader *reader, long long count, struct client *client, uLong *checksum){
+	char *piece;
+	while (count > 0) {
+		int length = takeBytes(reader, &piece, count);
+		if (length == -1) {
+			return -1;
+		}
+		if (settings.verify) {
+			*checksum = crc32(*checksum, (Bytef *) piece, length);
+		}
+		client->fileBytes += length;
+		count -= length;
+	}
+	return 0;
+}
+
+/******************************************************************************
+** inflatePayload()
+** Description: A function that inflates the FILE payload of a compressed
+** file (one deflate stream across the payloads) and counts the file bytes.
+** Parameters: inflate stream, simulated client (with the payload), payload
+** length, CRC32 so far (changed)
+** Output: 0 success, -1 the stream is damaged
+******************************************************************************/
+int inflatePayload(z_stream *inflater, struct client *client, int length, uLong *checksum){
+	int status = Z_OK;
+	inflater->next_in = (Bytef *) client->payload;
+	inflater->avail_in = length;
+	while (inflater->avail_in > 0 && status != Z_STREAM_END) {
+		inflater->next_out = (Bytef *) client->inflated;
+		inflater->avail_out = INFLATE_BUFFER_SIZE;
+		status = inflate(inflater, Z_NO_FLUSH);
+		if (status != Z_OK && status != Z_STREAM_END) {
+			return -1;
+		}
+		if (settings.verify) {
+			*checksum = crc32(*checksum, (Bytef *) client->inflated, INFLATE_BUFFER_SIZE - inflater->avail_out);
+		}
+		client->fileBytes += INFLATE_BUFFER_SIZE - inflater->avail_out;
+	}
+	return 0;
+}
+
+/******************************************************************************
+** runCommand()
+** Description: A function that runs one session for one command, as
+** ftclient.py does: DPORT with the benchmark options, the command, OKAY, the
+** data connection from the server (none with "mux=1"), the packets up to DONE,
+** then CLOSE and ACK. The time from connecting to CLOSE is the command
+** latency, the time to the first packet on the data connection its first byte.
+** Parameters: simulated client, command, filename (GET), whether to keep the
+** names a LIST sends in fileNames
+** Output: 0 success, -1 the command failed
+******************************************************************************/
+int runCommand(struct client *client, enum commandType type, char *name, int collectNames){
+	long long start = currentMicros();
+	long long firstByte = 0;
+	int controlSocket, dataSocket = -1;
+	int version = 1, compressed = 0, failed = 0, named = 0, dataLength;
+	unsigned int stream;
+	char tag[TAG_LENGTH + 1];
+	char options[PAYLOAD_LENGTH];
+	struct reader control, data, *transfer;
+	z_stream inflater;
+	uLong checksum = crc32(0L, Z_NULL, 0);
+	struct pollfd waiting;
+	memset(&control, 0, sizeof(control));
+	memset(&inflater, 0, sizeof(inflater));
+	controlSocket = connectServer();
+	if (controlSocket == -1) {
+		return -1;
+	}
+	control.socket = controlSocket;
+	control.buffer = malloc(READ_BUFFER_SIZE);
+	data = control;
+	data.buffer = malloc(READ_BUFFER_SIZE);
+	assert(control.buffer != NULL && data.buffer != NULL);
+	// the options ftclient.py sends, from the benchmark settings
+	snprintf(options, sizeof(options), "%d\nv=2 chunk=%d stream=1%s", client->dataPort, settings.chunkSize,
+		settings.mux ? " mux=1" : "");
+	if (settings.compressLevel) {
+		snprintf(options + strlen(options), sizeof(options) - strlen(options), " z=deflate zlevel=%d", settings.compressLevel);
+	}
+	if (settings.verify) {
+		strcat(options, " sum=crc32");
+	}
+	if (sendPacket(controlSocket, 1, "DPORT", options, strlen(options)) == -1 ||
+		sendPacket(controlSocket, 1, type == GET_COMMAND ? "GET" : "LIST", name, strlen(name)) == -1 ||
+		receivePacket(&control, 1, tag, client, &dataLength, &stream) == -1 || strcmp(tag, "OKAY") != 0) {
+		failed = 1;
+		goto done;
+	}
+	// the OKAY payload lists the options the server accepted
+	if (strstr(client->payload, "v=2") != NULL) {
+		version = 2;
+	}
+	if (strstr(client->payload, "mux=1") != NULL) {
+		version = 3;
+	}
+	compressed = strstr(client->payload, "z=deflate") != NULL;
+	if (compressed && inflateInit(&inflater) != Z_OK) {
+		failed = 1;
+		goto done;
+	}
+	// multiplexed: the transfer is stream 1 of the control connection
+	if (version == 3) {
+		transfer = &control;
+	}
+	else {
+		waiting.fd = client->listener;
+		waiting.events = POLLIN;
+		if (poll(&waiting, 1, TIMEOUT_SECONDS * 1000) != 1 ||
+			(dataSocket = accept4(client->listener, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+			failed = 1;
+			goto done;
+		}
+		data.socket = dataSocket;
+		transfer = &data;
+	}
+	transfer->rate = settings.rate;
+	transfer->startTime = currentMicros();
+	// the transfer, up to DONE
+	while (1) {
+		if (receivePacket(transfer, version, tag, client, &dataLength, &stream) == -1) {
+			failed = 1;
+			goto done;
+		}
+		// a control packet in the middle of a multiplexed transfer
+		if (version == 3 && stream == 0) {
+			failed |= strcmp(tag, "ERROR") == 0;
+			continue;
+		}
+		if (firstByte == 0) {
+			firstByte = currentMicros() - start;
+		}
+		if (strcmp(tag, "DONE") == 0) {
+			break;
+		}
+		if (strcmp(tag, "FNAME") == 0 && collectNames) {
+			fileNames = realloc(fileNames, (numberNames + 1) * sizeof(char *));
+			assert(fileNames != NULL);
+			fileNames[numberNames++] = strdup(client->payload);
+		}
+		else if (strcmp(tag, "SIZE") == 0) {
+			if (receiveBody(transfer, strtoll(client->payload, NULL, 10), client, &checksum) == -1) {
+				failed = 1;
+				goto done;
+			}
+		}
+		else if (strcmp(tag, "FILE") == 0) {
+			// the first FILE packet names the file, the others carry it
+			if (!named) {
+				named = 1;
+			}
+			else if (compressed) {
+				if (inflatePayload(&inflater, client, dataLength, &checksum) == -1) {
+					failed = 1;
+					goto done;
+				}
+			}
+			else {
+				if (settings.verify) {
+					checksum = crc32(checksum, (Bytef *) client->payload, dataLength);
+				}
+				client->fileBytes += dataLength;
+			}
+		}
+	}
+	// DONE carries the CRC32 of the file bytes
+	if (settings.verify && strncmp(client->payload, "crc32=", 6) == 0 &&
+		strtoul(client->payload + 6, NULL, 16) != checksum) {
+		fprintf(stderr, "ftbench: Checksum mismatch for \"%s\"\n", name);
+		failed = 1;
+	}
+	// the server errors come on the control connection, before CLOSE
+	while (1) {
+		if (receivePacket(&control, version, tag, client, &dataLength, &stream) == -1) {
+			failed = 1;
+			goto done;
+		}
+		failed |= strcmp(tag, "ERROR") == 0;
+		if (strcmp(tag, "CLOSE") == 0) {
+			break;
+		}
+	}
+	sendPacket(controlSocket, version, "ACK", "", 0);
+done:
+	if (compressed) {
+		inflateEnd(&inflater);
+	}
+	client->wireBytes += control.received + data.received;
+	free(control.buffer);
+	free(data.buffer);
+	if (dataSocket != -1) {
+		close(dataSocket);
+	}
+	close(controlSocket);
+	if (failed) {
+		client->errors++;
+		// a data connection may still be on its way, do not mistake it for the next one's
+		openDataListener(client);
+		return -1;
+	}
+	if (client->numberSamples == client->samplesSize) {
+		client->samplesSize = client->samplesSize ? 2 * client->samplesSize : 1024;
+		client->samples = realloc(client->samples, client->samplesSize * sizeof(struct sample));
+		assert(client->samples != NULL);
+	}
+	client->samples[client->numberSamples].type = type;
+	client->samples[client->numberSamples].firstByte = firstByte;
+	client->samples[client->numberSamples].latency = currentMicros() - start;
+	client->numberSamples++;
+	return 0;
+}
+
+/******************************************************************************
+** runClient()
+** Description: A function that runs one simulated client: it waits for the
+** others, then runs its commands one after the other, each a LIST with the
+** -l chance or else a GET of a random listed file, for -n commands or until
+** -d seconds have gone by.
+** Parameters: simulated client
+** Output: none
+******************************************************************************/
+void *runClient(void *arg){
+	struct client *client = arg;
+	long long deadline;
+	pthread_barrier_wait(&startBarrier);
+	deadline = currentMicros() + settings.seconds * 1000000LL;
+	for (int i = 0; settings.seconds ? currentMicros() < deadline : i < settings.requests; i++) {
+		unsigned long long pick = nextRandom(&client->seed);
+		if ((int) (pick % 100) < settings.listPercent || numberNames == 0) {
+			runCommand(client, LIST_COMMAND, "", 0);
+		}
+		else {
+			runCommand(client, GET_COMMAND, fileNames[(pick / 100) % numberNames], 0);
+		}
+	}
+	return NULL;
+}
+
+/******************************************************************************
+** compareLatency(), compareFirstByte()
+** Description: Functions that order samples for qsort(), by latency or by
+** time to the first byte.
+** Parameters: two samples
+** Output: negative, 0 or positive, as strcmp()
+******************************************************************************/
+int compareLatency(const void *a, const void *b){
+	long long x = ((struct sample *) a)->latency, y = ((struct sample *) b)->latency;
+	return (x > y) - (x < y);
+}
+
+int compareFirstByte(const void *a, const void *b){
+	long long x = ((struct sample *) a)->firstByte, y = ((struct sample *) b)->firstByte;
+	return (x > y) - (x < y);
+}
+
+/******************************************************************************
+** printPercentiles()
+** Description: A function that prints the p50, p99, p999 and largest latency
+** (or time to the first byte) of a set of samples, in milliseconds. The
+** samples are sorted in place.
+** Parameters: label, samples, number of samples, 1 for the first byte times
+** Output: none
+******************************************************************************/
+void printPercentiles(char *label, struct sample *samples, int numberSamples, int firstByte){
+	const double fractions[3] = { 0.5, 0.99, 0.999 };
+	double values[3];
+	if (numberSamples == 0) {
+		return;
+	}
+	qsort(samples, numberSamples, sizeof(struct sample), firstByte ? compareFirstByte : compareLatency);
+	for (int i = 0; i < 3; i++) {
+		// the nearest rank: the smallest sample with that fraction at or below it
+		int rank = fractions[i] * numberSamples;
+		if (rank < fractions[i] * numberSamples) {
+			rank++;
+		}
+		rank = rank < 1 ? 0 : rank - 1;
+		values[i] = (firstByte ? samples[rank].firstByte : samples[rank].latency) / 1000.0;
+	}
+	printf("  %s: p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n", label, values[0], values[1], values[2],
+		(firstByte ? samples[numberSamples - 1].firstByte : samples[numberSamples - 1].latency) / 1000.0);
+}
+
+/******************************************************************************
+** runBenchmark()
+** Description: A function that lists the server files once, runs the
+** simulated clients together, and reports: commands per second, file and
+** wire bytes per second, latency percentiles of GET and LIST and of the first
+** byte, and the CPU seconds per GB of file bytes of the client and server.
+** The server is listed on the first run only, later runs GET the same files.
+** Parameters: commands per second and GB per second of files (set)
+** Output: none
+******************************************************************************/
+void runBenchmark(double *commandRate, double *fileRate){
+	struct client *clients = calloc(settings.clients, sizeof(struct client));
+	struct client lister;
+	struct sample *samples, *gets, *lists;
+	int numberSamples = 0, numberGets = 0, numberLists = 0;
+	long long errors = 0, fileBytes = 0, wireBytes = 0;
+	double clientStart, serverStart = -1, clientSeconds, serverSeconds = -1, seconds, gigabytes;
+	long long start;
+	assert(clients != NULL);
+	// the files the GETs pick from
+	memset(&lister, 0, sizeof(lister));
+	lister.listener = -1;
+	if (fileNames == NULL && (openDataListener(&lister) == -1 || runCommand(&lister, LIST_COMMAND, "", 1) == -1)) {
+		fprintf(stderr, "ftbench: Cannot list the files of %s:%d\n", settings.host, settings.port);
+		exit(1);
+	}
+	if (lister.listener != -1) {
+		close(lister.listener);
+	}
+	if (numberNames == 0 && settings.listPercent < 100) {
+		fprintf(stderr, "ftbench: The server has no files to GET, only LIST is run\n");
+	}
+	// every client is ready before the clock starts
+	pthread_barrier_init(&startBarrier, NULL, settings.clients + 1);
+	for (int i = 0; i < settings.clients; i++) {
+		clients[i].index = i;
+		clients[i].seed = 0x2545F4914F6CDD1DULL * (i + 1);
+		clients[i].listener = -1;
+		clients[i].inflated = malloc(INFLATE_BUFFER_SIZE);
+		assert(clients[i].inflated != NULL);
+		if (openDataListener(&clients[i]) == -1) {
+			exit(1);
+		}
+		if (pthread_create(&clients[i].thread, NULL, runClient, &clients[i]) != 0) {
+			fprintf(stderr, "ftbench: Cannot start client %d\n", i);
+			exit(1);
+		}
+	}
+	clientStart = processSeconds(0);
+	if (settings.serverPid) {
+		serverStart = processSeconds(settings.serverPid);
+	}
+	start = currentMicros();
+	pthread_barrier_wait(&startBarrier);
+	for (int i = 0; i < settings.clients; i++) {
+		pthread_join(clients[i].thread, NULL);
+	}
+	seconds = (currentMicros() - start) / 1e6;
+	clientSeconds = processSeconds(0) - clientStart;
+	if (serverStart >= 0) {
+		serverSeconds = processSeconds(settings.serverPid) - serverStart;
+	}
+	// all the samples, then the GETs and LISTs apart
+	for (int i = 0; i < settings.clients; i++) {
+		numberSamples += clients[i].numberSamples;
+		errors += clients[i].errors;
+		fileBytes += clients[i].fileBytes;
+		wireBytes += clients[i].wireBytes;
+	}
+	samples = malloc((numberSamples + 1) * sizeof(struct sample));
+	gets = malloc((numberSamples + 1) * sizeof(struct sample));
+	lists = malloc((numberSamples + 1) * sizeof(struct sample));
+	assert(samples != NULL && gets != NULL && lists != NULL);
+	numberSamples = 0;
+	for (int i = 0; i < settings.clients; i++) {
+		for (int j = 0; j < clients[i].numberSamples; j++) {
+			struct sample *sample = &clients[i].samples[j];
+			samples[numberSamples++] = *sample;
+			if (sample->type == GET_COMMAND) {
+				gets[numberGets++] = *sample;
+			}
+			else {
+				lists[numberLists++] = *sample;
+			}
+		}
+	}
+	gigabytes = fileBytes / 1e9;
+	printf("ftbench: %d clients, %d commands (%d GET, %d LIST), %lld errors in %.2f s\n",
+		settings.clients, numberSamples, numberGets, numberLists, errors, seconds);
+	printf("  throughput: %.1f commands/s, %.3f GB/s of files, %.3f GB/s on the wire\n",
+		numberSamples / seconds, gigabytes / seconds, wireBytes / 1e9 / seconds);
+	printf("  bytes: %lld of files, %lld on the wire (%.2f%%)\n", fileBytes, wireBytes,
+		fileBytes ? 100.0 * wireBytes / fileBytes : 0.0);
+	printPercentiles("GET latency", gets, numberGets, 0);
+	printPercentiles("LIST latency", lists, numberLists, 0);
+	printPercentiles("first byte", samples, numberSamples, 1);
+	printf("  cpu: client %.2f s (%.3f s/GB)", clientSeconds, gigabytes > 0 ? clientSeconds / gigabytes : 0.0);
+	if (serverSeconds >= 0) {
+		printf(", server %.2f s (%.3f s/GB)", serverSeconds, gigabytes > 0 ? serverSeconds / gigabytes : 0.0);
+	}
+	printf("\n");
+	*commandRate = numberSamples / seconds;
+	*fileRate = gigabytes / seconds;
+	// the next run starts its clients afresh
+	for (int i = 0; i < settings.clients; i++) {
+		if (clients[i].listener != -1) {
+			close(clients[i].listener);
+		}
+		free(clients[i].inflated);
+		free(clients[i].payload);
+		free(clients[i].samples);
+	}
+	free(clients);
+	free(samples);
+	free(gets);
+	free(lists);
+}
@@ -0,0 +1,303 @@
+/******************************************************************************************
+** Trace decoder																  ftdecode.c
+** Description: A tool that prints the binary trace ftserver writes with -t, one line per
+** event: the time, the worker, the session, the event and its value. It can keep reading
+** the file as the server adds to it (like tail -f), and show one worker or one session
+** only. The trace layout below must stay the same as in ftserver.c.
+** Go to sources: (detailed citing within program):
+** http://man7.org/linux/man-pages/man3/strftime.3.html
+******************************************************************************************/
+
+#include <errno.h>
+
+#include <fcntl.h>
+
+#include <getopt.h>
+
+#include <stdio.h>
+
+#include <stdlib.h>
+
+#include <string.h>
+
+#include <time.h>
+
+#include <unistd.h>
+
+#include <arpa/inet.h>
+
+/************************************ Constants *****************************************/
+
+// the start of a trace file, as ftserver writes it
+#define TRACE_MAGIC   "FTTRACE1"
+// events read from the file at once
+#define READ_EVENTS        4096
+// while following the file, how long to wait for the server to add to it
+#define FOLLOW_MS           100
+
+/******************************** Data Structures ****************************************/
+
+// one trace event (the same layout as in ftserver.c): CLOCK_MONOTONIC
+// microseconds, the value of the event, the session (0 for none), the event
+// and the worker
+struct traceEvent {
+	long long time;
+	long long bytes;
+	unsigned int session;
+	unsigned short event;
+	unsigned short worker;
+};
+
+// start of the trace file (the same layout as in ftserver.c)
+struct traceHeader {
+	char magic[8];
+	long long startMicros;
+	long long startTime;
+	int eventSize;
+	int workers;
+};
+
+// name of each event, in the order of enum traceEventType in ftserver.c, and
+// what its value is ("address" for an IPv4 address, NULL when it has none)
+struct eventName {
+	const char *name;
+	const char *unit;
+};
+
+const struct eventName eventNames[] = {
+	{ "dropped", "events" },
+	{ "connect", "address" },
+	{ "close", "bytes" },
+	{ "data-port", "port" },
+	{ "data-open", "us" },
+	{ "data-close", NULL },
+	{ "list", "files" },
+	{ "list-stream", NULL },
+	{ "get", "bytes" },
+	{ "get-cached", "bytes" },
+	{ "get-zero-copy", "bytes" },
+	{ "get-compressing", "bytes" },
+	{ "get-precompressed", "bytes" },
+	{ "delta", "blocks" },
+	{ "signatures", "blocks" },
+	{ "mget", "files" },
+	{ "put", "bytes" },
+	{ "put-zero-copy", "bytes" },
+	{ "stats", NULL },
+	{ "quit", NULL },
+	{ "okay", NULL },
+	{ "command-error", NULL },
+	{ "file-error", NULL },
+	{ "open-error", NULL },
+	{ "create-error", NULL },
+	{ "save-error", NULL },
+	{ "compressed", "bytes" },
+	{ "delta-copied", "blocks" },
+	{ "delta-literal", "bytes" },
+	{ "received", "bytes" },
+	{ "done", "bytes" },
+	{ "packets", "packets" },
+	{ "send-calls", "calls" },
+	{ "close-sent", NULL },
+	{ "send", "bytes" },
+	{ "receive", "bytes" },
+	{ "throttle", "waiting" },
+	{ "turn", "bytes" }
+};
+
+// decoder settings from the command line
+struct settings {
+	char *traceFile;
+	// keep reading as the server writes (-f)
+	int follow;
+	// the worker (-w) and session (-s) to show, -1 for all
+	int worker;
+	int session;
+};
+
+// settings are set in main() and only read afterwards
+struct settings settings;
+// the two clocks at the start of the trace, to date the events
+struct traceHeader header;
+
+/***************************** Function Declarations *************************************/
+
+int isNumber(char *str, int *n);
+int readHeader(int fd);
+void printEvent(struct traceEvent *event);
+void decodeTrace(int fd);
+
+/********************************** Main Function ****************************************/
+
+int main(int argc, char **argv){
+	int option;
+	int fd;
+	settings.worker = -1;
+	settings.session = -1;
+	// read the options in front of the file name
+	// source: https://www.gnu.org/software/libc/manual/html_node/Using-Getopt.html
+	while ((option = getopt(argc, argv, "fw:s:")) != -1) {
+		switch (option) {
+		case 'f':
+			settings.follow = 1;
+			break;
+		case 'w':
+			if (!isNumber(optarg, &settings.worker)) {
+				fprintf(stderr, "ftdecode: Worker must be a number!\n");
+				exit(1);
+			}
+			break;
+		case 's':
+			if (!isNumber(optarg, &settings.session)) {
+				fprintf(stderr, "ftdecode: Session must be a number!\n");
+				exit(1);
+			}
+			break;
+		default:
+			fprintf(stderr, "Error: Use ftdecode [-f] [-w <worker>] [-s <session>] <trace-file>\n");
+			exit(1);
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "Error: Use ftdecode [-f] [-w <worker>] [-s <session>] <trace-file>\n");
+		exit(1);
+	}
+	settings.traceFile = argv[optind];
+	fd = open(settings.traceFile, O_RDONLY);
+	if (fd == -1) {
+		perror(settings.traceFile);
+		exit(1);
+	}
+	if (readHeader(fd) == -1) {
+		exit(1);
+	}
+	decodeTrace(fd);
+	close(fd);
+	exit(0);
+}
+
+/****************************** Function Definitions ************************************/
+
+/******************************************************************************
+** isNumber()
+** Description: A function that determines if the input string contains only
+** digits, and converts it.
+** Parameters: string, number (set)
+** Output: 1 a number, 0 not a number
+******************************************************************************/
+int isNumber(char *str, int *n){
+	if (*str == '\0' || strspn(str, "0123456789") != strlen(str)) {
+		return 0;
+	}
+	*n = atoi(str);
+	return 1;
+}
+
+/******************************************************************************
+** readHeader()
+** Description: A function that reads the header of the trace file, and
+** checks that it is a trace with the event layout this decoder knows.
+** Parameters: trace file descriptor
+** Output: 0 success, -1 not a trace this decoder reads
+******************************************************************************/
+int readHeader(int fd){
+	ssize_t got = read(fd, &header, sizeof(header));
+	if (got != sizeof(header) || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+		fprintf(stderr, "ftdecode: \"%s\" is not an ftserver trace\n", settings.traceFile);
+		return -1;
+	}
+	if (header.eventSize != sizeof(struct traceEvent)) {
+		fprintf(stderr, "ftdecode: Events of %d bytes, this decoder reads %d\n",
+			header.eventSize, (int) sizeof(struct traceEvent));
+		return -1;
+	}
+	return 0;
+}
+
+/******************************************************************************
+** printEvent()
+** Description: A function that prints one event as a line: the wall clock
+** time (from the server's monotonic clock and the clocks in the header), the
+** worker, the session, the event name and its value.
+** Parameters: trace event
+** Output: none
+** Source: http://man7.org/linux/man-pages/man3/strftime.3.html
+******************************************************************************/
+void printEvent(struct traceEvent *event){
+	long long micros = header.startTime + (event->time - header.startMicros);
+	time_t seconds = micros / 1000000;
+	struct tm local;
+	char stamp[32];
+	const char *name = NULL, *unit = NULL;
+	char unknown[16];
+	if ((settings.worker != -1 && event->worker != settings.worker) ||
+		(settings.session != -1 && event->session != (unsigned int) settings.session)) {
+		return;
+	}
+	localtime_r(&seconds, &local);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+	if (event->event < sizeof(eventNames) / sizeof(eventNames[0])) {
+		name = eventNames[event->event].name;
+		unit = eventNames[event->event].unit;
+	}
+	else {
+		snprintf(unknown, sizeof(unknown), "event-%d", event->event);
+		name = unknown;
+		unit = "";
+	}
+	printf("%s.%06lld w%d s%u %s", stamp, micros % 1000000, event->worker, event->session, name);
+	if (unit != NULL && strcmp(unit, "address") == 0) {
+		struct in_addr address;
+		char text[INET_ADDRSTRLEN];
+		address.s_addr = (in_addr_t) event->bytes;
+		printf(" %s", inet_ntop(AF_INET, &address, text, sizeof(text)));
+	}
+	else if (unit != NULL) {
+		printf(" %lld %s", event->bytes, unit);
+	}
+	printf("\n");
+}
+
+/******************************************************************************
+** decodeTrace()
+** Description: A function that prints the events of the trace file, many
+** read at once. A piece of an event at the end is kept for the next read,
+** since the server may be writing it right now. With -f it waits for more
+** events at the end of the file instead of stopping.
+** Parameters: trace file descriptor
+** Output: none
+******************************************************************************/
+void decodeTrace(int fd){
+	static struct traceEvent events[READ_EVENTS];
+	struct timespec pause = { 0, FOLLOW_MS * 1000000L };
+	size_t have = 0;
+	ssize_t got;
+	while (1) {
+		got = read(fd, (char *) events + have, sizeof(events) - have);
+		if (got == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("read");
+			return;
+		}
+		if (got == 0) {
+			if (!settings.follow) {
+				break;
+			}
+			fflush(stdout);
+			nanosleep(&pause, NULL);
+			continue;
+		}
+		have += got;
+		for (size_t i = 0; i < have / sizeof(struct traceEvent); i++) {
+			printEvent(&events[i]);
+		}
+		// the piece of an event, moved to the front
+		memmove(events, (char *) events + have - have % sizeof(struct traceEvent), have % sizeof(struct traceEvent));
+		have %= sizeof(struct traceEvent);
+	}
+	if (have > 0) {
+		fprintf(stderr, "ftdecode: The trace ends in the middle of an event\n");
+	}
+}
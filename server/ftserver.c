@@ -3,39 +3,86 @@
 ** Author: Kara Franco
 ** CS.372-400 Intro to Computer Networks
 ** Due Date: March 6, 2016
-** Description: A server program that connects with one client at a time to list and transfer 
-** files. The server runs continuously between each client connection. Each client session is 
-** run on the control connection and the file transfer/listing is run on a data connection. 
+** Description: A server program that connects with many clients at once to list and transfer 
+** files. The server runs continuously, serving every client session from one epoll event loop 
+** with non-blocking sockets. Each client session is run on the control connection and the 
+** file transfer/listing is run on a data connection. 
 ** The server is stopped upon receiving an interrupt signal. 
 ** Go to sources: (detailed citing within program):
 ** http://beej.us/guide/bgnet/output/html/multipage/index.html
 ** https://www.ietf.org/rfc/rfc959.txt
 ******************************************************************************************/
 
+// accept4() and the other Linux extensions used below
+#define _GNU_SOURCE
 // assert()
 #include <assert.h>
-// dirent struct, opendir, readdir, closedir
+// dirent struct, opendir, readdir, closedir, getdents64()
 #include <dirent.h>
+// errno, EAGAIN, EINPROGRESS
+#include <errno.h>
+// fcntl(), O_NONBLOCK, posix_fadvise()
+#include <fcntl.h>
+// fnmatch(), the patterns of a batch GET
+#include <fnmatch.h>
+// pthread_create(), pthread_setaffinity_np()
+#include <pthread.h>
+// cpu_set_t, CPU_SET()
+#include <sched.h>
 // to use all symbols from <netinet/in.h>
 #include <netdb.h>
 // sigaction, 
 #include <signal.h>
+// getopt()
+#include <getopt.h>
 // printf, sscanf, fread(), fclose()
 #include <stdio.h>
 // malloc(), realloc(), atoi()
 #include <stdlib.h>
 // strlen, strcopy, strcmp, memset
 #include <string.h>
-// socket(), socklen_t, send()
+// epoll_create1(), epoll_ctl(), epoll_wait()
+#include <sys/epoll.h>
+// sendfile()
+#include <sys/sendfile.h>
+// inotify_init1(), inotify_add_watch(), struct inotify_event
+#include <sys/inotify.h>
+// eventfd(), io_uring completions wake epoll through it
+#include <sys/eventfd.h>
+// syscall(), io_uring has no libc wrappers
+#include <sys/syscall.h>
+// POLLOUT
+#include <poll.h>
+// struct io_uring_params, struct io_uring_sqe, IORING_OP_*
+#include <linux/io_uring.h>
+// mmap(), munmap()
+#include <sys/mman.h>
+// socket(), socklen_t, send(), sendmsg()
 #include <sys/socket.h>
 // stat struct
 #include <sys/stat.h>
+// struct iovec
+#include <sys/uio.h>
+// clock_gettime()
+#include <time.h>
 // close()
 #include <unistd.h>
 // sockaddr_in, sin_port, htons, etc.
 #include <netinet/in.h>
-//inet_ntoa()
+//inet_ntop()
 #include <arpa/inet.h>
+// deflateInit(), deflate(), compress2(), crc32()
+#include <zlib.h>
+// uint32_t, uint64_t
+#include <stdint.h>
+// _mm_crc32_u64(), or __crc32cd() on ARMv8
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+// getauxval(), HWCAP_CRC32
+#include <sys/auxv.h>
+#endif
 
 
 /******************************* Global Variables ****************************************/
@@ -46,38 +93,891 @@
 #define TAG_LENGTH            8
 // number of bytes for packet length field
 #define PACKET_SIZE		      2
+// number of bytes for packet length field in version 2 packets (DPORT option v=2)
+#define PACKET_SIZE_V2        4
+// number of bytes for the stream ID in version 3 packets (DPORT option mux=1)
+#define STREAM_ID_LENGTH      4
+// largest packet on the control connection: length field + stream ID + tag + payload
+#define MAX_PACKET_LENGTH     (PACKET_SIZE_V2 + STREAM_ID_LENGTH + TAG_LENGTH + PAYLOAD_LENGTH)
+// version 2 FILE packet payload: default, and the most a client may ask for
+#define DEFAULT_CHUNK_SIZE   65536
+#define MAX_CHUNK_SIZE     4194304
+// FILE payloads up to this size are read straight into the output buffer,
+// larger ones are sent from the page cache with sendfile()
+#define INPLACE_CHUNK_SIZE   16384
+// free output buffer the data connection needs for the next packet
+#define PACKET_ROOM          (PACKET_SIZE_V2 + STREAM_ID_LENGTH + TAG_LENGTH + INPLACE_CHUNK_SIZE)
+// number of epoll events handled per event loop pass
+#define MAX_EVENTS           64
+// bytes queued on a data connection before waiting for the socket to drain
+#define DATA_BUFFER_SIZE  65536
+// bytes queued on a control connection (a few small packets)
+#define CONTROL_BUFFER_SIZE 4096
+// bytes a session may queue per event before the other sessions get a turn
+#define DATA_BUDGET      262144
+// connect() attempts on the client data port, and the delay before a retry:
+// 1 ms, doubled after each refusal up to the cap (about 0.9 s in all)
+#define CONNECT_ATTEMPTS     14
+#define CONNECT_RETRY_MS      1
+#define CONNECT_RETRY_MAX_MS 128
+// sessions each worker preallocates, more clients are turned away
+#define DEFAULT_MAX_SESSIONS 1024
+// session slots start on a page boundary, so buffers never share pages
+#define SLOT_ALIGNMENT     4096
+// hash buckets of the directory index to start with, doubled as files are added
+#define INDEX_BUCKETS       256
+// directory entries read per getdents64() call by a streaming LIST
+#define DIRENT_BUFFER_SIZE 32768
+// budget charged for each directory entry a LIST looks at, sent or not
+#define LIST_ENTRY_COST      64
+// hot file cache: default budget (-m, in MiB) and hash buckets
+#define DEFAULT_CACHE_MB     64
+#define CACHE_BUCKETS      1024
+// file bytes read at a time into the deflate stream of a GET, and the level
+// used when the client asks for compression without one
+#define DEFLATE_INPUT_SIZE 65536
+#define DEFAULT_DEFLATE_LEVEL 6
+// batch GET (MGET): files read ahead of the one being sent, and the bytes of
+// each file asked for
+#define BATCH_READAHEAD_FILES  16
+#define BATCH_READAHEAD_BYTES 4194304
+// delta GET: block sizes a client may ask for, the most block signatures it
+// may send (8 bytes each: adler32 and CRC32), and file bytes scanned per turn
+#define DELTA_MIN_BLOCK      512
+#define DELTA_MAX_BLOCK  1048576
+#define DELTA_MAX_BLOCKS  262144
+#define SIGNATURE_LENGTH       8
+#define DELTA_SCAN_STEP    65536
+// adler32: the modulus, and the bytes summed before the sums are reduced
+#define ADLER_MOD          65521
+#define ADLER_BLOCK         4096
+
+// rate limits (-r, -R): a token bucket holds a tenth of a second of its rate
+// (at least RATE_MIN_BURST), transfers waiting for tokens take turns of
+// RATE_QUANTUM bytes, clients are hashed to CLIENT_BUCKETS buckets
+#define RATE_BURST_DIVISOR    10
+#define RATE_MIN_BURST     65536
+#define RATE_QUANTUM       65536
+#define CLIENT_BUCKETS      4096
+// trace (-t): events in each worker's ring (a power of two), how long the
+// drainer sleeps between passes, the verbosity levels, and the file header
+#define TRACE_EVENTS       16384
+#define TRACE_DRAIN_MS        10
+#define TRACE_OFF              0
+#define TRACE_SESSIONS         1
+#define TRACE_COMMANDS         2
+#define TRACE_SENDS            3
+#define DEFAULT_TRACE_LEVEL    TRACE_COMMANDS
+#define TRACE_MAGIC   "FTTRACE1"
+// records a trace event when the verbosity asks for it: a load and a compare
+// when it does not
+#define TRACE(level, event, session, bytes) \
+	do { \
+		if (__builtin_expect(traceLevel >= (level), 0)) { \
+			recordTrace((event), (session), (bytes)); \
+		} \
+	} while (0)
+
+// PUT: pipe between the data socket and the file, and the temporary names
+#define UPLOAD_PIPE_SIZE 1048576
+#define UPLOAD_PREFIX    ".ftput-"
+
+// file digests remembered, one per slot of a direct mapped table
+#define DIGEST_SLOTS        4096
+// bytes of each of the three CRC32C streams the instruction runs side by side
+#define CRC32C_BLOCK         4096
+// bytes read at a time to checksum a body sent with sendfile()
+#define CHECKSUM_BUFFER_SIZE 65536
+
+// io_uring backend (-u): submission queue entries, and the registered buffers
+// file bodies are read into, one per session sending
+#define URING_ENTRIES        256
+#define URING_BUFFERS         32
+#define URING_BUFFER_SIZE 262144
+// io_uring user data: the session (slots are page aligned), and the operation in the low bits
+#define URING_READ             1
+#define URING_POLL             2
+#define URING_SEND             3
+#define URING_OPERATION        3
+
+// log-linear latency histograms: 16 buckets per power of two of microseconds,
+// up to 2^37 microseconds (about 38 hours)
+#define HISTOGRAM_SUB_BITS     4
+#define HISTOGRAM_SUB_BUCKETS 16
+#define HISTOGRAM_BUCKETS    544
+#define HISTOGRAM_MAX ((1LL << 37) - 1)
+// the STATS reply, and the text served to Prometheus
+#define STATS_TEXT_SIZE     1024
+#define METRICS_TEXT_SIZE  16384
+// changes to the directory reported by inotify
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE)
+
+/******************************** Data Structures ****************************************/
+
+// kinds of socket endpoints watched by the event loop
+enum connectionType { LISTEN_CONNECTION, CONTROL_CONNECTION, DATA_CONNECTION, URING_CONNECTION };
+
+// checksum of the file bytes a GET sends, in the DONE payload
+enum checksumType { NO_CHECKSUM, CRC32C_CHECKSUM, CRC32_CHECKSUM };
+
+// trace events, the value each one carries in its bytes field, and the
+// verbosity it needs (ftdecode.c has the same list, in the same order)
+enum traceEventType {
+	// events a full ring lost, in all (written by the drainer)
+	TRACE_DROPPED,
+	// sessions: control connection accepted (client IPv4 address, network
+	// order), session closed (bytes sent), DPORT (port), data connection
+	// open (microseconds to connect) and closed
+	TRACE_CONNECT,
+	TRACE_CLOSE,
+	TRACE_DATA_PORT,
+	TRACE_DATA_OPEN,
+	TRACE_DATA_CLOSE,
+	// commands: the transfer each one starts (file or range bytes, blocks,
+	// files), and the replies
+	TRACE_LIST,
+	TRACE_LIST_STREAM,
+	TRACE_GET,
+	TRACE_GET_CACHED,
+	TRACE_GET_ZERO_COPY,
+	TRACE_GET_COMPRESSING,
+	TRACE_GET_PRECOMPRESSED,
+	TRACE_DELTA,
+	TRACE_SIGNATURES,
+	TRACE_MGET,
+	TRACE_PUT,
+	TRACE_PUT_ZERO_COPY,
+	TRACE_STATS,
+	TRACE_QUIT,
+	TRACE_OKAY,
+	TRACE_COMMAND_ERROR,
+	TRACE_FILE_ERROR,
+	TRACE_OPEN_ERROR,
+	TRACE_CREATE_ERROR,
+	TRACE_SAVE_ERROR,
+	// commands: how the transfer ended (bytes, blocks, packets, system calls);
+	// done, packets and send-calls come once DONE is sent, so they count the
+	// whole transfer
+	TRACE_COMPRESSED,
+	TRACE_DELTA_COPIED,
+	TRACE_DELTA_LITERAL,
+	TRACE_RECEIVED,
+	TRACE_DONE,
+	TRACE_PACKETS,
+	TRACE_SEND_CALLS,
+	TRACE_CLOSE_SENT,
+	// sends: each send or receive (bytes), each wait for tokens (transfers
+	// waiting) and each turn taken (deficit bytes)
+	TRACE_SEND,
+	TRACE_RECEIVE,
+	TRACE_THROTTLE,
+	TRACE_TURN
+};
+
+// states of a client session, in the order a session moves through them
+enum sessionState {
+	// waiting for the DPORT packet
+	DPORT_STATE,
+	// waiting for the LIST or GET packet
+	COMMAND_STATE,
+	// receiving the block signatures of a DELTA
+	SIGNATURE_STATE,
+	// connecting to the client data port
+	CONNECT_STATE,
+	// sending the listing or file on the data connection
+	TRANSFER_STATE,
+	// DONE and CLOSE sent, waiting for the client ACK
+	ACK_STATE,
+	// sending the last control packets, then closing
+	CLOSING_STATE,
+	// closed, freed at the end of the event loop pass
+	CLOSED_STATE
+};
+
+// one socket endpoint, registered with epoll
+struct connection {
+	int socket;
+	enum connectionType type;
+	// packet format: 1 (16 bit length), 2 (32 bit length) or 3 (32 bit length and stream ID)
+	int version;
+	// stream ID written in version 3 packets: 0 control, then one per transfer
+	unsigned int stream;
+	// connection whose socket and output buffer carry the packets: itself, or
+	// the control connection when the data connection is multiplexed onto it
+	struct connection *carrier;
+	// events currently watched by epoll
+	unsigned int events;
+	// session owning the endpoint (NULL for the listener)
+	struct session *session;
+	// queued output, used as a ring: bytes [outStart, outEnd) are sent first,
+	// then bytes [0, wrapEnd) once packets wrapped to the front of the buffer
+	char *outBuffer;
+	int outStart, outEnd, outSize;
+	int wrapped, wrapEnd;
+	// packets queued, send system calls and bytes sent, for the transfer report
+	long long packets;
+	long long sendCalls;
+	long long bytesSent;
+	// received input, bytes [0, inEnd) are not parsed yet
+	char *inBuffer;
+	int inEnd, inSize;
+};
+
+// one file of the server directory
+struct fileEntry {
+	char *name;
+	off_t size;
+	// modification and status change times to the nanosecond: a file rewritten
+	// in place within the same second, with the same size, is still a change
+	struct timespec mtime;
+	struct timespec ctime;
+	ino_t inode;
+};
+
+// the files of the directory at one moment; a LIST transfer keeps a reference,
+// and the last one to let go frees it
+struct listing {
+	int references;
+	int numberFiles;
+	struct fileEntry *files;
+	// all the names, one after the other
+	char *names;
+};
+
+// one file in a hash bucket of the directory index
+struct indexEntry {
+	struct indexEntry *next;
+	unsigned int hash;
+	struct fileEntry file;
+};
+
+// the files of the server directory, shared by all workers: hashed by name for
+// GET, with a listing snapshot for LIST; kept up to date with inotify
+struct directoryIndex {
+	// 0 when inotify is not available or -n was given, the directory is read every time
+	int enabled;
+	pthread_rwlock_t lock;
+	struct indexEntry **buckets;
+	unsigned int bucketCount;
+	int numberFiles;
+	// listing of the current files, NULL until a LIST asks for it after a change
+	struct listing *snapshot;
+	int inotifyFd;
+	pthread_t thread;
+};
+
+// a file of the hot file cache, shared by the sessions sending it
+struct cachedFile {
+	char *name;
+	unsigned int hash;
+	// the file the copy was made from
+	ino_t inode;
+	struct timespec mtime;
+	struct timespec ctime;
+	off_t original;
+	// deflate level of a precompressed copy, 0 for a plain copy
+	int level;
+	// copy of the file contents (or of its deflate stream), in anonymous memory
+	char *data;
+	off_t size;
+	// sessions sending the file; a stale file left the cache and is freed with the last one
+	int references;
+	int stale;
+	// hash bucket chain, and LRU list from oldest to newest
+	struct cachedFile *next;
+	struct cachedFile *older, *newer;
+};
+
+// the hot file cache, shared by all workers under one lock
+struct fileCache {
+	pthread_mutex_t lock;
+	// bytes the cached files may use (0 cache off), and use now
+	size_t budget;
+	size_t used;
+	struct cachedFile *buckets[CACHE_BUCKETS];
+	struct cachedFile *oldest, *newest;
+	long long hits, misses, evictions;
+};
+
+// checksum of a whole file, remembered so that sending it again needs no hashing
+struct fileDigest {
+	// NULL for an empty slot
+	char *name;
+	unsigned int hash;
+	ino_t inode;
+	struct timespec mtime;
+	struct timespec ctime;
+	off_t size;
+	enum checksumType type;
+	uint32_t checksum;
+};
+
+// the file digests, shared by all workers under one lock
+struct digestCache {
+	pthread_mutex_t lock;
+	struct fileDigest slots[DIGEST_SLOTS];
+	long long hits, misses;
+};
+
+// durations in microseconds, bucketed in the manner of HDR histograms: each
+// power of two is split in HISTOGRAM_SUB_BUCKETS, so a percentile read from
+// the buckets is within about 6% of the true value
+struct histogram {
+	long long counts[HISTOGRAM_BUCKETS];
+	long long count, sum, max;
+};
+
+// counters and latencies of one worker; only the worker writes them (with
+// relaxed atomic stores), STATS and the Prometheus endpoint read them from
+// any thread
+struct metrics {
+	long long sessions;
+	// transfers run, STATS answered, failed transfers and refused commands
+	long long lists, gets, batches, deltas, puts, stats, errors;
+	// packets, send system calls and bytes of the sessions, added when a
+	// transfer starts and when the session closes, and the bytes of the PUTs
+	long long packets, sendCalls, bytesSent, bytesReceived;
+	// GET names found in the directory (index) or not
+	long long lookupHits, lookupMisses;
+	// times transfers waited for their turn under the rate limits, and the
+	// microseconds they waited
+	long long throttles, throttledTime;
+	// data connect, from the command to the first byte sent, whole GET and LIST
+	struct histogram connectTime, firstByteTime, getTime, listTime;
+};
+
+// a delta GET: the block signatures of the client's copy of the file, hashed
+// by their weak checksum, and the scan of the server's file for those blocks
+struct delta {
+	int blockSize;
+	int numberBlocks, received;
+	// adler32 (weak) and CRC32 (strong) of each block
+	uint32_t *weak, *strong;
+	// hash chains of the blocks: first block of each bucket, next block (-1 ends)
+	int *heads, *next;
+	int bucketBits;
+	// bytes [windowStart, windowEnd) of the file: read into the buffer, or the
+	// whole copy in the hot file cache
+	char *buffer;
+	const char *window;
+	off_t windowSize, windowStart, windowEnd;
+	// scan position, and the first byte not sent yet (literal bytes before the position)
+	off_t offset, literalStart;
+	// adler32 sums of the block at the position, while they roll with it
+	int rolling;
+	uint32_t sumA, sumB;
+	// block found at the position (-1 none), and the run of blocks the next COPY sends
+	int matched;
+	int copyBlock, copyCount;
+	// blocks copied and literal bytes sent, for the transfer report
+	long long copiedBlocks, literalBytes;
+};
+
+// a token bucket of the rate limits: the bytes that may be sent now, refilled
+// at the rate up to the burst; sends are charged after they happened, so the
+// tokens may go below zero
+struct tokenBucket {
+	pthread_mutex_t lock;
+	double tokens;
+	// microseconds of the last refill
+	long long refilled;
+};
+
+// one trace event, as written to the trace file (ftdecode.c reads the same
+// layout): CLOCK_MONOTONIC microseconds, the value of the event, the session
+// (numbered by its worker from 1, 0 for none), the event and the worker
+struct traceEvent {
+	long long time;
+	long long bytes;
+	unsigned int session;
+	unsigned short event;
+	unsigned short worker;
+};
+
+// start of the trace file: the two clocks at the start, so the decoder can
+// date the events, and the layout of the events that follow
+struct traceHeader {
+	char magic[8];
+	long long startMicros;
+	long long startTime;
+	int eventSize;
+	int workers;
+};
+
+// trace events of one worker, a ring with one writer and one reader: the
+// worker adds at head, the drainer thread takes from tail, each index on
+// its own cache line so they do not bounce between the two
+struct traceRing {
+	unsigned int head __attribute__ ((aligned(64)));
+	// events lost to a full ring, and the part the drainer reported
+	long long dropped;
+	unsigned int tail __attribute__ ((aligned(64)));
+	long long reported;
+	int worker;
+	struct traceEvent events[TRACE_EVENTS] __attribute__ ((aligned(64)));
+};
+
+// one client, from the DPORT packet to the ACK
+struct session {
+	enum sessionState state;
+	struct connection control;
+	struct connection data;
+	// client address, the data port is set from DPORT
+	struct sockaddr_in clientAddress;
+	char clientIPv4[INET_ADDRSTRLEN];
+	int dataPort;
+	// client user command and filename
+	char userCommand[TAG_LENGTH + 1];
+	char filename[PAYLOAD_LENGTH + 1];
+	// last packet received on the control connection
+	char tagIn[TAG_LENGTH + 1];
+	char dataIn[PAYLOAD_LENGTH + 1];
+	int dataInLength;
+	// packet format and FILE payload size agreed in DPORT, used after OKAY
+	int version;
+	int chunkSize;
+	// data connection retries
+	int connectionAttempts;
+	// when the data connection and the current command started (microseconds),
+	// and whether the first byte of the transfer is still to be sent
+	long long connectStart;
+	long long commandStart;
+	int awaitingFirstByte;
+	// DONE is queued, the transfer report waits for it to be sent
+	int reportPending;
+	long long retryTime;
+	struct session *nextRetry;
+	// listing or file being sent
+	struct listing *listing;
+	int fileIndex;
+	// without the index, the directory is streamed: read in batches with getdents64()
+	int dirFd;
+	char *direntBuffer;
+	int direntOffset, direntEnd;
+	// LIST options: names to skip, names left to send (-1 no limit), name prefix
+	long long listSkip;
+	long long listRemaining;
+	char listPrefix[PAYLOAD_LENGTH + 1];
+	// batch GET (MGET): names of the matching files (in the listing or in the
+	// filename payload), the next one to send and the next one to read ahead
+	char **batchNames;
+	int batchCount, batchNext, batchAhead;
+	// without the index, the lines of the batch are matched while sending:
+	// the lines, the one being matched, and whether its directory scan runs
+	// (the names are then copies, the sent ones are freed)
+	char **batchLines;
+	int numberLines, batchLine;
+	int batchScanning;
+	// delta GET (DELTA): the client's block signatures and the scan
+	struct delta *delta;
+	// upload (PUT): the new file (-1 none), its temporary name when the file
+	// system has no unnamed files, the pipe splice() moves the bytes through,
+	// the file length and the bytes still to come
+	int uploadFd;
+	char uploadTemp[32];
+	int uploadPipe[2];
+	off_t uploadSize;
+	off_t uploadRemaining;
+	FILE *infile;
+	// the file comes from the hot file cache instead of infile
+	struct cachedFile *cached;
+	// infile or cached is being sent
+	int sendingFile;
+	int transferStatus;
+	// the session runs many commands on one data connection (DPORT option keep=1)
+	int keepOpen;
+	// transfers run on the control connection, there is no data connection (DPORT option mux=1)
+	int mux;
+	// transfers started, the stream ID of the current one
+	unsigned int transfers;
+	// client accepts the file as one SIZE packet and a raw body (DPORT option stream=1)
+	int streamBody;
+	// deflate level of the files sent, 0 sends them as they are (DPORT options z=deflate zlevel=N)
+	int compressLevel;
+	// deflate stream of a file compressed while sending, and its input buffer
+	z_stream *deflater;
+	char *deflateInput;
+	// checksum agreed in DPORT (sum=crc32c or sum=crc32), whether DONE carries
+	// it for this transfer, and the checksum of the file bytes sent so far; it
+	// is only computed while checksumming is set,
+	// a whole file with a remembered digest is not hashed again
+	enum checksumType checksumType;
+	int sendChecksum;
+	int checksumming;
+	uint32_t checksum;
+	// the file being sent, its digest is remembered after a whole file transfer
+	struct fileEntry sentFile;
+	int wholeFile;
+	// file length, and the end of the bytes to send (the file length, or the
+	// end of the range a GET asked for with its offset and length options)
+	off_t fileSize;
+	off_t bodyEnd;
+	// raw body left to send, and where it continues in the file
+	off_t bodyOffset;
+	off_t bodyRemaining;
+	// sendfile() is not supported for the file, copy the body instead
+	int copyBody;
+	// io_uring of the worker (NULL without it), and the session's two slots in
+	// its fixed file table (file and data socket, set while a file is sent)
+	struct uring *uring;
+	int uringSlot;
+	int uringFiles;
+	// operations in flight, and the piece of the body they read and send:
+	// its registered buffer (-1 none), bytes read into it and sent from it
+	int uringOps;
+	int uringBuffer;
+	int uringRead, uringSent;
+	int uringFailed;
+	// closed with operations in flight, back to the pool once they complete
+	int draining;
+	// rate limits: the bucket of the client address (NULL no limit), bytes
+	// sent and charged to the buckets, the deficit of its turns, the part of
+	// DATA_BUDGET held back in this turn, and whether the scheduler runs it now
+	struct tokenBucket *clientBucket;
+	long long chargedBytes;
+	long long deficit;
+	int heldBudget;
+	int turn;
+	// waiting in the worker's queue for its turn, since throttleStart (microseconds)
+	int throttled;
+	long long throttleStart;
+	struct session *nextThrottled;
+	// number of the session in its worker's trace
+	unsigned int traceId;
+	// sessions closed during the current event loop pass, or free in the pool
+	struct session *nextClosed;
+};
+
+// io_uring of one worker, set up with raw system calls: the submission and
+// completion rings shared with the kernel, and an eventfd that epoll watches
+// to learn about completions
+struct uring {
+	int fd;
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+	struct io_uring_sqe *sqes;
+	unsigned *cqHead, *cqTail, *cqMask;
+	struct io_uring_cqe *cqes;
+	unsigned entries;
+	// entries queued since the last io_uring_enter()
+	unsigned queued;
+	struct connection notifier;
+	// registered buffers, and the indexes of the free ones
+	char *buffers;
+	int freeBuffers[URING_BUFFERS];
+	int numberFree;
+};
+
+// the event loop of one worker: an epoll instance with its own listener and sessions
+struct engine {
+	// worker number, and the thread running it
+	int worker;
+	pthread_t thread;
+	int epollFd;
+	struct connection listener;
+	int activeSessions;
+	// sessions waiting to retry their data connection
+	struct session *retryList;
+	// transfers waiting for their turn under the rate limits, in order
+	struct session *throttledHead, *throttledTail;
+	int throttledCount;
+	// trace ring of the worker (-t), and the last session number given out
+	struct traceRing *trace;
+	unsigned int traceSessions;
+	// sessions to free at the end of the event loop pass
+	struct session *closedList;
+	// preallocated session slots, each holding a session and its buffers
+	char *sessionSlab;
+	size_t slotSize;
+	struct session *freeSessions;
+	// io_uring backend, fd -1 when not used
+	struct uring uring;
+	struct metrics metrics;
+};
+
+// server settings from the command line
+struct settings {
+	int port;
+	// number of worker threads, each with its own listener
+	int workers;
+	// pin each worker thread to one core
+	int pinWorkers;
+	// sessions preallocated per worker
+	int maxSessions;
+	// keep the directory index (cleared by -n)
+	int useIndex;
+	// hot file cache budget in MiB, 0 turns the cache off
+	int cacheMegabytes;
+	// send file bodies with io_uring when the kernel has it (-u)
+	int useUring;
+	// local port of the Prometheus endpoint (-p), 0 for none
+	int metricsPort;
+	// bytes per second sent by the whole server (-r) and to each client
+	// address (-R), 0 no limit
+	long long totalRate;
+	long long clientRate;
+	// binary trace file (-t), NULL for none, and its starting verbosity (-v)
+	char *traceFile;
+	int traceLevel;
+};
+
+// settings are set in main() and only read afterwards
+struct settings settings;
+// event engines, one per worker, and the metrics of the worker running this thread
+struct engine *engines;
+__thread struct metrics *workerMetrics;
+// the directory index is set up before the workers start
+struct directoryIndex directoryIndex;
+struct fileCache fileCache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+struct digestCache digestCache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+// token buckets of the rate limits, shared by all workers
+struct tokenBucket totalBucket;
+struct tokenBucket *clientBuckets;
+// trace verbosity (changed by SIGUSR1 and SIGUSR2), the ring of the worker
+// running this thread, and the file the drainer writes with its event count
+volatile sig_atomic_t traceLevel;
+__thread struct traceRing *workerTrace;
+FILE *traceFile;
+long long traceWritten;
+// CRC32C table for CPUs without the CRC32C instruction, and whether it is there
+uint32_t crc32cTable[256];
+int crc32cHardware;
+// tables that move a CRC32C past CRC32C_BLOCK zero bytes, a byte of it each
+uint32_t crc32cShiftTable[4][256];
 
 /***************************** Function Declarations *************************************/
 
 int isNumber(char *str, int *n);
+long long parseSize(char *str);
 void stopServer(int sig);
-void receiveData(int socket, void *buffer, int size);
-void receivePacket(int socket, char *tag, char *data);
-char **listFiles(char *dirName, int *numberFiles);
-int controlConnection(int controlSocket, char *userCommand, int *dataPort, char* filename);
-int dataConnection(int controlSocket, int dataSocket, char *userCommand, char *filename);
-void sendData(int socket, void *buffer, int numberBytes);
-void handleRequest(int socket, char *tag, char *data);
-void startServer(int port);
+struct listing *listFiles(char *dirName);
+void releaseListing(struct listing *listing);
+unsigned int hashName(char *name);
+int sameTime(struct timespec *a, struct timespec *b);
+struct indexEntry **findEntry(char *name, unsigned int hash);
+void indexFile(char *name, struct stat *info);
+void unindexFile(char *name);
+void buildIndex(void);
+int allowedName(char *name);
+int lookupFile(char *name, struct fileEntry *file);
+struct listing *acquireListing(void);
+void *watchDirectory(void *arg);
+void startDirectoryIndex(void);
+struct cachedFile *acquireCachedFile(char *name, struct fileEntry *file);
+struct cachedFile *acquireCompressedFile(char *name, struct fileEntry *file, int level);
+struct cachedFile *lookupCachedFile(char *name, unsigned int hash, struct fileEntry *file, int level);
+struct cachedFile *storeCachedFile(struct cachedFile *loaded);
+struct cachedFile *findCachedFile(char *name, unsigned int hash, int level);
+void linkCachedFile(struct cachedFile *cached);
+void unlinkCachedFile(struct cachedFile *cached);
+void dropCachedFile(struct cachedFile *cached);
+void forgetCachedFile(char *name);
+void releaseCachedFile(struct cachedFile *cached);
+void initChecksums(void);
+uint32_t crc32cSoftware(uint32_t crc, const char *data, size_t length);
+uint32_t crc32cInstruction(uint32_t crc, const char *data, size_t length);
+uint32_t crc32cShift(uint32_t crc);
+uint32_t crc32c(uint32_t crc, const char *data, size_t length);
+void updateChecksum(struct session *session, const char *data, size_t length);
+void checksumFileBytes(struct session *session, int fd, off_t offset, size_t count);
+int findDigest(char *name, struct fileEntry *file, enum checksumType type, uint32_t *checksum);
+void storeDigest(char *name, struct fileEntry *file, enum checksumType type, uint32_t checksum);
+void forgetDigests(char *name);
+void benchmarkChecksums(void);
+long long currentTime(void);
+long long currentMicros(void);
+void countMetric(long long *counter, long long amount);
+int histogramBucket(long long value);
+long long bucketLimit(int bucket);
+void recordValue(struct histogram *histogram, long long value);
+long long histogramPercentile(struct histogram *histogram, double fraction);
+void collectMetrics(struct metrics *total, int *activeSessions, int *queuedTransfers);
+void foldCounters(struct session *session);
+int writeStats(char *text, int size);
+int writePrometheus(char *text, int size);
+void *serveMetrics(void *arg);
+void startMetricsEndpoint(void);
+void startRateLimits(void);
+long long rateBurst(long long rate);
+long long bucketWait(struct tokenBucket *bucket, long long rate, long long now);
+long long chargeSession(struct session *session);
+long long sessionWait(struct session *session, long long now);
+void throttleSession(struct engine *engine, struct session *session, long long now);
+void unthrottleSession(struct engine *engine, struct session *session, long long now);
+int runTransfer(struct engine *engine, struct session *session);
+int serveThrottled(struct engine *engine);
+void startTracing(void);
+void changeTraceLevel(int sig);
+void recordTrace(int event, struct session *session, long long bytes);
+void *drainTrace(void *arg);
+void traceCounters(long long *written, long long *dropped);
+void updateEvents(struct engine *engine, struct connection *conn, unsigned int events);
+void watchConnection(struct engine *engine, struct connection *conn, unsigned int events);
+int receiveData(struct connection *conn);
+int headerLength(struct connection *conn);
+int receivePacket(struct connection *conn, char *tag, char *data, int *dataLength);
+int controlConnection(struct engine *engine, struct session *session, char *tagIn, char *dataIn);
+int runCommand(struct engine *engine, struct session *session);
+void startTransfer(struct session *session);
+void finishTransfer(struct session *session);
+int reportTransfer(struct session *session, int closing);
+void closeListing(struct session *session);
+int findOption(char *payload, char *key, char *value, int size);
+int nextListedName(struct session *session, char **name, int *budget);
+int matchBatch(struct session *session);
+void addBatchName(struct session *session, char **patterns, int pattern, char *name);
+int scanBatch(struct session *session, int *budget);
+void readAheadBatch(struct session *session);
+int openBatchFile(struct session *session);
+int startDelta(struct session *session);
+int openDelta(struct session *session, struct fileEntry *file);
+int addSignatures(struct session *session, char *data, int dataLength);
+uint32_t blockAdler(const unsigned char *data, size_t length);
+int findBlock(struct delta *delta, uint32_t weak, const unsigned char *block);
+int fillWindow(struct session *session, off_t upTo);
+int scanDelta(struct session *session, int *budget);
+int queueLiteral(struct session *session, int *budget);
+void queueCopy(struct session *session, int *budget);
+int queueDelta(struct session *session, int *budget);
+void closeDelta(struct session *session);
+void nameUpload(struct session *session);
+int startUpload(struct session *session);
+int writeUpload(struct session *session, const char *data, size_t count, off_t offset);
+int drainUpload(struct session *session, off_t offset, size_t count);
+int receiveUpload(struct session *session, int *budget);
+int finishUpload(struct session *session);
+void closeUpload(struct session *session);
+int readFile(struct session *session, char *buffer, size_t count);
+void closeFile(struct session *session);
+int sendFileBody(struct session *session, int *budget);
+void queueFileChunk(struct session *session, int *budget);
+void queueCompressedChunk(struct session *session, int *budget);
+int dataConnection(struct session *session);
+int outputSpace(struct connection *conn);
+int pendingOutput(struct connection *conn);
+char *reserveOutput(struct connection *conn, int length);
+void commitOutput(struct connection *conn, char *start, int length);
+int sendData(struct connection *conn);
+void writePacketHeader(struct connection *conn, char *packet, char *tag, int dataLength);
+void handlePacketHeader(struct connection *conn, char *tag, int dataLength);
+void handlePacket(struct connection *conn, char *tag, char *data, int dataLength);
+void handleRequest(struct connection *conn, char *tag, char *data);
+int setupUring(struct uring *ring);
+struct io_uring_sqe *queueOperation(struct uring *ring);
+void submitOperations(struct uring *ring);
+int setUringFiles(struct session *session, int fileFd, int socketFd);
+int submitFileBody(struct session *session);
+void queueSend(struct session *session, int afterPoll);
+void completeOperations(struct engine *engine);
+void finishOperations(struct engine *engine, struct session *session);
+void cancelOperations(struct session *session);
+void createSessionPool(struct engine *engine);
+void openSession(struct engine *engine, int controlSocket, struct sockaddr_in *clientAddress);
+void closeSession(struct engine *engine, struct session *session);
+void freeClosedSessions(struct engine *engine);
+void openDataConnection(struct engine *engine, struct session *session);
+void retryDataConnection(struct engine *engine, struct session *session);
+int retryConnections(struct engine *engine);
+int replyRoom(struct connection *conn);
+void handleControl(struct engine *engine, struct session *session, unsigned int events);
+void handleData(struct engine *engine, struct session *session, unsigned int events);
+void acceptClients(struct engine *engine);
+int openListener(int port);
+void *runWorker(void *arg);
+void startServer(void);
 
 /********************************** Main Function ****************************************/
 
 int main(int argc, char **argv){
-	// port number that listens for client connections
-	int port; 
+	// command line option character
+	int option;
+	// default settings: one worker, not pinned
+	settings.workers = 1;
+	settings.pinWorkers = 0;
+	settings.maxSessions = DEFAULT_MAX_SESSIONS;
+	settings.useIndex = 1;
+	settings.cacheMegabytes = DEFAULT_CACHE_MB;
+	settings.traceLevel = DEFAULT_TRACE_LEVEL;
+	// read the options in front of the port number
+	// source: https://www.gnu.org/software/libc/manual/html_node/Using-Getopt.html
+	initChecksums();
+	while ((option = getopt(argc, argv, "w:ac:nm:ukp:r:R:t:v:")) != -1) {
+		switch (option) {
+		case 'w':
+			if (!isNumber(optarg, &settings.workers) || settings.workers < 1) {
+				fprintf(stderr, "ftserver: Workers must be a positive number!\n");
+				exit(1);
+			}
+			break;
+		case 'a':
+			settings.pinWorkers = 1;
+			break;
+		case 'n':
+			settings.useIndex = 0;
+			break;
+		case 'u':
+			settings.useUring = 1;
+			break;
+		case 'p':
+			if (!isNumber(optarg, &settings.metricsPort) || settings.metricsPort < 1) {
+				fprintf(stderr, "ftserver: Metrics port must be a number!\n");
+				exit(1);
+			}
+			break;
+		case 'k':
+			// measure the checksums, and serve nothing
+			benchmarkChecksums();
+			exit(0);
+		case 'm':
+			if (!isNumber(optarg, &settings.cacheMegabytes) || settings.cacheMegabytes < 0) {
+				fprintf(stderr, "ftserver: Cache size must be a number of megabytes!\n");
+				exit(1);
+			}
+			break;
+		case 'c':
+			if (!isNumber(optarg, &settings.maxSessions) || settings.maxSessions < 1) {
+				fprintf(stderr, "ftserver: Sessions must be a positive number!\n");
+				exit(1);
+			}
+			break;
+		case 'r':
+			if ((settings.totalRate = parseSize(optarg)) < 0) {
+				fprintf(stderr, "ftserver: Rate must be a number of bytes per second!\n");
+				exit(1);
+			}
+			break;
+		case 'R':
+			if ((settings.clientRate = parseSize(optarg)) < 0) {
+				fprintf(stderr, "ftserver: Client rate must be a number of bytes per second!\n");
+				exit(1);
+			}
+			break;
+		case 't':
+			settings.traceFile = optarg;
+			break;
+		case 'v':
+			if (!isNumber(optarg, &settings.traceLevel) || settings.traceLevel < TRACE_OFF || settings.traceLevel > TRACE_SENDS) {
+				fprintf(stderr, "ftserver: Trace level must be 0 to 3!\n");
+				exit(1);
+			}
+			break;
+		default:
+			fprintf(stderr, "Error: Use ftserver [-w <workers>] [-a] [-c <sessions>] [-n] [-m <megabytes>] [-u] [-k] [-p <metrics-port>] [-r <bytes/s>] [-R <bytes/s>] [-t <trace-file>] [-v <level>] <server-port>\n");
+			exit(1);
+		}
+	}
 	// check for server user input errors 
-	// server expects two command-line arguments, "ftserver" and the desired port number
-	if (argc != 2) {
-		fprintf(stderr, "Error: Use ftserver <server-port>\n");
+	// server expects one more argument, the desired port number
+	if (optind != argc - 1) {
+		fprintf(stderr, "Error: Use ftserver [-w <workers>] [-a] [-c <sessions>] [-n] [-m <megabytes>] [-u] [-k] [-p <metrics-port>] [-r <bytes/s>] [-R <bytes/s>] [-t <trace-file>] [-v <level>] <server-port>\n");
 		exit(1);
 	}
 	// port number must be a number
-	if (!isNumber(argv[1], &port)) {
+	if (!isNumber(argv[optind], &settings.port)) {
 		fprintf(stderr, "ftserver: Server port must be a number!\n");
 		exit(1);
 	}
 	// start the server until an interrupt signal is received
-	startServer(port);
+	startServer();
 
 	exit(0);
 }
@@ -100,6 +1000,27 @@ int isNumber(char *str, int *n){
 	return stringMatches == 1;
 }
 
+/******************************************************************************
+** parseSize()
+** Description: A function that reads a number of bytes, with an optional k,
+** m or g suffix (KiB, MiB, GiB), e.g. "64k". Used for the rate limits.
+** Parameters: string
+** Output: number of bytes, -1 when it is not a size
+******************************************************************************/
+long long parseSize(char *str){
+	char *end;
+	long long size = strtoll(str, &end, 10);
+	if (end == str || size < 0) {
+		return -1;
+	}
+	switch (*end) {
+	case 'k': case 'K': size <<= 10; end++; break;
+	case 'm': case 'M': size <<= 20; end++; break;
+	case 'g': case 'G': size <<= 30; end++; break;
+	}
+	return *end == '\0' ? size : -1;
+}
+
 /******************************************************************************
 ** stopServer()
 ** Description: A function that terminates the program and gives feedback before
@@ -135,14 +1056,18 @@ void stopServer(int sig){
 /******************************************************************************
 ** listFiles()
 ** Description: A function that lists all the files in the directory of the 
-** server. Invoked in dataConnection(), Program lists the file names to the 
-** client screen. 
-** Parameters: direectory name, and the number of files in the directory
-** Output: list of filenames
+** server, with their size and modification time. Invoked when the directory
+** index is built, and for every LIST when there is no index. Program lists the
+** file names to the client screen. 
+** Parameters: direectory name
+** Output: listing of the files, with one reference
 ******************************************************************************/
-char ** listFiles(char *dirName, int *numberFiles){
+struct listing *listFiles(char *dirName){
 	// set up return variable
-	char **fileList;      
+	struct listing *listing;
+	// name bytes used and allocated, list entries allocated
+	size_t namesLength, namesSize;
+	int filesSize;
 	DIR *dir; 
 	// set up directory variables
 	// source directory format: http://pubs.opengroup.org/onlinepubs/007908775/xsh/dirent.h.html
@@ -154,408 +1079,5378 @@ char ** listFiles(char *dirName, int *numberFiles){
 		fprintf(stderr, "ftserver: Error, cannot open %s\n", dirName);
 		exit(1);
 	}
-	// create the list of filenames in the current directory
-	*numberFiles = 0;
-	fileList = NULL;
+	listing = calloc(1, sizeof(struct listing));
+	assert(listing != NULL);
+	listing->references = 1;
+	namesLength = namesSize = 0;
+	filesSize = 0;
+	// create the list of files in the current directory
 	while ((entry = readdir(dir)) != NULL) {
-		// if there are subdirectories, ignore them
+		size_t length = strlen(entry->d_name) + 1;
+		// the entry type tells most subdirectories apart without a stat()
+		if (entry->d_type == DT_DIR) {
+			continue;
+		}
+		// if there are subdirectories, ignore them (and files removed meanwhile)
 		// source: http://www.gnu.org/software/libc/manual/html_node/Testing-File-Type.html
 	    // source: http://pubs.opengroup.org/onlinepubs/009695399/basedefs/sys/stat.h.html
-		stat(entry->d_name, &info);
-		if (S_ISDIR(info.st_mode)) {
+		if (stat(entry->d_name, &info) == -1 || S_ISDIR(info.st_mode)) {
 			continue;
 		}
-
-		{
-			// -- attach the current filename onto the list --
-			// allocate memory for new file name
-			if (fileList == NULL) {
-				fileList = malloc(sizeof(char *));
-			}
-			else {
-				fileList = realloc(fileList, (*numberFiles + 1) * sizeof(char *));
+		// grow the list and the names by doubling, so each file is copied a few times at most
+		if (listing->numberFiles == filesSize) {
+			filesSize = filesSize ? 2 * filesSize : 64;
+			listing->files = realloc(listing->files, filesSize * sizeof(struct fileEntry));
+			assert(listing->files != NULL);
+		}
+		if (namesLength + length > namesSize) {
+			namesSize = namesSize ? 2 * namesSize : 4096;
+			if (namesSize < namesLength + length) {
+				namesSize = namesLength + length;
 			}
-			// check for malloc() error
-			assert(fileList != NULL); 
-			fileList[*numberFiles] = malloc((strlen(entry->d_name) + 1) * sizeof(char));
-			assert(fileList[*numberFiles] != NULL); 
-			// copy the filename into the fileList
-			strcpy(fileList[*numberFiles], entry->d_name);
-			// increase the number of files listed
-			(*numberFiles)++;
+			listing->names = realloc(listing->names, namesSize);
+			assert(listing->names != NULL);
 		}
+		// the names may still move, keep the offset until the end
+		memcpy(listing->names + namesLength, entry->d_name, length);
+		listing->files[listing->numberFiles].name = (char *) namesLength;
+		listing->files[listing->numberFiles].size = info.st_size;
+		listing->files[listing->numberFiles].mtime = info.st_mtim;
+		listing->files[listing->numberFiles].ctime = info.st_ctim;
+		listing->files[listing->numberFiles].inode = info.st_ino;
+		namesLength += length;
+		// increase the number of files listed
+		listing->numberFiles++;
 	}
 	// close the current directory
 	closedir(dir);
-	return fileList;
+	// turn the offsets into names
+	for (int i = 0; i < listing->numberFiles; i++) {
+		listing->files[i].name = listing->names + (size_t) listing->files[i].name;
+	}
+	return listing;
 }
 
 /******************************************************************************
-** receiveData()
-** Description: A function that uses the recv() function to collect all the data
-** that is being sent. This function is used in the receivePacket function below.
-** Parameters: current socket endpoint to receive data, number of bytes to receive,
-** buffer to hold the number of bytes, changed.
+** releaseListing()
+** Description: A function that drops one reference to a listing, and frees it
+** with the last one. LIST transfers on any worker may hold the same snapshot.
+** Parameters: listing
 ** Output: none
 ******************************************************************************/
-void receiveData(int socket, void *buffer, int numberBytes){
-	// set up variables for recv(); ret return val
-	int ret;  
-	// total number of bytes received
-	int receivedBytes;     
-	// find the number of bytes received
-	receivedBytes = 0;
-	while (receivedBytes < numberBytes) {
-		ret = recv(socket, buffer + receivedBytes, numberBytes - receivedBytes, 0);
-		// if error in recv, exit
-		if (ret == -1) {
-			perror("recv");
-			exit(1);
+void releaseListing(struct listing *listing){
+	if (__atomic_sub_fetch(&listing->references, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(listing->files);
+		free(listing->names);
+		free(listing);
+	}
+}
+
+/******************************************************************************
+** hashName()
+** Description: A function that hashes a filename for the directory index.
+** Parameters: filename
+** Output: 32 bit FNV-1a hash
+** Source: http://www.isthe.com/chongo/tech/comp/fnv/
+******************************************************************************/
+unsigned int hashName(char *name){
+	unsigned int hash = 2166136261u;
+	while (*name != '\0') {
+		hash = (hash ^ (unsigned char) *name++) * 16777619u;
+	}
+	return hash;
+}
+
+/******************************************************************************
+** sameTime()
+** Description: A function that compares two file times to the nanosecond.
+** Parameters: two times
+** Output: 1 the same, 0 different
+******************************************************************************/
+int sameTime(struct timespec *a, struct timespec *b){
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/******************************************************************************
+** findEntry()
+** Description: A function that finds a file in the directory index. The index
+** lock must be held.
+** Parameters: filename, its hash
+** Output: link pointing at the entry, or at the NULL ending its bucket
+******************************************************************************/
+struct indexEntry **findEntry(char *name, unsigned int hash){
+	struct indexEntry **link = &directoryIndex.buckets[hash & (directoryIndex.bucketCount - 1)];
+	while (*link != NULL) {
+		if ((*link)->hash == hash && strcmp((*link)->file.name, name) == 0) {
+			break;
 		}
-		// add the number of bytes received, this will total the buffer needed
-		else {
-			receivedBytes += ret;
+		link = &(*link)->next;
+	}
+	return link;
+}
+
+/******************************************************************************
+** indexFile()
+** Description: A function that adds a file to the directory index, or updates
+** its size and time. The listing snapshot is dropped, the next LIST makes a new
+** one. The index write lock must be held.
+** Parameters: filename, file status
+** Output: none
+******************************************************************************/
+void indexFile(char *name, struct stat *info){
+	unsigned int hash = hashName(name);
+	struct indexEntry **link = findEntry(name, hash);
+	struct indexEntry *entry = *link;
+	if (entry == NULL) {
+		// entry and name in one allocation
+		entry = malloc(sizeof(struct indexEntry) + strlen(name) + 1);
+		assert(entry != NULL);
+		entry->hash = hash;
+		entry->file.name = (char *) (entry + 1);
+		strcpy(entry->file.name, name);
+		entry->next = NULL;
+		*link = entry;
+		directoryIndex.numberFiles++;
+		// keep about one file per bucket
+		if ((unsigned int) directoryIndex.numberFiles > directoryIndex.bucketCount) {
+			unsigned int oldCount = directoryIndex.bucketCount;
+			struct indexEntry **oldBuckets = directoryIndex.buckets;
+			directoryIndex.bucketCount *= 2;
+			directoryIndex.buckets = calloc(directoryIndex.bucketCount, sizeof(struct indexEntry *));
+			assert(directoryIndex.buckets != NULL);
+			for (unsigned int i = 0; i < oldCount; i++) {
+				while (oldBuckets[i] != NULL) {
+					struct indexEntry *moved = oldBuckets[i];
+					oldBuckets[i] = moved->next;
+					moved->next = directoryIndex.buckets[moved->hash & (directoryIndex.bucketCount - 1)];
+					directoryIndex.buckets[moved->hash & (directoryIndex.bucketCount - 1)] = moved;
+				}
+			}
+			free(oldBuckets);
 		}
 	}
+	entry->file.size = info->st_size;
+	entry->file.mtime = info->st_mtim;
+	entry->file.ctime = info->st_ctim;
+	entry->file.inode = info->st_ino;
+	if (directoryIndex.snapshot != NULL) {
+		releaseListing(directoryIndex.snapshot);
+		directoryIndex.snapshot = NULL;
+	}
 }
 
 /******************************************************************************
-** receivePacket()
-** Description: A function that receives a packet from the socket after the
-** connection is made. Used in the control connection.
-** Parameters: current socket endpoint to receive data, the 8 byte tag (has info 
-** about what action requested, data to transfer; data and tag are changed
+** unindexFile()
+** Description: A function that removes a file from the directory index. The
+** index write lock must be held.
+** Parameters: filename
 ** Output: none
-** Source: http://beej.us/guide/bgnet/output/html/singlepage/bgnet.html#sonofdataencap
 ******************************************************************************/
-void receivePacket(int socket, char *tag, char *data){
-	// set up variables for receiveing packet
-	// number of bytes in packet
-	unsigned short packetLength; 
-	// number of bytes in the data encapsulated
-	unsigned short dataLength;
-	// tempTag buffer made
-	char tempTag[TAG_LENGTH + 1];  
-	// tempPayload buffer made
-	char tempPayload[PAYLOAD_LENGTH + 1]; 
-	// call receiveData() to get packet length
-	receiveData(socket, &packetLength, sizeof(packetLength));
-	// source for byte order conversion: https://www.gnu.org/software/libc/manual/html_node/Byte-Order.html 
-	packetLength = ntohs(packetLength);
-	// call receiveData() to get the tag length
-	receiveData(socket, tempTag, TAG_LENGTH);
-	tempTag[TAG_LENGTH] = '\0';
-	if (tag != NULL) { strcpy(tag, tempTag); }
-	// call receiveData() to get the payload (data)
-	dataLength = packetLength - TAG_LENGTH - sizeof(packetLength);
-	receiveData(socket, tempPayload, dataLength);
-	tempPayload[dataLength] = '\0';
-	if (data != NULL) { strcpy(data, tempPayload); }
+void unindexFile(char *name){
+	struct indexEntry **link = findEntry(name, hashName(name));
+	struct indexEntry *entry = *link;
+	if (entry == NULL) {
+		return;
+	}
+	*link = entry->next;
+	free(entry);
+	directoryIndex.numberFiles--;
+	if (directoryIndex.snapshot != NULL) {
+		releaseListing(directoryIndex.snapshot);
+		directoryIndex.snapshot = NULL;
+	}
 }
 
 /******************************************************************************
-** controlConnection()
-** Description: A function that runs the connection to the client. The program 
-** prints to the client screen what actions are taking place, and changes the 
-** userCommand, dataPort and filename. Used in startServer.
-** Parameters: current socket endpoint to receive data, user command (from tag), 
-** data port number, and the filename
-** Output: 0 success, -1 error
+** buildIndex()
+** Description: A function that reads the whole directory into the index, at
+** start up and when inotify lost events. The index write lock must be held.
+** Parameters: none
+** Output: none
 ******************************************************************************/
-int controlConnection(int controlSocket, char *userCommand, int *dataPort, char* filename){
-	// set up variables, buffer for input and output
-	char dataIn[PAYLOAD_LENGTH + 1];  
-	char tagIn[TAG_LENGTH + 1];          
-	char dataOut[PAYLOAD_LENGTH + 1]; 
-	char tagOut[TAG_LENGTH + 1];        
-	// get the command(tag) and data
-	// call receivePacket() to get the data port
-	printf("  Receiving data port...\n");
-	receivePacket(controlSocket, tagIn, dataIn);
-	if (strcmp(tagIn, "DPORT") == 0) { *dataPort = atoi(dataIn); }
-	// call receivePacket to get client user command and filename
-	printf("  Receiving user command ...\n");
-	receivePacket(controlSocket, tagIn, dataIn);
-	strcpy(userCommand, tagIn);
-	strcpy(filename, dataIn);
-	// check if user entered the command (either -l or -g) correctly 
-	if (strcmp(tagIn, "LIST") != 0 && strcmp(tagIn, "GET") != 0) {
-		printf("  Sending command error ...\n");
-		strcpy(tagOut, "ERROR");
-		strcpy(dataOut, "Command must be either -l or -g");
-		handleRequest(controlSocket, tagOut, dataOut);
-		return -1;
+void buildIndex(void){
+	struct listing *listing = listFiles(".");
+	struct stat info;
+	// empty the index
+	for (unsigned int i = 0; i < directoryIndex.bucketCount; i++) {
+		while (directoryIndex.buckets[i] != NULL) {
+			struct indexEntry *entry = directoryIndex.buckets[i];
+			directoryIndex.buckets[i] = entry->next;
+			free(entry);
+		}
 	}
-	// after the above collects the: port, client user command and checks for errors,
-	// send the socket and client user command to handle the request (which sends data/file)
-	else {
-		printf("  Sending okay for data connection...\n");
-		strcpy(tagOut, "OKAY");
-		handleRequest(controlSocket, tagOut, "");
+	directoryIndex.numberFiles = 0;
+	if (directoryIndex.snapshot != NULL) {
+		releaseListing(directoryIndex.snapshot);
+		directoryIndex.snapshot = NULL;
+	}
+	// the listing read the directory already, keep it as the snapshot
+	memset(&info, 0, sizeof(info));
+	for (int i = 0; i < listing->numberFiles; i++) {
+		info.st_size = listing->files[i].size;
+		info.st_mtim = listing->files[i].mtime;
+		info.st_ctim = listing->files[i].ctime;
+		info.st_ino = listing->files[i].inode;
+		indexFile(listing->files[i].name, &info);
+	}
+	directoryIndex.snapshot = listing;
+}
+
+/******************************************************************************
+** allowedName()
+** Description: A function that checks that a client filename may name a file
+** of the server directory: only names in the directory, not paths, and no
+** hidden names, where the temporary files of uploads in progress live. GET,
+** DELTA, MGET and PUT all check their names with it.
+** Parameters: filename
+** Output: 1 allowed, 0 refused
+******************************************************************************/
+int allowedName(char *name){
+	return name[0] != '\0' && name[0] != '.' && strchr(name, '/') == NULL;
+}
+
+/******************************************************************************
+** lookupFile()
+** Description: A function that checks that a client filename is a file of the
+** server directory. With the index this is one hash lookup; without it, the
+** name is checked with stat(). Used in startTransfer().
+** Parameters: filename, file entry (size, times and inode are changed)
+** Output: 1 file found, 0 not found
+******************************************************************************/
+int lookupFile(char *name, struct fileEntry *file){
+	struct indexEntry *entry;
+	struct stat info;
+	if (!allowedName(name)) {
+		countMetric(&workerMetrics->lookupMisses, 1);
 		return 0;
 	}
+	if (!directoryIndex.enabled) {
+		if (stat(name, &info) == -1 || S_ISDIR(info.st_mode)) {
+			countMetric(&workerMetrics->lookupMisses, 1);
+			return 0;
+		}
+		file->size = info.st_size;
+		file->mtime = info.st_mtim;
+		file->ctime = info.st_ctim;
+		file->inode = info.st_ino;
+		countMetric(&workerMetrics->lookupHits, 1);
+		return 1;
+	}
+	pthread_rwlock_rdlock(&directoryIndex.lock);
+	entry = *findEntry(name, hashName(name));
+	if (entry != NULL) {
+		file->size = entry->file.size;
+		file->mtime = entry->file.mtime;
+		file->ctime = entry->file.ctime;
+		file->inode = entry->file.inode;
+	}
+	pthread_rwlock_unlock(&directoryIndex.lock);
+	countMetric(entry != NULL ? &workerMetrics->lookupHits : &workerMetrics->lookupMisses, 1);
+	return entry != NULL;
 }
 
 /******************************************************************************
-** dataConnection()
-** Description: A function that runs the client file transfer connection. The program 
-** prints to the client screen what actions are taking place. Used in startServer().
-** Parameters: server endpoints (2) for data connection and for control connection, 
-** the user command (from tag), and the filename to be transferred (if requested)
-** Output: 0 success, -1 error
+** acquireListing()
+** Description: A function that gets the listing a LIST transfer sends from
+** the index. Every LIST until the next change shares one snapshot, made from
+** the index without reading the directory. Used in startTransfer().
+** Parameters: none
+** Output: listing, with one reference for the caller
 ******************************************************************************/
-int dataConnection(int controlSocket, int dataSocket, char *userCommand, char *filename){
-	int ret = 0; 
-	// list of filenames and the number of files in the current dir
-	char **fileList; 
-	int numberFiles;   
-	// call listFiles() to get the files in the current directory
-	fileList = listFiles(".", &numberFiles);
-	// if client user command to list the filenames, then call handleRequest() to send names
-	if (strcmp(userCommand, "LIST") == 0) {
-		// transfer each name in it's own packet
-		printf("  Sending file listing ...\n");
-		for (int i = 0; i < numberFiles; i++) {
-			handleRequest(dataSocket, "FNAME", fileList[i]);
-		}
-	}
-	// if client user command to get a file, 
-	// then call handleRequest() to either send file or error/already exists
-	else if (strcmp(userCommand, "GET") == 0) {
-		do {
-			char buffer[PAYLOAD_LENGTH + 1]; 
-			// make variables for handling files
-			// number of bytes in file (use fread() to get)
-			int bytesRead;  
-			// used to set if file exists or not
-			int fileExists; 
-			FILE *infile;   
-			// for all files in directory, compare the filename with the names in dir list
-			fileExists = 0;
-			for (int i = 0; i < numberFiles && !fileExists; i++) {
-				if (strcmp(filename, fileList[i]) == 0) {
-					fileExists = 1;
-				}
+struct listing *acquireListing(void){
+	struct listing *listing;
+	pthread_rwlock_rdlock(&directoryIndex.lock);
+	listing = directoryIndex.snapshot;
+	if (listing != NULL) {
+		__atomic_add_fetch(&listing->references, 1, __ATOMIC_RELAXED);
+	}
+	pthread_rwlock_unlock(&directoryIndex.lock);
+	if (listing != NULL) {
+		return listing;
+	}
+	// no snapshot since the last change: make one from the index
+	pthread_rwlock_wrlock(&directoryIndex.lock);
+	if (directoryIndex.snapshot == NULL) {
+		size_t namesLength = 0;
+		int n = 0;
+		for (unsigned int i = 0; i < directoryIndex.bucketCount; i++) {
+			for (struct indexEntry *entry = directoryIndex.buckets[i]; entry != NULL; entry = entry->next) {
+				namesLength += strlen(entry->file.name) + 1;
 			}
-			// if the filename does not exsist, send error
-			if (!fileExists) {
-				printf("  Sending file error ...\n");
-				handleRequest(controlSocket, "ERROR", "Error: File not found");
-				ret = -1;
-				break;
+		}
+		listing = calloc(1, sizeof(struct listing));
+		assert(listing != NULL);
+		listing->files = malloc((directoryIndex.numberFiles + 1) * sizeof(struct fileEntry));
+		listing->names = malloc(namesLength + 1);
+		assert(listing->files != NULL && listing->names != NULL);
+		namesLength = 0;
+		for (unsigned int i = 0; i < directoryIndex.bucketCount; i++) {
+			for (struct indexEntry *entry = directoryIndex.buckets[i]; entry != NULL; entry = entry->next) {
+				listing->files[n] = entry->file;
+				listing->files[n].name = listing->names + namesLength;
+				strcpy(listing->files[n].name, entry->file.name);
+				namesLength += strlen(entry->file.name) + 1;
+				n++;
 			}
+		}
+		listing->numberFiles = n;
+		// the index keeps one reference until the next change
+		listing->references = 1;
+		directoryIndex.snapshot = listing;
+	}
+	listing = directoryIndex.snapshot;
+	__atomic_add_fetch(&listing->references, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&directoryIndex.lock);
+	return listing;
+}
 
-			// open file, if file will not open, send error
-			infile = fopen(filename, "r");
-			if (infile == NULL) {
-				printf("  Sending cannot open error ...\n");
-				handleRequest(controlSocket, "ERROR", "Error: cannot open file");
-				ret = -1;
-				break;
-			}
-			// call handleRequest() to transfer name of file
-			handleRequest(dataSocket, "FILE", filename);
-
-			// call handleRequest() to transfer the actual file
-			// source: http://stackoverflow.com/questions/8589425/how-does-fread-really-work
-			printf("  Sending file ...\n");
-			do {
-				bytesRead = fread(buffer, sizeof(char), PAYLOAD_LENGTH, infile);
-				buffer[bytesRead] = '\0';
-				handleRequest(dataSocket, "FILE", buffer);
-			} while (bytesRead > 0);
-			if (ferror(infile)) {
-				perror("fread");
-				ret = -1;
+/******************************************************************************
+** watchDirectory()
+** Description: A function that runs the thread keeping the directory index up
+** to date. Each inotify event names a file that was created, changed, moved or
+** removed; the file is looked at again and its entry updated. When inotify
+** dropped events, the whole directory is read again. Started by
+** startDirectoryIndex().
+** Parameters: none
+** Output: none, runs until the server is stopped
+** Source: http://man7.org/linux/man-pages/man7/inotify.7.html
+******************************************************************************/
+void *watchDirectory(void *arg){
+	// events are read many at a time, aligned for struct inotify_event
+	char buffer[16384] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t length;
+	(void) arg;
+	while (1) {
+		length = read(directoryIndex.inotifyFd, buffer, sizeof(buffer));
+		if (length == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("inotify read");
+			exit(1);
+		}
+		for (char *next = buffer; next < buffer + length; ) {
+			struct inotify_event *event = (struct inotify_event *) next;
+			struct stat info;
+			int exists;
+			next += sizeof(struct inotify_event) + event->len;
+			// events were lost, start over
+			if (event->mask & IN_Q_OVERFLOW) {
+				pthread_rwlock_wrlock(&directoryIndex.lock);
+				buildIndex();
+				pthread_rwlock_unlock(&directoryIndex.lock);
+				continue;
+			}
+			if (event->len == 0) {
+				continue;
+			}
+			// look at the file before taking the lock, it may be gone already
+			exists = !(event->mask & (IN_DELETE | IN_MOVED_FROM)) &&
+				stat(event->name, &info) == 0 && !S_ISDIR(info.st_mode);
+			pthread_rwlock_wrlock(&directoryIndex.lock);
+			if (exists) {
+				indexFile(event->name, &info);
+			}
+			else {
+				unindexFile(event->name);
+			}
+			pthread_rwlock_unlock(&directoryIndex.lock);
+			// written to: the copies may hold bytes from before, even where the
+			// times and size came out the same
+			if (event->mask & (IN_MODIFY | IN_CLOSE_WRITE)) {
+				forgetCachedFile(event->name);
+				forgetDigests(event->name);
 			}
-			fclose(infile);
+		}
+	}
+	return NULL;
+}
 
-		} while (0);
+/******************************************************************************
+** startDirectoryIndex()
+** Description: A function that builds the directory index and starts the
+** thread keeping it up to date. When inotify is not available the server runs
+** without the index, GET checks the file with stat() and LIST streams the
+** directory. Used in
+** startServer().
+** Parameters: none
+** Output: none
+******************************************************************************/
+void startDirectoryIndex(void){
+	directoryIndex.enabled = 0;
+	if (!settings.useIndex) {
+		return;
 	}
-	// if we get here, there is an error in the client user command tag
-	else {
-		fprintf(stderr, "ftserver: User command must be \"LIST\" or "
-			"\"GET\"; received \"%s\"\n", userCommand);
-		ret = -1;
+	directoryIndex.inotifyFd = inotify_init1(IN_CLOEXEC);
+	// watch first, so that no change slips in between reading and watching
+	if (directoryIndex.inotifyFd == -1 ||
+		inotify_add_watch(directoryIndex.inotifyFd, ".", WATCH_EVENTS | IN_ONLYDIR) == -1) {
+		perror("inotify");
+		fprintf(stderr, "ftserver: Running without the directory index\n");
+		if (directoryIndex.inotifyFd != -1) {
+			close(directoryIndex.inotifyFd);
+		}
+		return;
 	}
-	// final FT tag must be labeled DONE, so that the client knows transfer is complete
-	handleRequest(dataSocket, "DONE", "");
-	// user (client) is sent close request
-	printf("  Sending okay for closing connection...\n");
-	handleRequest(controlSocket, "CLOSE", "");
-	// free memory from fileList
-	for (int i = 0; i < numberFiles; i++) {
-		free(fileList[i]);
+	pthread_rwlock_init(&directoryIndex.lock, NULL);
+	directoryIndex.bucketCount = INDEX_BUCKETS;
+	directoryIndex.buckets = calloc(directoryIndex.bucketCount, sizeof(struct indexEntry *));
+	assert(directoryIndex.buckets != NULL);
+	buildIndex();
+	if (pthread_create(&directoryIndex.thread, NULL, watchDirectory, NULL) != 0) {
+		fprintf(stderr, "ftserver: Cannot start the directory watcher\n");
+		exit(1);
 	}
-	free(fileList);
-	return ret;
+	directoryIndex.enabled = 1;
+	printf("ftserver: Indexed %d files\n", directoryIndex.numberFiles);
 }
 
 /******************************************************************************
-** sendData()
-** Description: A function that uses send() to transfer all the bytes of data to 
-** the client. Used in handleRequest.
-** Parameters: current socket endpoint to send from, the data buffer and the number
-** of bytes to be sent.
-** Output: none
-******************************************************************************/
-void sendData(int socket, void *buffer, int numberBytes){
-	// set up variables for send(); ret return val
-	int ret;    
-	// number of bytes to be sent
-	int sentBytes;    
-	// send the number of bytes
-	// source: http://pubs.opengroup.org/onlinepubs/009695399/functions/send.html
-	sentBytes = 0;
-	while (sentBytes < numberBytes) {
-		ret = send(socket, buffer + sentBytes, numberBytes - sentBytes, 0);
-		// if send() returns an error, exit
-		if (ret == -1) {
-			perror("send");
-			exit(1);
+** acquireCachedFile()
+** Description: A function that finds a file in the hot file cache, or reads
+** it in. Cached files are copies in anonymous memory, keyed by name and by the
+** inode, times and size the index has for the file, so a changed file is read
+** again, and a write that inotify reports drops the copies at once. A copy
+** (unlike a mapping of the file) cannot fault when the file is cut short while
+** being sent. The file is read without the cache lock; files bigger than an
+** eighth of the budget are not cached. Used in startTransfer().
+** Parameters: filename, its index entry
+** Output: cached file with one reference for the caller, NULL not cached
+** Source: http://man7.org/linux/man-pages/man2/mmap.2.html
+******************************************************************************/
+struct cachedFile *acquireCachedFile(char *name, struct fileEntry *file){
+	unsigned int hash = hashName(name);
+	struct cachedFile *cached, *loaded;
+	int fd;
+	ssize_t bytesRead;
+	off_t total;
+	struct stat info;
+	if (fileCache.budget == 0 || file->size == 0 || (size_t) file->size > fileCache.budget / 8) {
+		return NULL;
+	}
+	cached = lookupCachedFile(name, hash, file, 0);
+	if (cached != NULL) {
+		return cached;
+	}
+	// miss: copy the file into fresh memory
+	fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return NULL;
+	}
+	if (fstat(fd, &info) == -1 || info.st_size != file->size) {
+		close(fd);
+		return NULL;
+	}
+	loaded = calloc(1, sizeof(struct cachedFile) + strlen(name) + 1);
+	assert(loaded != NULL);
+	loaded->data = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (loaded->data == MAP_FAILED) {
+		perror("mmap");
+		free(loaded);
+		close(fd);
+		return NULL;
+	}
+	for (total = 0; total < info.st_size; total += bytesRead) {
+		bytesRead = pread(fd, loaded->data + total, info.st_size - total, total);
+		if (bytesRead <= 0) {
+			break;
 		}
-		// add the data sent (from ret) to sent data
-		else {
-			sentBytes += ret;
+	}
+	close(fd);
+	if (total != info.st_size) {
+		munmap(loaded->data, info.st_size);
+		free(loaded);
+		return NULL;
+	}
+	loaded->name = (char *) (loaded + 1);
+	strcpy(loaded->name, name);
+	loaded->hash = hash;
+	loaded->inode = info.st_ino;
+	loaded->mtime = info.st_mtim;
+	loaded->ctime = info.st_ctim;
+	loaded->original = info.st_size;
+	loaded->size = info.st_size;
+	return storeCachedFile(loaded);
+}
+
+/******************************************************************************
+** acquireCompressedFile()
+** Description: A function that finds the precompressed copy of a file in the
+** hot file cache, or makes it: the plain copy is deflated in one go, without
+** the cache lock. Precompressed copies sit in the cache next to the plain
+** ones, keyed also by their level, so repeated GETs of a hot file cost no
+** compression. Used in startTransfer().
+** Parameters: filename, its index entry, deflate level
+** Output: cached deflate stream with one reference for the caller, NULL not cached
+** Source: https://zlib.net/manual.html
+******************************************************************************/
+struct cachedFile *acquireCompressedFile(char *name, struct fileEntry *file, int level){
+	unsigned int hash = hashName(name);
+	struct cachedFile *cached, *plain, *loaded;
+	uLongf length;
+	size_t bound;
+	if (fileCache.budget == 0 || file->size == 0 || (size_t) file->size > fileCache.budget / 8) {
+		return NULL;
+	}
+	cached = lookupCachedFile(name, hash, file, level);
+	if (cached != NULL) {
+		return cached;
+	}
+	// miss: compress the plain copy (which is cached on the way)
+	plain = acquireCachedFile(name, file);
+	if (plain == NULL) {
+		return NULL;
+	}
+	bound = compressBound(plain->size);
+	loaded = calloc(1, sizeof(struct cachedFile) + strlen(name) + 1);
+	assert(loaded != NULL);
+	loaded->data = mmap(NULL, bound, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (loaded->data == MAP_FAILED) {
+		perror("mmap");
+		free(loaded);
+		releaseCachedFile(plain);
+		return NULL;
+	}
+	length = bound;
+	if (compress2((Bytef *) loaded->data, &length, (Bytef *) plain->data, plain->size, level) != Z_OK) {
+		fprintf(stderr, "ftserver: Cannot compress \"%s\"\n", name);
+		munmap(loaded->data, bound);
+		free(loaded);
+		releaseCachedFile(plain);
+		return NULL;
+	}
+	// give back the pages past the end of the stream
+	loaded->data = mremap(loaded->data, bound, length, 0);
+	assert(loaded->data != MAP_FAILED);
+	loaded->name = (char *) (loaded + 1);
+	strcpy(loaded->name, name);
+	loaded->hash = hash;
+	loaded->inode = plain->inode;
+	loaded->mtime = plain->mtime;
+	loaded->ctime = plain->ctime;
+	loaded->original = plain->original;
+	loaded->level = level;
+	loaded->size = length;
+	releaseCachedFile(plain);
+	return storeCachedFile(loaded);
+}
+
+/******************************************************************************
+** lookupCachedFile()
+** Description: A function that looks up a copy of a file in the hot file
+** cache, and counts the hit or miss. A hit moves to the newest end of the LRU
+** list. Used by the acquire functions before they make a copy.
+** Parameters: filename, its hash, its index entry, deflate level (0 plain copy)
+** Output: cached file with one reference for the caller, NULL not cached
+******************************************************************************/
+struct cachedFile *lookupCachedFile(char *name, unsigned int hash, struct fileEntry *file, int level){
+	struct cachedFile *cached;
+	pthread_mutex_lock(&fileCache.lock);
+	cached = findCachedFile(name, hash, level);
+	if (cached != NULL && cached->inode == file->inode && cached->original == file->size &&
+		sameTime(&cached->mtime, &file->mtime) && sameTime(&cached->ctime, &file->ctime)) {
+		cached->references++;
+		unlinkCachedFile(cached);
+		linkCachedFile(cached);
+		fileCache.hits++;
+		pthread_mutex_unlock(&fileCache.lock);
+		return cached;
+	}
+	fileCache.misses++;
+	pthread_mutex_unlock(&fileCache.lock);
+	return NULL;
+}
+
+/******************************************************************************
+** storeCachedFile()
+** Description: A function that puts a new copy of a file in the hot file
+** cache. It replaces the old copy of a changed file, and evicts the oldest
+** files nobody is sending until it fits. Used by the acquire functions.
+** Parameters: new copy, not yet in the cache
+** Output: cached file with one reference for the caller (the new copy, or
+** the same copy another worker stored meanwhile)
+******************************************************************************/
+struct cachedFile *storeCachedFile(struct cachedFile *loaded){
+	struct cachedFile *cached;
+	loaded->references = 1;
+	pthread_mutex_lock(&fileCache.lock);
+	// another worker may have read the same file meanwhile
+	cached = findCachedFile(loaded->name, loaded->hash, loaded->level);
+	if (cached != NULL && cached->inode == loaded->inode && cached->original == loaded->original &&
+		sameTime(&cached->mtime, &loaded->mtime) && sameTime(&cached->ctime, &loaded->ctime)) {
+		cached->references++;
+		pthread_mutex_unlock(&fileCache.lock);
+		munmap(loaded->data, loaded->size);
+		free(loaded);
+		return cached;
+	}
+	// drop the old copy of a changed file, then make room
+	if (cached != NULL) {
+		dropCachedFile(cached);
+	}
+	while (fileCache.used + loaded->size > fileCache.budget) {
+		struct cachedFile *oldest = fileCache.oldest;
+		// files being sent stay, look further
+		while (oldest != NULL && oldest->references > 0) {
+			oldest = oldest->newer;
 		}
+		if (oldest == NULL) {
+			break;
+		}
+		dropCachedFile(oldest);
+		fileCache.evictions++;
+	}
+	// no room: send this copy, and free it afterwards
+	if (fileCache.used + loaded->size > fileCache.budget) {
+		loaded->stale = 1;
+		pthread_mutex_unlock(&fileCache.lock);
+		return loaded;
 	}
+	loaded->next = fileCache.buckets[loaded->hash % CACHE_BUCKETS];
+	fileCache.buckets[loaded->hash % CACHE_BUCKETS] = loaded;
+	linkCachedFile(loaded);
+	fileCache.used += loaded->size;
+	pthread_mutex_unlock(&fileCache.lock);
+	return loaded;
 }
 
 /******************************************************************************
-** handleRequest()
-** Description: A function that sends packet(s) from the server to the client. 
-** Used in controlConnection() and dataConnection().
-** Parameters: current socket endpoint to send from, the data buffer and the tag
+** findCachedFile()
+** Description: A function that finds a file in the cache hash table. The
+** cache lock must be held.
+** Parameters: filename, its hash, deflate level (0 plain copy)
+** Output: cached file, NULL not cached
+******************************************************************************/
+struct cachedFile *findCachedFile(char *name, unsigned int hash, int level){
+	struct cachedFile *cached = fileCache.buckets[hash % CACHE_BUCKETS];
+	while (cached != NULL && (cached->hash != hash || cached->level != level || strcmp(cached->name, name) != 0)) {
+		cached = cached->next;
+	}
+	return cached;
+}
+
+/******************************************************************************
+** linkCachedFile()
+** Description: A function that puts a cached file at the newest end of the
+** LRU list. The cache lock must be held.
+** Parameters: cached file
 ** Output: none
 ******************************************************************************/
-void handleRequest(int socket, char *tag, char *data){
-	// set variables for handling packets
-	// number of bytes in packet
-	unsigned short packetLength;
-	// tag buffer (set at 8 bytes)
-	char tagBuffer[TAG_LENGTH];            
-	// call sendData() to send the packet length
-	packetLength = htons(sizeof(packetLength) + TAG_LENGTH + strlen(data));
-	sendData(socket, &packetLength, sizeof(packetLength));
-	// call sendData() to send the tag
-	memset(tagBuffer, '\0', TAG_LENGTH);   
-	strcpy(tagBuffer, tag);
-	sendData(socket, tagBuffer, TAG_LENGTH);
-	// finally, call sendData() to send the list/files (will call many times)
-	sendData(socket, data, strlen(data));
+void linkCachedFile(struct cachedFile *cached){
+	cached->newer = NULL;
+	cached->older = fileCache.newest;
+	if (fileCache.newest != NULL) {
+		fileCache.newest->newer = cached;
+	}
+	else {
+		fileCache.oldest = cached;
+	}
+	fileCache.newest = cached;
 }
 
 /******************************************************************************
-** startServer()
-** Description: A function that listens on inputed port, and interacts with 
-** one client user, and remains open after the user connection terminates for 
-** more client users. Used in main function. 
-** Parameters: port that server user enters
+** unlinkCachedFile()
+** Description: A function that takes a cached file out of the LRU list. The
+** cache lock must be held.
+** Parameters: cached file
 ** Output: none
 ******************************************************************************/
-void startServer(int port){
-	// endpoint socket that receives requests
-	int serverSocket;                 
-	int status;  
-	// set up signal for handling ctrl c exit
-	struct sigaction interrupt; 
-	// get server address
-	struct sockaddr_in serverAddress; 
-	// specify what type of socket addressing used (IPv4)
-	serverAddress.sin_family = AF_INET; 
-	// convert address host to network short
-	serverAddress.sin_port = htons(port);   
-	// bind socket to INNADD_ANY (all available interfaces, not just localhost)
-	// source: http://stackoverflow.com/questions/16508685/understanding-inaddr-any-for-socket-programming-c 
-	serverAddress.sin_addr.s_addr = INADDR_ANY; 
-	// set the server side socket
-	serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-	if (serverSocket == -1) {
-		perror("socket");
-		exit(1);
+void unlinkCachedFile(struct cachedFile *cached){
+	if (cached->older != NULL) {
+		cached->older->newer = cached->newer;
 	}
-	// bind the new server socket with the port
-	status = bind(serverSocket, (struct sockaddr*) &serverAddress, sizeof(serverAddress));
-	if (status == -1) {
-		perror("bind");
-		exit(1);
+	else {
+		fileCache.oldest = cached->newer;
 	}
-	// listen for client user connections, up to 10
-	status = listen(serverSocket, 10);
-	if (status == -1) {
-		perror("listen");
-		exit(1);
+	if (cached->newer != NULL) {
+		cached->newer->older = cached->older;
 	}
-	// ready stopServer() to catch any interrupt signals
-	interrupt.sa_handler = &stopServer;
-	interrupt.sa_flags = 0;
-	sigemptyset(&interrupt.sa_mask);
-	status = sigaction(SIGINT, &interrupt, 0);
-	if (status == -1) {
-		perror("sigaction");
-		exit(1);
+	else {
+		fileCache.newest = cached->older;
 	}
-	// start running on port, waiting for client user connections (data or control)
-	printf("ftserver: Server open on port %d\n", port);
-	while (1) {
-		// variable for printing client IP (in decimal form)
-		char *clientIPv4; 
-		// variables for command tags and filename buffers
-		char userCommand[TAG_LENGTH + 1];      
-		char filename[PAYLOAD_LENGTH + 1]; 
-		// server side socket endpoints
-		int controlSocket, dataSocket;   
-		// client data port number
-		int dataPort;
-		// address struct length
-		// http://pubs.opengroup.org/onlinepubs/7908799/xns/syssocket.h.html
-		socklen_t addrLen;                 
-		struct sockaddr_in clientAddress;  
-		// start file transfer connection with client
-		addrLen = sizeof(struct sockaddr_in);
-		controlSocket = accept(serverSocket, (struct sockaddr *) &clientAddress, &addrLen);
-		if (controlSocket == -1) {
-			perror("accept");
-			exit(1);
-		}
-		// 
-		clientIPv4 = inet_ntoa(clientAddress.sin_addr);
-		printf("\nftserver: Control connection established with \"%s\"\n", clientIPv4);
-		// controlConnection() to send/receive packets with client user requests
-		status = controlConnection(controlSocket, userCommand, &dataPort, filename);
-		// if packets understood, proceed to the data connection (where fileList or files are sent)
-		if (status != -1) {
-			int connectionAttempts; 
-			// set server side endpoint for data connection
-			dataSocket = socket(AF_INET, SOCK_STREAM, 0);
-			if (dataSocket == -1) {
-				perror("socket");
-				exit(1);
-			}
-			// start data connection with client user
-			clientAddress.sin_port = htons(dataPort);
-			connectionAttempts = 0;
-			do {
-				status = connect(dataSocket, (struct sockaddr *) &clientAddress, sizeof(clientAddress));
-			// max number of connection attempts is set at 10
-			} while (status == -1 && connectionAttempts < 10);
-			if (status == -1) {
-				perror("connect");
-				exit(1);
-			}
-			printf("ftserver: Data connection established with \"%s\"\n", clientIPv4);
+}
 
-			// call dataConnection to transfer file list or files to client user
-			dataConnection(controlSocket, dataSocket, userCommand, filename);
-			// wait to receive packet from user that the trasfer or listing is DONE (in tag)
-			receivePacket(controlSocket, NULL, NULL);
-			// close the data connection, client can reconnect for more interactions
-			status = close(dataSocket);
-			if (status == -1) {
-				perror("close");
-				exit(1);
-			}
-			printf("ftserver: Data connection closed\n");
+/******************************************************************************
+** dropCachedFile()
+** Description: A function that removes a file from the cache. It is freed
+** now, or by the last session still sending it. The cache lock must be held.
+** Parameters: cached file
+** Output: none
+******************************************************************************/
+void dropCachedFile(struct cachedFile *cached){
+	struct cachedFile **link = &fileCache.buckets[cached->hash % CACHE_BUCKETS];
+	while (*link != cached) {
+		link = &(*link)->next;
+	}
+	*link = cached->next;
+	unlinkCachedFile(cached);
+	fileCache.used -= cached->size;
+	cached->stale = 1;
+	if (cached->references == 0) {
+		munmap(cached->data, cached->size);
+		free(cached);
+	}
+}
+
+/******************************************************************************
+** forgetCachedFile()
+** Description: A function that drops every copy of a file (plain and
+** precompressed) from the hot file cache, when inotify reports that it was
+** written to. Copies being sent are freed with their last reference.
+** Parameters: filename
+** Output: none
+******************************************************************************/
+void forgetCachedFile(char *name){
+	unsigned int hash = hashName(name);
+	struct cachedFile *cached, *next;
+	pthread_mutex_lock(&fileCache.lock);
+	for (cached = fileCache.buckets[hash % CACHE_BUCKETS]; cached != NULL; cached = next) {
+		next = cached->next;
+		if (cached->hash == hash && strcmp(cached->name, name) == 0) {
+			dropCachedFile(cached);
 		}
 	}
-}
\ No newline at end of file
+	pthread_mutex_unlock(&fileCache.lock);
+}
+
+/******************************************************************************
+** releaseCachedFile()
+** Description: A function that drops a session's reference to a cached file.
+** A file that left the cache meanwhile is freed with the last reference.
+** Parameters: cached file
+** Output: none
+******************************************************************************/
+void releaseCachedFile(struct cachedFile *cached){
+	int freeFile;
+	pthread_mutex_lock(&fileCache.lock);
+	cached->references--;
+	freeFile = cached->stale && cached->references == 0;
+	pthread_mutex_unlock(&fileCache.lock);
+	if (freeFile) {
+		munmap(cached->data, cached->size);
+		free(cached);
+	}
+}
+
+/******************************************************************************
+** initChecksums()
+** Description: A function that builds the CRC32C table (reflected Castagnoli
+** polynomial), and the shift tables: a CRC is linear, so moving it past a
+** block of zero bytes is the XOR of moving each of its 32 bits. It also
+** checks whether the CPU has the CRC32C instruction (SSE4.2 on x86, the CRC
+** extension on ARMv8). Used in main().
+** Parameters: none
+** Output: none
+** Source: https://www.rfc-editor.org/rfc/rfc3720#appendix-B.4
+******************************************************************************/
+void initChecksums(void){
+	uint32_t shifted[32];
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++) {
+			crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+		}
+		crc32cTable[i] = crc;
+	}
+	for (int bit = 0; bit < 32; bit++) {
+		shifted[bit] = (uint32_t) 1 << bit;
+		for (int i = 0; i < CRC32C_BLOCK; i++) {
+			shifted[bit] = crc32cTable[shifted[bit] & 0xFF] ^ (shifted[bit] >> 8);
+		}
+	}
+	for (int byte = 0; byte < 4; byte++) {
+		for (int value = 0; value < 256; value++) {
+			crc32cShiftTable[byte][value] = 0;
+			for (int bit = 0; bit < 8; bit++) {
+				if (value & (1 << bit)) {
+					crc32cShiftTable[byte][value] ^= shifted[byte * 8 + bit];
+				}
+			}
+		}
+	}
+#if defined(__x86_64__)
+	crc32cHardware = __builtin_cpu_supports("sse4.2");
+#elif defined(__aarch64__)
+	crc32cHardware = (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#endif
+}
+
+/******************************************************************************
+** crc32cSoftware()
+** Description: A function that continues a CRC32C a byte at a time with the
+** table, for CPUs without the instruction. Like zlib's crc32(), it starts
+** from 0 and returns the finished value.
+** Parameters: checksum so far, bytes, number of bytes
+** Output: checksum
+******************************************************************************/
+uint32_t crc32cSoftware(uint32_t crc, const char *data, size_t length){
+	const unsigned char *byte = (const unsigned char *) data;
+	crc = ~crc;
+	while (length-- > 0) {
+		crc = crc32cTable[(crc ^ *byte++) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+/******************************************************************************
+** crc32cInstruction()
+** Description: A function that continues a CRC32C eight bytes per CRC32C
+** instruction. The instruction takes a few cycles before its result can be
+** used again, so three blocks are checksummed side by side and then joined
+** with crc32cShift(). It is compiled for the instruction set extension on its
+** own, so the server still runs on CPUs without it (initChecksums() checks).
+** Parameters: checksum so far, bytes, number of bytes
+** Output: checksum
+** Source: https://www.intel.com/content/dam/www/public/us/en/documents/white-papers/crc-iscsi-polynomial-crc32-instruction-paper.pdf
+******************************************************************************/
+#if defined(__x86_64__)
+#define CRC32C_WORD(crc, word) ((uint32_t) _mm_crc32_u64((crc), (word)))
+#define CRC32C_BYTE(crc, byte) _mm_crc32_u8((crc), (byte))
+__attribute__((target("sse4.2")))
+#elif defined(__aarch64__)
+#define CRC32C_WORD(crc, word) __crc32cd((crc), (word))
+#define CRC32C_BYTE(crc, byte) __crc32cb((crc), (byte))
+__attribute__((target("+crc")))
+#endif
+uint32_t crc32cInstruction(uint32_t crc, const char *data, size_t length){
+#if defined(__x86_64__) || defined(__aarch64__)
+	uint64_t first, second, third;
+	crc = ~crc;
+	while (length >= 3 * CRC32C_BLOCK) {
+		uint32_t crcFirst = crc, crcSecond = 0, crcThird = 0;
+		for (int i = 0; i < CRC32C_BLOCK; i += 8) {
+			memcpy(&first, data + i, 8);
+			memcpy(&second, data + CRC32C_BLOCK + i, 8);
+			memcpy(&third, data + 2 * CRC32C_BLOCK + i, 8);
+			crcFirst = CRC32C_WORD(crcFirst, first);
+			crcSecond = CRC32C_WORD(crcSecond, second);
+			crcThird = CRC32C_WORD(crcThird, third);
+		}
+		crc = crc32cShift(crc32cShift(crcFirst) ^ crcSecond) ^ crcThird;
+		data += 3 * CRC32C_BLOCK;
+		length -= 3 * CRC32C_BLOCK;
+	}
+	while (length >= 8) {
+		memcpy(&first, data, 8);
+		crc = CRC32C_WORD(crc, first);
+		data += 8;
+		length -= 8;
+	}
+	while (length-- > 0) {
+		crc = CRC32C_BYTE(crc, (unsigned char) *data++);
+	}
+	return ~crc;
+#else
+	return crc32cSoftware(crc, data, length);
+#endif
+}
+
+/******************************************************************************
+** crc32cShift()
+** Description: A function that moves a CRC32C state past CRC32C_BLOCK zero
+** bytes, one table lookup per byte of it.
+** Parameters: CRC32C state
+** Output: CRC32C state
+******************************************************************************/
+uint32_t crc32cShift(uint32_t crc){
+	return crc32cShiftTable[0][crc & 0xFF] ^ crc32cShiftTable[1][(crc >> 8) & 0xFF] ^
+		crc32cShiftTable[2][(crc >> 16) & 0xFF] ^ crc32cShiftTable[3][crc >> 24];
+}
+
+/******************************************************************************
+** crc32c()
+** Description: A function that continues a CRC32C with the instruction when
+** the CPU has it, with the table otherwise.
+** Parameters: checksum so far (0 to start), bytes, number of bytes
+** Output: checksum
+******************************************************************************/
+uint32_t crc32c(uint32_t crc, const char *data, size_t length){
+	return crc32cHardware ? crc32cInstruction(crc, data, length) : crc32cSoftware(crc, data, length);
+}
+
+/******************************************************************************
+** updateChecksum()
+** Description: A function that adds file bytes a GET sends to the checksum
+** of the transfer, when it is being computed.
+** Parameters: client session, bytes, number of bytes
+** Output: none
+******************************************************************************/
+void updateChecksum(struct session *session, const char *data, size_t length){
+	if (!session->checksumming) {
+		return;
+	}
+	if (session->checksumType == CRC32C_CHECKSUM) {
+		session->checksum = crc32c(session->checksum, data, length);
+	}
+	else {
+		session->checksum = crc32(session->checksum, (const Bytef *) data, length);
+	}
+}
+
+/******************************************************************************
+** checksumFileBytes()
+** Description: A function that adds bytes sendfile() sent, or splice()
+** received, to the checksum. They never passed through the server, so they
+** are read back from the page cache, a buffer at a time.
+** Parameters: client session, file, offset and number of the bytes
+** Output: none
+******************************************************************************/
+void checksumFileBytes(struct session *session, int fd, off_t offset, size_t count){
+	static __thread char buffer[CHECKSUM_BUFFER_SIZE];
+	ssize_t bytesRead;
+	if (!session->checksumming) {
+		return;
+	}
+	while (count > 0) {
+		bytesRead = pread(fd, buffer, count < sizeof(buffer) ? count : sizeof(buffer), offset);
+		if (bytesRead <= 0) {
+			// the client sees the mismatch, the digest is not remembered
+			session->wholeFile = 0;
+			return;
+		}
+		updateChecksum(session, buffer, bytesRead);
+		offset += bytesRead;
+		count -= bytesRead;
+	}
+}
+
+/******************************************************************************
+** findDigest()
+** Description: A function that looks up the remembered checksum of a whole
+** file, keyed by name, inode, times and size like the hot file cache.
+** Parameters: filename, its index entry, checksum type, checksum (changed)
+** Output: 1 found, 0 not remembered
+******************************************************************************/
+int findDigest(char *name, struct fileEntry *file, enum checksumType type, uint32_t *checksum){
+	unsigned int hash = hashName(name);
+	struct fileDigest *digest = &digestCache.slots[(hash ^ type) % DIGEST_SLOTS];
+	int found;
+	pthread_mutex_lock(&digestCache.lock);
+	found = digest->name != NULL && digest->hash == hash && digest->type == type &&
+		digest->inode == file->inode && digest->size == file->size &&
+		sameTime(&digest->mtime, &file->mtime) && sameTime(&digest->ctime, &file->ctime) &&
+		strcmp(digest->name, name) == 0;
+	if (found) {
+		*checksum = digest->checksum;
+		digestCache.hits++;
+	}
+	else {
+		digestCache.misses++;
+	}
+	pthread_mutex_unlock(&digestCache.lock);
+	return found;
+}
+
+/******************************************************************************
+** storeDigest()
+** Description: A function that remembers the checksum of a whole file. The
+** table is direct mapped: the digest takes the slot of its name and type,
+** replacing the one there.
+** Parameters: filename, its index entry, checksum type, checksum
+** Output: none
+******************************************************************************/
+void storeDigest(char *name, struct fileEntry *file, enum checksumType type, uint32_t checksum){
+	unsigned int hash = hashName(name);
+	struct fileDigest *digest = &digestCache.slots[(hash ^ type) % DIGEST_SLOTS];
+	char *copy = strdup(name);
+	char *old;
+	assert(copy != NULL);
+	pthread_mutex_lock(&digestCache.lock);
+	old = digest->name;
+	digest->name = copy;
+	digest->hash = hash;
+	digest->inode = file->inode;
+	digest->mtime = file->mtime;
+	digest->ctime = file->ctime;
+	digest->size = file->size;
+	digest->type = type;
+	digest->checksum = checksum;
+	pthread_mutex_unlock(&digestCache.lock);
+	free(old);
+}
+
+/******************************************************************************
+** forgetDigests()
+** Description: A function that empties the digest slots of a file, for each
+** checksum type, when inotify reports that it was written to; otherwise a
+** stale digest would agree with a stale cached copy.
+** Parameters: filename
+** Output: none
+******************************************************************************/
+void forgetDigests(char *name){
+	unsigned int hash = hashName(name);
+	char *old[CRC32_CHECKSUM + 1] = { NULL };
+	pthread_mutex_lock(&digestCache.lock);
+	for (int type = CRC32C_CHECKSUM; type <= CRC32_CHECKSUM; type++) {
+		struct fileDigest *digest = &digestCache.slots[(hash ^ type) % DIGEST_SLOTS];
+		if (digest->name != NULL && digest->hash == hash && digest->type == (enum checksumType) type &&
+			strcmp(digest->name, name) == 0) {
+			old[type] = digest->name;
+			digest->name = NULL;
+		}
+	}
+	pthread_mutex_unlock(&digestCache.lock);
+	for (int type = CRC32C_CHECKSUM; type <= CRC32_CHECKSUM; type++) {
+		free(old[type]);
+	}
+}
+
+/******************************************************************************
+** benchmarkChecksums()
+** Description: A function that measures how fast the checksums run over a
+** buffer that fits no cache, next to memcpy() of the same bytes (the least a
+** copying transfer costs), and prints the rates. Run with the -k option.
+** Parameters: none
+** Output: none
+******************************************************************************/
+void benchmarkChecksums(void){
+	const size_t size = 64 * 1048576;
+	const int rounds = 8;
+	const char *names[] = { "memcpy", "crc32c (instruction)", "crc32c (table)", "crc32 (zlib)" };
+	char *buffer = malloc(size);
+	char *copy = malloc(size);
+	volatile uint32_t sink = 0;
+	assert(buffer != NULL && copy != NULL);
+	for (size_t i = 0; i < size; i++) {
+		buffer[i] = (char) (i * 2654435761u >> 13);
+	}
+	memcpy(copy, buffer, size);
+	printf("ftserver: checksum rates over %zu MiB, %d rounds\n", size / 1048576, rounds);
+	if (crc32cHardware && crc32cInstruction(0, buffer + 3, size - 3) != crc32cSoftware(0, buffer + 3, size - 3)) {
+		printf("  crc32c instruction and table disagree!\n");
+	}
+	for (int method = 0; method < 4; method++) {
+		struct timespec start, end;
+		double seconds;
+		if (method == 1 && !crc32cHardware) {
+			printf("  %-22s not supported by this CPU\n", names[method]);
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int round = 0; round < rounds; round++) {
+			switch (method) {
+			case 0: memcpy(copy, buffer, size); sink += copy[round]; break;
+			case 1: sink += crc32cInstruction(0, buffer, size); break;
+			case 2: sink += crc32cSoftware(0, buffer, size); break;
+			case 3: sink += crc32(0, (const Bytef *) buffer, size); break;
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		printf("  %-22s %8.2f GB/s\n", names[method], (double) size * rounds / seconds / 1e9);
+	}
+	free(buffer);
+	free(copy);
+}
+
+/******************************************************************************
+** currentTime()
+** Description: A function that reads the monotonic clock, used to schedule
+** data connection retries. Used in the event loop.
+** Parameters: none
+** Output: milliseconds since an arbitrary fixed point
+** Source: http://man7.org/linux/man-pages/man2/clock_gettime.2.html
+******************************************************************************/
+long long currentTime(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/******************************************************************************
+** currentMicros()
+** Description: A function that reads the monotonic clock in microseconds, for
+** the latency histograms.
+** Parameters: none
+** Output: microseconds since an arbitrary fixed point
+** Source: http://man7.org/linux/man-pages/man2/clock_gettime.2.html
+******************************************************************************/
+long long currentMicros(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/******************************************************************************
+** countMetric()
+** Description: A function that adds to a counter of the worker's metrics.
+** Only the worker writes its counters, so a relaxed load and store do, with
+** no locked instruction; the store is atomic so that STATS, read on another
+** thread, never sees half of it.
+** Parameters: counter, amount to add
+** Output: none
+******************************************************************************/
+void countMetric(long long *counter, long long amount){
+	__atomic_store_n(counter, *counter + amount, __ATOMIC_RELAXED);
+}
+
+/******************************************************************************
+** histogramBucket()
+** Description: A function that finds the histogram bucket of a duration. The
+** first 2 * HISTOGRAM_SUB_BUCKETS values have a bucket each; above them, the
+** power of two of the value picks a group of HISTOGRAM_SUB_BUCKETS buckets,
+** and the next HISTOGRAM_SUB_BITS bits of the value the bucket in it.
+** Parameters: duration in microseconds
+** Output: bucket number
+** Source: http://hdrhistogram.org/
+******************************************************************************/
+int histogramBucket(long long value){
+	int exponent;
+	if (value < 0) {
+		value = 0;
+	}
+	if (value > HISTOGRAM_MAX) {
+		value = HISTOGRAM_MAX;
+	}
+	if (value < 2 * HISTOGRAM_SUB_BUCKETS) {
+		return value;
+	}
+	exponent = 63 - __builtin_clzll(value);
+	return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS +
+		(value >> (exponent - HISTOGRAM_SUB_BITS)) - HISTOGRAM_SUB_BUCKETS;
+}
+
+/******************************************************************************
+** bucketLimit()
+** Description: A function that finds the largest duration of a histogram
+** bucket, the reverse of histogramBucket().
+** Parameters: bucket number
+** Output: duration in microseconds
+******************************************************************************/
+long long bucketLimit(int bucket){
+	int exponent;
+	long long top;
+	if (bucket < 2 * HISTOGRAM_SUB_BUCKETS) {
+		return bucket;
+	}
+	exponent = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+	top = bucket % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+	return ((top + 1) << (exponent - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+/******************************************************************************
+** recordValue()
+** Description: A function that adds a duration to a histogram of the
+** worker's metrics.
+** Parameters: histogram, duration in microseconds
+** Output: none
+******************************************************************************/
+void recordValue(struct histogram *histogram, long long value){
+	countMetric(&histogram->counts[histogramBucket(value)], 1);
+	countMetric(&histogram->count, 1);
+	countMetric(&histogram->sum, value);
+	if (value > histogram->max) {
+		__atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+	}
+}
+
+/******************************************************************************
+** histogramPercentile()
+** Description: A function that finds the duration a fraction of the recorded
+** durations are at or below, to the precision of the buckets.
+** Parameters: histogram, fraction (0.99 for the 99th percentile)
+** Output: duration in microseconds, 0 when nothing was recorded
+******************************************************************************/
+long long histogramPercentile(struct histogram *histogram, double fraction){
+	long long target = fraction * histogram->count;
+	long long seen = 0;
+	// the rank of the value, rounded up
+	if (target < fraction * histogram->count || target == 0) {
+		target++;
+	}
+	for (int i = 0; i < HISTOGRAM_BUCKETS && histogram->count > 0; i++) {
+		seen += histogram->counts[i];
+		if (seen >= target) {
+			return bucketLimit(i) < histogram->max ? bucketLimit(i) : histogram->max;
+		}
+	}
+	return histogram->max;
+}
+
+/******************************************************************************
+** collectMetrics()
+** Description: A function that adds up the metrics of all the workers. The
+** workers keep going meanwhile, so the totals are a moment of each worker,
+** not of the whole server.
+** Parameters: totals (set), number of active sessions (set)
+** Output: none
+******************************************************************************/
+void collectMetrics(struct metrics *total, int *activeSessions, int *queuedTransfers){
+	// the counters, and the histograms after them, are all long long
+	int numberCounters = sizeof(struct metrics) / sizeof(long long);
+	memset(total, 0, sizeof(struct metrics));
+	*activeSessions = *queuedTransfers = 0;
+	for (int i = 0; i < settings.workers; i++) {
+		long long *from = (long long *) &engines[i].metrics;
+		long long *to = (long long *) total;
+		for (int j = 0; j < numberCounters; j++) {
+			to[j] += __atomic_load_n(&from[j], __ATOMIC_RELAXED);
+		}
+		*activeSessions += __atomic_load_n(&engines[i].activeSessions, __ATOMIC_RELAXED);
+		*queuedTransfers += __atomic_load_n(&engines[i].throttledCount, __ATOMIC_RELAXED);
+	}
+	// the largest durations are not sums
+	total->connectTime.max = total->firstByteTime.max = total->getTime.max = total->listTime.max = 0;
+	for (int i = 0; i < settings.workers; i++) {
+		struct histogram *from[4] = { &engines[i].metrics.connectTime, &engines[i].metrics.firstByteTime,
+			&engines[i].metrics.getTime, &engines[i].metrics.listTime };
+		struct histogram *to[4] = { &total->connectTime, &total->firstByteTime, &total->getTime, &total->listTime };
+		for (int j = 0; j < 4; j++) {
+			long long max = __atomic_load_n(&from[j]->max, __ATOMIC_RELAXED);
+			if (max > to[j]->max) {
+				to[j]->max = max;
+			}
+		}
+	}
+}
+
+/******************************************************************************
+** foldCounters()
+** Description: A function that adds the packets, send system calls and bytes
+** counted by the connections of a session to the worker's metrics, and starts
+** their count again. Used when a transfer starts, so that the transfer report
+** counts that transfer only, and when the session closes.
+** Parameters: client session
+** Output: none
+******************************************************************************/
+void foldCounters(struct session *session){
+	struct connection *conns[2] = { &session->control, &session->data };
+	// the rate limits are charged first, their count starts again too
+	chargeSession(session);
+	session->chargedBytes = 0;
+	for (int i = 0; i < 2; i++) {
+		countMetric(&workerMetrics->packets, conns[i]->packets);
+		countMetric(&workerMetrics->sendCalls, conns[i]->sendCalls);
+		countMetric(&workerMetrics->bytesSent, conns[i]->bytesSent);
+		conns[i]->packets = conns[i]->sendCalls = conns[i]->bytesSent = 0;
+	}
+}
+
+/******************************************************************************
+** writeStats()
+** Description: A function that writes the server metrics as the text of the
+** STATS reply: the counters, then the percentiles of each histogram in
+** milliseconds.
+** Parameters: text buffer, its size
+** Output: length of the text
+******************************************************************************/
+int writeStats(char *text, int size){
+	struct metrics total;
+	int activeSessions, queuedTransfers;
+	int length;
+	long long traceEvents, traceDropped;
+	const char *names[4] = { "data connect", "first byte", "GET", "LIST" };
+	struct histogram *histograms[4] = { &total.connectTime, &total.firstByteTime, &total.getTime, &total.listTime };
+	collectMetrics(&total, &activeSessions, &queuedTransfers);
+	traceCounters(&traceEvents, &traceDropped);
+	length = snprintf(text, size,
+		"sessions: %lld opened, %d active\n"
+		"commands: %lld LIST, %lld GET, %lld MGET, %lld DELTA, %lld PUT, %lld STATS, %lld errors\n"
+		"sent: %lld bytes, %lld packets, %lld system calls\n"
+		"received: %lld bytes\n"
+		"directory: %lld hits, %lld misses\n"
+		"rate limits: %lld waits, %.3f s waited, %d transfers waiting\n"
+		"trace: level %d, %lld events written, %lld dropped\n",
+		total.sessions, activeSessions, total.lists, total.gets, total.batches, total.deltas, total.puts, total.stats,
+		total.errors, total.bytesSent, total.packets, total.sendCalls, total.bytesReceived, total.lookupHits, total.lookupMisses,
+		total.throttles, total.throttledTime / 1e6, queuedTransfers, (int) traceLevel, traceEvents, traceDropped);
+	pthread_mutex_lock(&fileCache.lock);
+	length += snprintf(text + length, size - length, "file cache: %lld hits, %lld misses, %lld evictions, %zu bytes\n",
+		fileCache.hits, fileCache.misses, fileCache.evictions, fileCache.used);
+	pthread_mutex_unlock(&fileCache.lock);
+	pthread_mutex_lock(&digestCache.lock);
+	length += snprintf(text + length, size - length, "digests: %lld hits, %lld misses\n",
+		digestCache.hits, digestCache.misses);
+	pthread_mutex_unlock(&digestCache.lock);
+	for (int i = 0; i < 4; i++) {
+		length += snprintf(text + length, size - length,
+			"%s: %lld, p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n", names[i], histograms[i]->count,
+			histogramPercentile(histograms[i], 0.5) / 1000.0, histogramPercentile(histograms[i], 0.9) / 1000.0,
+			histogramPercentile(histograms[i], 0.99) / 1000.0, histograms[i]->max / 1000.0);
+	}
+	return length < size ? length : size - 1;
+}
+
+/******************************************************************************
+** writePrometheus()
+** Description: A function that writes the server metrics in the Prometheus
+** text format: counters and gauges, and each histogram as a summary with its
+** percentiles in seconds.
+** Parameters: text buffer, its size
+** Output: length of the text
+** Source: https://prometheus.io/docs/instrumenting/exposition_formats/
+******************************************************************************/
+int writePrometheus(char *text, int size){
+	struct metrics total;
+	int activeSessions, queuedTransfers;
+	int length;
+	long long traceEvents, traceDropped;
+	const char *names[4] = { "data_connect", "first_byte", "get", "list" };
+	const double quantiles[4] = { 0.5, 0.9, 0.99, 0.999 };
+	struct histogram *histograms[4] = { &total.connectTime, &total.firstByteTime, &total.getTime, &total.listTime };
+	collectMetrics(&total, &activeSessions, &queuedTransfers);
+	traceCounters(&traceEvents, &traceDropped);
+	length = snprintf(text, size,
+		"# TYPE ftserver_sessions_total counter\nftserver_sessions_total %lld\n"
+		"# TYPE ftserver_active_sessions gauge\nftserver_active_sessions %d\n"
+		"# TYPE ftserver_commands_total counter\n"
+		"ftserver_commands_total{command=\"LIST\"} %lld\nftserver_commands_total{command=\"GET\"} %lld\n"
+		"ftserver_commands_total{command=\"MGET\"} %lld\nftserver_commands_total{command=\"DELTA\"} %lld\n"
+		"ftserver_commands_total{command=\"PUT\"} %lld\nftserver_commands_total{command=\"STATS\"} %lld\n"
+		"# TYPE ftserver_errors_total counter\nftserver_errors_total %lld\n"
+		"# TYPE ftserver_sent_bytes_total counter\nftserver_sent_bytes_total %lld\n"
+		"# TYPE ftserver_received_bytes_total counter\nftserver_received_bytes_total %lld\n"
+		"# TYPE ftserver_packets_total counter\nftserver_packets_total %lld\n"
+		"# TYPE ftserver_send_calls_total counter\nftserver_send_calls_total %lld\n"
+		"# TYPE ftserver_directory_lookups_total counter\n"
+		"ftserver_directory_lookups_total{result=\"hit\"} %lld\nftserver_directory_lookups_total{result=\"miss\"} %lld\n"
+		"# TYPE ftserver_rate_limit_waits_total counter\nftserver_rate_limit_waits_total %lld\n"
+		"# TYPE ftserver_rate_limit_wait_seconds_total counter\nftserver_rate_limit_wait_seconds_total %.6f\n"
+		"# TYPE ftserver_rate_limit_queued_transfers gauge\nftserver_rate_limit_queued_transfers %d\n"
+		"# TYPE ftserver_trace_events_total counter\nftserver_trace_events_total %lld\n"
+		"# TYPE ftserver_trace_dropped_total counter\nftserver_trace_dropped_total %lld\n",
+		total.sessions, activeSessions, total.lists, total.gets, total.batches, total.deltas, total.puts, total.stats,
+		total.errors, total.bytesSent, total.bytesReceived, total.packets, total.sendCalls, total.lookupHits, total.lookupMisses,
+		total.throttles, total.throttledTime / 1e6, queuedTransfers, traceEvents, traceDropped);
+	pthread_mutex_lock(&fileCache.lock);
+	length += snprintf(text + length, size - length,
+		"# TYPE ftserver_file_cache_lookups_total counter\n"
+		"ftserver_file_cache_lookups_total{result=\"hit\"} %lld\nftserver_file_cache_lookups_total{result=\"miss\"} %lld\n"
+		"# TYPE ftserver_file_cache_evictions_total counter\nftserver_file_cache_evictions_total %lld\n"
+		"# TYPE ftserver_file_cache_bytes gauge\nftserver_file_cache_bytes %zu\n",
+		fileCache.hits, fileCache.misses, fileCache.evictions, fileCache.used);
+	pthread_mutex_unlock(&fileCache.lock);
+	pthread_mutex_lock(&digestCache.lock);
+	length += snprintf(text + length, size - length,
+		"# TYPE ftserver_digest_lookups_total counter\n"
+		"ftserver_digest_lookups_total{result=\"hit\"} %lld\nftserver_digest_lookups_total{result=\"miss\"} %lld\n",
+		digestCache.hits, digestCache.misses);
+	pthread_mutex_unlock(&digestCache.lock);
+	for (int i = 0; i < 4 && length < size; i++) {
+		length += snprintf(text + length, size - length, "# TYPE ftserver_%s_seconds summary\n", names[i]);
+		for (int j = 0; j < 4 && length < size; j++) {
+			length += snprintf(text + length, size - length, "ftserver_%s_seconds{quantile=\"%g\"} %.6f\n",
+				names[i], quantiles[j], histogramPercentile(histograms[i], quantiles[j]) / 1e6);
+		}
+		if (length < size) {
+			length += snprintf(text + length, size - length, "ftserver_%s_seconds_sum %.6f\nftserver_%s_seconds_count %lld\n",
+				names[i], histograms[i]->sum / 1e6, names[i], histograms[i]->count);
+		}
+	}
+	return length < size ? length : size - 1;
+}
+
+/******************************************************************************
+** serveMetrics()
+** Description: A function that runs the thread of the Prometheus endpoint:
+** for each connection, the request is read and answered with the metrics
+** text, whatever it asked for, and the connection closed. Started by
+** startMetricsEndpoint().
+** Parameters: listening socket
+** Output: none, runs until the server is stopped
+******************************************************************************/
+void *serveMetrics(void *arg){
+	int listener = (int) (intptr_t) arg;
+	// a client that sends nothing does not hold the endpoint for long
+	struct timeval timeout = { 1, 0 };
+	char *text = malloc(METRICS_TEXT_SIZE);
+	char request[1024];
+	char header[128];
+	assert(text != NULL);
+	while (1) {
+		int length, headerLength, sent;
+		int client = accept(listener, NULL, NULL);
+		if (client == -1) {
+			if (errno != EINTR && errno != ECONNABORTED) {
+				perror("accept metrics");
+			}
+			continue;
+		}
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		if (recv(client, request, sizeof(request), 0) <= 0) {
+			close(client);
+			continue;
+		}
+		length = writePrometheus(text, METRICS_TEXT_SIZE);
+		headerLength = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n", length);
+		sent = send(client, header, headerLength, MSG_NOSIGNAL);
+		for (int done = 0; sent > 0 && done < length; done += sent) {
+			sent = send(client, text + done, length - done, MSG_NOSIGNAL);
+		}
+		close(client);
+	}
+	return NULL;
+}
+
+/******************************************************************************
+** startMetricsEndpoint()
+** Description: A function that opens the Prometheus endpoint on the -p port
+** of the loopback interface only, and starts its thread. Used in
+** startServer().
+** Parameters: none, the port is in settings
+** Output: none
+******************************************************************************/
+void startMetricsEndpoint(void){
+	int listener;
+	int optionValue = 1;
+	pthread_t thread;
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(settings.metricsPort);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listener == -1) {
+		perror("socket");
+		exit(1);
+	}
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &optionValue, sizeof(optionValue));
+	if (bind(listener, (struct sockaddr *) &address, sizeof(address)) == -1 || listen(listener, 16) == -1) {
+		perror("metrics endpoint");
+		exit(1);
+	}
+	if (pthread_create(&thread, NULL, serveMetrics, (void *) (intptr_t) listener) != 0) {
+		fprintf(stderr, "ftserver: Cannot start the metrics endpoint\n");
+		exit(1);
+	}
+	printf("ftserver: Metrics on http://127.0.0.1:%d/metrics\n", settings.metricsPort);
+}
+
+/******************************************************************************
+** startRateLimits()
+** Description: A function that sets up the token buckets of the rate limits
+** (-r for the whole server, -R for each client address), full, so the first
+** bytes go out at once. Used in startServer().
+** Parameters: none
+** Output: none
+******************************************************************************/
+void startRateLimits(void){
+	long long now = currentMicros();
+	pthread_mutex_init(&totalBucket.lock, NULL);
+	totalBucket.tokens = rateBurst(settings.totalRate);
+	totalBucket.refilled = now;
+	if (settings.clientRate) {
+		clientBuckets = calloc(CLIENT_BUCKETS, sizeof(struct tokenBucket));
+		assert(clientBuckets != NULL);
+		for (int i = 0; i < CLIENT_BUCKETS; i++) {
+			pthread_mutex_init(&clientBuckets[i].lock, NULL);
+			clientBuckets[i].tokens = rateBurst(settings.clientRate);
+			clientBuckets[i].refilled = now;
+		}
+	}
+	if (settings.totalRate || settings.clientRate) {
+		printf("ftserver: Sending at most %lld bytes/s in all, %lld bytes/s to each client (0 no limit)\n",
+			settings.totalRate, settings.clientRate);
+	}
+}
+
+/******************************************************************************
+** rateBurst()
+** Description: A function that finds how many bytes a token bucket holds: a
+** tenth of a second of its rate, and at least RATE_MIN_BURST.
+** Parameters: bytes per second
+** Output: bytes
+******************************************************************************/
+long long rateBurst(long long rate){
+	return rate / RATE_BURST_DIVISOR > RATE_MIN_BURST ? rate / RATE_BURST_DIVISOR : RATE_MIN_BURST;
+}
+
+/******************************************************************************
+** bucketWait()
+** Description: A function that refills a token bucket for the time since its
+** last refill, and finds how long a send has to wait for it.
+** Parameters: token bucket, its rate in bytes per second, current time in
+** microseconds
+** Output: microseconds to wait, 0 tokens are there now
+** Source: https://en.wikipedia.org/wiki/Token_bucket
+******************************************************************************/
+long long bucketWait(struct tokenBucket *bucket, long long rate, long long now){
+	long long wait = 0;
+	pthread_mutex_lock(&bucket->lock);
+	if (now > bucket->refilled) {
+		bucket->tokens += (double) (now - bucket->refilled) * rate / 1e6;
+		if (bucket->tokens > rateBurst(rate)) {
+			bucket->tokens = rateBurst(rate);
+		}
+		bucket->refilled = now;
+	}
+	if (bucket->tokens <= 0) {
+		wait = (long long) (-bucket->tokens * 1e6 / rate) + 1;
+	}
+	pthread_mutex_unlock(&bucket->lock);
+	return wait;
+}
+
+/******************************************************************************
+** chargeSession()
+** Description: A function that takes the bytes a session sent since it was
+** last charged out of the token buckets. Sends are charged after they
+** happened, so the buckets may go below zero; the next sends wait for that.
+** Parameters: client session
+** Output: bytes charged
+******************************************************************************/
+long long chargeSession(struct session *session){
+	long long sent = session->data.carrier->bytesSent - session->chargedBytes;
+	if (sent <= 0) {
+		return 0;
+	}
+	session->chargedBytes = session->data.carrier->bytesSent;
+	if (settings.totalRate) {
+		pthread_mutex_lock(&totalBucket.lock);
+		totalBucket.tokens -= sent;
+		pthread_mutex_unlock(&totalBucket.lock);
+	}
+	if (session->clientBucket != NULL) {
+		pthread_mutex_lock(&session->clientBucket->lock);
+		session->clientBucket->tokens -= sent;
+		pthread_mutex_unlock(&session->clientBucket->lock);
+	}
+	return sent;
+}
+
+/******************************************************************************
+** sessionWait()
+** Description: A function that finds how long a session has to wait for
+** tokens: for the server's bucket and for its client's, whichever is longer.
+** Parameters: client session, current time in microseconds
+** Output: microseconds to wait, 0 it may send now
+******************************************************************************/
+long long sessionWait(struct session *session, long long now){
+	long long wait = 0, clientWait;
+	if (settings.totalRate) {
+		wait = bucketWait(&totalBucket, settings.totalRate, now);
+	}
+	if (session->clientBucket != NULL) {
+		clientWait = bucketWait(session->clientBucket, settings.clientRate, now);
+		if (clientWait > wait) {
+			wait = clientWait;
+		}
+	}
+	return wait;
+}
+
+/******************************************************************************
+** throttleSession()
+** Description: A function that puts a transfer at the end of the worker's
+** queue of transfers waiting for their turn. It stops watching its socket
+** until serveThrottled() runs it.
+** Parameters: event engine, client session, current time in microseconds
+** Output: none
+******************************************************************************/
+void throttleSession(struct engine *engine, struct session *session, long long now){
+	session->throttled = 1;
+	session->throttleStart = now;
+	session->nextThrottled = NULL;
+	if (engine->throttledTail != NULL) {
+		engine->throttledTail->nextThrottled = session;
+	}
+	else {
+		engine->throttledHead = session;
+	}
+	engine->throttledTail = session;
+	__atomic_store_n(&engine->throttledCount, engine->throttledCount + 1, __ATOMIC_RELAXED);
+	countMetric(&workerMetrics->throttles, 1);
+	TRACE(TRACE_SENDS, TRACE_THROTTLE, session, engine->throttledCount);
+}
+
+/******************************************************************************
+** unthrottleSession()
+** Description: A function that takes a transfer out of the worker's queue,
+** and counts the time it waited.
+** Parameters: event engine, client session, current time in microseconds
+** Output: none
+******************************************************************************/
+void unthrottleSession(struct engine *engine, struct session *session, long long now){
+	struct session **link = &engine->throttledHead;
+	struct session *previous = NULL;
+	if (!session->throttled) {
+		return;
+	}
+	while (*link != session) {
+		previous = *link;
+		link = &(*link)->nextThrottled;
+	}
+	*link = session->nextThrottled;
+	if (engine->throttledTail == session) {
+		engine->throttledTail = previous;
+	}
+	session->throttled = 0;
+	__atomic_store_n(&engine->throttledCount, engine->throttledCount - 1, __ATOMIC_RELAXED);
+	countMetric(&workerMetrics->throttledTime, now - session->throttleStart);
+}
+
+/******************************************************************************
+** runTransfer()
+** Description: A function that runs the data side of a transfer under the
+** rate limits, in deficit round robin. While there are tokens and no transfer
+** is waiting, it sends as much as dataConnection() likes. Once the tokens run
+** out, transfers queue up and take turns: each turn adds RATE_QUANTUM bytes to
+** the transfer's deficit and sends at most that, so a small GET or LIST waits
+** one round at most while a bulk transfer gets all the bytes nobody else
+** wants. Uploads are not limited. Without limits it is dataConnection().
+** Parameters: event engine, client session
+** Output: 0 success, -1 error
+** Source: https://en.wikipedia.org/wiki/Deficit_round_robin
+******************************************************************************/
+int runTransfer(struct engine *engine, struct session *session){
+	long long now, sent;
+	int turn = session->turn;
+	int status;
+	if ((!settings.totalRate && !settings.clientRate) || session->uploadFd != -1) {
+		return dataConnection(session);
+	}
+	if (session->throttled) {
+		return 0;
+	}
+	session->turn = 0;
+	chargeSession(session);
+	now = currentMicros();
+	// out of tokens, or other transfers are waiting for their turn
+	if (sessionWait(session, now) > 0 || (!turn && engine->throttledHead != NULL)) {
+		throttleSession(engine, session, now);
+		return 0;
+	}
+	// a turn of the round: the deficit bounds the bytes sent
+	if (turn) {
+		session->deficit += RATE_QUANTUM;
+		TRACE(TRACE_SENDS, TRACE_TURN, session, session->deficit);
+		if (session->deficit <= 0) {
+			throttleSession(engine, session, now);
+			return 0;
+		}
+		session->heldBudget = session->deficit < DATA_BUDGET ? DATA_BUDGET - session->deficit : 0;
+	}
+	status = dataConnection(session);
+	session->heldBudget = 0;
+	sent = chargeSession(session);
+	// a finished transfer keeps no deficit; one that used its turn and has
+	// more to send waits for the next round, behind the others
+	if (session->state != TRANSFER_STATE) {
+		session->deficit = 0;
+	}
+	else if (turn) {
+		session->deficit -= sent;
+		if (status == 0 && sent > 0 && engine->throttledHead != NULL && session->uringOps == 0) {
+			throttleSession(engine, session, now);
+		}
+	}
+	return status;
+}
+
+/******************************************************************************
+** serveThrottled()
+** Description: A function that runs one round of the worker's waiting
+** transfers: each one whose tokens are there gets its turn, in queue order,
+** the others (their client's tokens ran out) go to the back of the queue.
+** The round stops where the server's tokens run out. Used in runWorker() before each
+** epoll_wait().
+** Parameters: event engine
+** Output: epoll timeout in milliseconds until the next tokens, -1 when no
+** transfer is waiting
+******************************************************************************/
+int serveThrottled(struct engine *engine){
+	long long now, wake = -1, wait;
+	int count = engine->throttledCount;
+	struct session *session;
+	if (engine->throttledHead == NULL) {
+		return -1;
+	}
+	now = currentMicros();
+	while (count-- > 0 && engine->throttledHead != NULL) {
+		// the server's tokens ran out: the round goes on from here once they
+		// are back, so every transfer gets its turn in order
+		if (settings.totalRate && (wait = bucketWait(&totalBucket, settings.totalRate, now)) > 0) {
+			return (int) ((wait + 999) / 1000);
+		}
+		session = engine->throttledHead;
+		wait = sessionWait(session, now);
+		if (wait > 0) {
+			// its client's tokens ran out, to the back of the queue
+			if (session != engine->throttledTail) {
+				engine->throttledHead = session->nextThrottled;
+				session->nextThrottled = NULL;
+				engine->throttledTail->nextThrottled = session;
+				engine->throttledTail = session;
+			}
+			if (wake == -1 || wait < wake) {
+				wake = wait;
+			}
+			continue;
+		}
+		unthrottleSession(engine, session, now);
+		session->turn = 1;
+		if (session->mux) {
+			handleControl(engine, session, 0);
+		}
+		else {
+			handleData(engine, session, 0);
+		}
+		session->turn = 0;
+	}
+	// a transfer that took its turn may be waiting again already
+	if (engine->throttledHead != NULL && wake == -1) {
+		return 0;
+	}
+	return wake == -1 ? -1 : (int) ((wake + 999) / 1000);
+}
+
+/******************************************************************************
+** startTracing()
+** Description: A function that starts the trace (-t): it writes the header of
+** the trace file, gives each worker its ring, and starts the drainer thread.
+** SIGUSR1 then raises the verbosity by one level and SIGUSR2 lowers it, so
+** the trace can be turned up on a running server and back down (to 0, which
+** records nothing). Used in startServer(), before the workers start.
+** Parameters: none, the file and level are in settings
+** Output: none
+******************************************************************************/
+void startTracing(void){
+	struct traceHeader header;
+	struct sigaction change;
+	struct timespec now;
+	pthread_t thread;
+	if (settings.traceFile == NULL) {
+		return;
+	}
+	traceFile = fopen(settings.traceFile, "w");
+	if (traceFile == NULL) {
+		perror("trace file");
+		exit(1);
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	clock_gettime(CLOCK_REALTIME, &now);
+	header.startMicros = currentMicros();
+	header.startTime = (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	header.eventSize = sizeof(struct traceEvent);
+	header.workers = settings.workers;
+	if (fwrite(&header, sizeof(header), 1, traceFile) != 1 || fflush(traceFile) == EOF) {
+		perror("trace file");
+		exit(1);
+	}
+	for (int i = 0; i < settings.workers; i++) {
+		engines[i].trace = aligned_alloc(64, sizeof(struct traceRing));
+		assert(engines[i].trace != NULL);
+		memset(engines[i].trace, 0, sizeof(struct traceRing));
+		engines[i].trace->worker = i;
+	}
+	change.sa_handler = &changeTraceLevel;
+	change.sa_flags = SA_RESTART;
+	sigemptyset(&change.sa_mask);
+	if (sigaction(SIGUSR1, &change, 0) == -1 || sigaction(SIGUSR2, &change, 0) == -1) {
+		perror("sigaction");
+		exit(1);
+	}
+	if (pthread_create(&thread, NULL, drainTrace, NULL) != 0) {
+		fprintf(stderr, "ftserver: Cannot start the trace\n");
+		exit(1);
+	}
+	traceLevel = settings.traceLevel;
+	printf("ftserver: Tracing to \"%s\" at level %d (SIGUSR1 raises it, SIGUSR2 lowers it)\n",
+		settings.traceFile, settings.traceLevel);
+}
+
+/******************************************************************************
+** changeTraceLevel()
+** Description: A function that raises (SIGUSR1) or lowers (SIGUSR2) the
+** trace verbosity by one level. The workers see the new level at their next
+** event.
+** Parameters: signal number
+** Output: none
+******************************************************************************/
+void changeTraceLevel(int sig){
+	if (sig == SIGUSR1 && traceLevel < TRACE_SENDS) {
+		traceLevel = traceLevel + 1;
+	}
+	else if (sig == SIGUSR2 && traceLevel > TRACE_OFF) {
+		traceLevel = traceLevel - 1;
+	}
+}
+
+/******************************************************************************
+** recordTrace()
+** Description: A function that adds an event to the ring of the worker
+** running this thread, without a lock or a system call: only this thread
+** moves head, and only the drainer moves tail. When the drainer fell behind
+** and the ring is full, the event is counted as dropped instead of waiting.
+** Used through TRACE(), which skips it below the verbosity.
+** Parameters: event, client session (NULL for none), value of the event
+** Output: none
+** Source: https://www.kernel.org/doc/Documentation/circular-buffers.txt
+******************************************************************************/
+void recordTrace(int event, struct session *session, long long bytes){
+	struct traceRing *ring = workerTrace;
+	struct traceEvent *entry;
+	unsigned int head;
+	if (ring == NULL) {
+		return;
+	}
+	head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == TRACE_EVENTS) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	entry = &ring->events[head & (TRACE_EVENTS - 1)];
+	entry->time = currentMicros();
+	entry->bytes = bytes;
+	entry->session = session != NULL ? session->traceId : 0;
+	entry->event = event;
+	entry->worker = ring->worker;
+	// the drainer sees the event only once it is all written
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/******************************************************************************
+** drainTrace()
+** Description: A function that runs the trace drainer thread: every
+** TRACE_DRAIN_MS it copies the new events of each ring to the trace file (in
+** one or two pieces, where the ring wraps), frees their room, notes the
+** events lost to a full ring, and flushes the file so a decoder following it
+** sees them. If the file cannot be written, the trace stops.
+** Parameters: none
+** Output: none
+******************************************************************************/
+void *drainTrace(void *arg){
+	struct traceEvent lost;
+	struct timespec pause = { 0, TRACE_DRAIN_MS * 1000000L };
+	(void) arg;
+	while (1) {
+		long long drained = 0;
+		for (int i = 0; i < settings.workers; i++) {
+			struct traceRing *ring = engines[i].trace;
+			unsigned int tail = ring->tail;
+			unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+			long long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+			while (tail != head) {
+				unsigned int start = tail & (TRACE_EVENTS - 1);
+				unsigned int count = head - tail;
+				if (count > TRACE_EVENTS - start) {
+					count = TRACE_EVENTS - start;
+				}
+				fwrite(&ring->events[start], sizeof(struct traceEvent), count, traceFile);
+				tail += count;
+				drained += count;
+			}
+			// the events are copied to the file buffer, the worker may reuse their room
+			__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+			if (dropped > ring->reported) {
+				memset(&lost, 0, sizeof(lost));
+				lost.time = currentMicros();
+				lost.bytes = dropped - ring->reported;
+				lost.event = TRACE_DROPPED;
+				lost.worker = ring->worker;
+				fwrite(&lost, sizeof(lost), 1, traceFile);
+				ring->reported = dropped;
+				drained++;
+			}
+		}
+		if (drained > 0) {
+			if (fflush(traceFile) == EOF || ferror(traceFile)) {
+				perror("trace file");
+				fprintf(stderr, "ftserver: Trace stopped\n");
+				traceLevel = TRACE_OFF;
+				return NULL;
+			}
+			__atomic_add_fetch(&traceWritten, drained, __ATOMIC_RELAXED);
+		}
+		nanosleep(&pause, NULL);
+	}
+	return NULL;
+}
+
+/******************************************************************************
+** traceCounters()
+** Description: A function that reads the trace counters for STATS and the
+** Prometheus endpoint: the events written to the trace file, and the events
+** lost to full rings.
+** Parameters: events written (holder), events dropped (holder)
+** Output: none
+******************************************************************************/
+void traceCounters(long long *written, long long *dropped){
+	*written = __atomic_load_n(&traceWritten, __ATOMIC_RELAXED);
+	*dropped = 0;
+	if (traceFile == NULL) {
+		return;
+	}
+	for (int i = 0; i < settings.workers; i++) {
+		*dropped += __atomic_load_n(&engines[i].trace->dropped, __ATOMIC_RELAXED);
+	}
+}
+
+/******************************************************************************
+** updateEvents()
+** Description: A function that changes the epoll events watched for a
+** connection, skipping the system call when nothing changed.
+** Parameters: event engine, connection, new event mask
+** Output: none
+** Source: http://man7.org/linux/man-pages/man2/epoll_ctl.2.html
+******************************************************************************/
+void updateEvents(struct engine *engine, struct connection *conn, unsigned int events){
+	struct epoll_event event;
+	if (conn->events == events) {
+		return;
+	}
+	event.events = events;
+	event.data.ptr = conn;
+	if (epoll_ctl(engine->epollFd, EPOLL_CTL_MOD, conn->socket, &event) == -1) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+	conn->events = events;
+}
+
+/******************************************************************************
+** watchConnection()
+** Description: A function that registers a new socket endpoint with epoll.
+** Parameters: event engine, connection, event mask
+** Output: none
+******************************************************************************/
+void watchConnection(struct engine *engine, struct connection *conn, unsigned int events){
+	struct epoll_event event;
+	event.events = events;
+	event.data.ptr = conn;
+	if (epoll_ctl(engine->epollFd, EPOLL_CTL_ADD, conn->socket, &event) == -1) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+	conn->events = events;
+}
+
+/******************************************************************************
+** receiveData()
+** Description: A function that uses the recv() function to collect the data
+** that is waiting on a non-blocking socket into the connection input buffer.
+** The receivePacket function below takes complete packets out of that buffer.
+** Parameters: connection with the socket endpoint and input buffer
+** Output: 0 success, -1 error or the client closed the connection
+******************************************************************************/
+int receiveData(struct connection *conn){
+	// set up variables for recv(); ret return val
+	int ret;
+	// read until the socket is drained or the buffer is full
+	while (conn->inEnd < conn->inSize) {
+		ret = recv(conn->socket, conn->inBuffer + conn->inEnd, conn->inSize - conn->inEnd, 0);
+		if (ret == -1) {
+			// nothing more to read right now, epoll will tell us when there is
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("recv");
+			return -1;
+		}
+		// client closed the connection
+		if (ret == 0) {
+			return -1;
+		}
+		// add the number of bytes received to the buffer
+		conn->inEnd += ret;
+	}
+	return 0;
+}
+
+/******************************************************************************
+** headerLength()
+** Description: A function that finds the number of bytes in front of a packet
+** payload: the length field (2 bytes, or 4 in version 2), the stream ID (in
+** version 3) and the tag.
+** Parameters: connection
+** Output: number of header bytes
+******************************************************************************/
+int headerLength(struct connection *conn){
+	if (conn->version == 3) {
+		return PACKET_SIZE_V2 + STREAM_ID_LENGTH + TAG_LENGTH;
+	}
+	return (conn->version == 2 ? PACKET_SIZE_V2 : PACKET_SIZE) + TAG_LENGTH;
+}
+
+/******************************************************************************
+** receivePacket()
+** Description: A function that takes one packet out of the connection input
+** buffer, once all of its bytes have arrived. Used in the control connection.
+** The payload is copied with its length, so it may hold any bytes.
+** Parameters: connection with the received bytes, the 8 byte tag (has info 
+** about what action requested, data to transfer and its length; data, tag and
+** length are changed
+** Output: 1 packet received, 0 packet not complete yet, -1 malformed packet
+** Source: http://beej.us/guide/bgnet/output/html/singlepage/bgnet.html#sonofdataencap
+******************************************************************************/
+int receivePacket(struct connection *conn, char *tag, char *data, int *dataLength){
+	// number of bytes in packet
+	unsigned int packetLength;
+	unsigned short shortLength;
+	// number of bytes in front of the payload
+	int header = headerLength(conn);
+	// wait for the packet length
+	if (conn->inEnd < header - TAG_LENGTH) {
+		return 0;
+	}
+	// source for byte order conversion: https://www.gnu.org/software/libc/manual/html_node/Byte-Order.html
+	if (conn->version >= 2) {
+		memcpy(&packetLength, conn->inBuffer, PACKET_SIZE_V2);
+		packetLength = ntohl(packetLength);
+	}
+	else {
+		memcpy(&shortLength, conn->inBuffer, PACKET_SIZE);
+		packetLength = ntohs(shortLength);
+	}
+	// the payload must fit in the receive buffers
+	if (packetLength < (unsigned int) header || packetLength - header > PAYLOAD_LENGTH) {
+		return -1;
+	}
+	// wait for the rest of the packet
+	if ((unsigned int) conn->inEnd < packetLength) {
+		return 0;
+	}
+	// copy out the tag and the payload (data)
+	memcpy(tag, conn->inBuffer + header - TAG_LENGTH, TAG_LENGTH);
+	tag[TAG_LENGTH] = '\0';
+	*dataLength = packetLength - header;
+	memcpy(data, conn->inBuffer + header, *dataLength);
+	data[*dataLength] = '\0';
+	// move any bytes of the next packet to the front of the buffer
+	memmove(conn->inBuffer, conn->inBuffer + packetLength, conn->inEnd - packetLength);
+	conn->inEnd -= packetLength;
+	return 1;
+}
+
+/******************************************************************************
+** controlConnection()
+** Description: A function that runs the control side of a client session, one
+** packet at a time. The DPORT packet sets the data port, the LIST or GET packet
+** starts the data connection and the ACK packet ends the session. A DELTA
+** packet is followed by SIGS packets with the client's block signatures, the
+** transfer starts once they are all in. A kept
+** session (DPORT option keep=1) runs commands until QUIT instead. The program
+** prints to the server screen what actions are taking place. Used in
+** handleControl().
+** Parameters: event engine, client session, received tag and data
+** Output: 0 success, -1 error
+******************************************************************************/
+int controlConnection(struct engine *engine, struct session *session, char *tagIn, char *dataIn){
+	// value of a DPORT option
+	char value[16];
+	// the STATS reply
+	char stats[STATS_TEXT_SIZE];
+	switch (session->state) {
+	case DPORT_STATE:
+		// get the data port
+		if (strcmp(tagIn, "DPORT") == 0) { session->dataPort = atoi(dataIn); }
+		TRACE(TRACE_SESSIONS, TRACE_DATA_PORT, session, session->dataPort);
+		// options the client supports follow the port number
+		session->streamBody = findOption(dataIn, "stream", value, sizeof(value)) && strcmp(value, "1") == 0;
+		session->keepOpen = findOption(dataIn, "keep", value, sizeof(value)) && strcmp(value, "1") == 0;
+		// version 2 packets: 32 bit length, FILE payloads of the chunk size the client asks for
+		if (findOption(dataIn, "v", value, sizeof(value)) && atoi(value) >= 2) {
+			session->version = 2;
+			session->chunkSize = DEFAULT_CHUNK_SIZE;
+			if (findOption(dataIn, "chunk", value, sizeof(value)) && atoi(value) > 0) {
+				session->chunkSize = atoi(value);
+			}
+			if (session->chunkSize > MAX_CHUNK_SIZE) {
+				session->chunkSize = MAX_CHUNK_SIZE;
+			}
+		}
+		// version 3 packets: the transfers share the control connection, each on
+		// its own stream (only with version 2 lengths)
+		if (session->version == 2 && findOption(dataIn, "mux", value, sizeof(value)) && strcmp(value, "1") == 0) {
+			session->version = 3;
+			session->mux = 1;
+			session->data.carrier = &session->control;
+			// the control output buffer takes the data buffer next to it
+			session->control.outSize = CONTROL_BUFFER_SIZE + DATA_BUFFER_SIZE;
+		}
+		// compression: the client lists the formats it reads ("z=zstd,deflate"), this
+		// server writes deflate only; compressed files go in FILE packets, never raw
+		if (session->version >= 2 && findOption(dataIn, "z", value, sizeof(value))) {
+			char *format, *next;
+			for (format = strtok_r(value, ",", &next); format != NULL; format = strtok_r(NULL, ",", &next)) {
+				if (strcmp(format, "deflate") == 0) {
+					session->compressLevel = DEFAULT_DEFLATE_LEVEL;
+				}
+			}
+			if (session->compressLevel && findOption(dataIn, "zlevel", value, sizeof(value)) &&
+				atoi(value) >= 1 && atoi(value) <= 9) {
+				session->compressLevel = atoi(value);
+			}
+			if (session->compressLevel) {
+				session->streamBody = 0;
+			}
+		}
+		// checksum in DONE: the first of the client's list this server computes
+		if (findOption(dataIn, "sum", value, sizeof(value))) {
+			char *type, *next;
+			for (type = strtok_r(value, ",", &next); type != NULL && session->checksumType == NO_CHECKSUM;
+				type = strtok_r(NULL, ",", &next)) {
+				if (strcmp(type, "crc32c") == 0) {
+					session->checksumType = CRC32C_CHECKSUM;
+				}
+				else if (strcmp(type, "crc32") == 0) {
+					session->checksumType = CRC32_CHECKSUM;
+				}
+			}
+		}
+		session->state = COMMAND_STATE;
+		return 0;
+
+	case COMMAND_STATE:
+		// get client user command and filename
+		strcpy(session->userCommand, tagIn);
+		strcpy(session->filename, dataIn);
+		session->commandStart = currentMicros();
+		// a kept session ends when the client says so
+		if (session->keepOpen && strcmp(tagIn, "QUIT") == 0) {
+			TRACE(TRACE_COMMANDS, TRACE_QUIT, session, 0);
+			handleRequest(&session->control, "CLOSE", "");
+			if (session->data.socket != -1) {
+				close(session->data.socket);
+				session->data.socket = -1;
+				TRACE(TRACE_SESSIONS, TRACE_DATA_CLOSE, session, 0);
+			}
+			session->state = CLOSING_STATE;
+			return 0;
+		}
+		// the server metrics are answered on the control connection, without a
+		// transfer; a kept session goes on with its next command, otherwise
+		// STATS is the whole session
+		if (strcmp(tagIn, "STATS") == 0) {
+			TRACE(TRACE_COMMANDS, TRACE_STATS, session, 0);
+			countMetric(&workerMetrics->stats, 1);
+			writeStats(stats, sizeof(stats));
+			handleRequest(&session->control, "STATS", stats);
+			if (session->transfers > 0) {
+				handleRequest(&session->control, "NEXT", "");
+				return 0;
+			}
+			handleRequest(&session->control, "CLOSE", "");
+			session->state = CLOSING_STATE;
+			return 0;
+		}
+		// the block signatures of the client's copy follow a DELTA
+		if (strcmp(tagIn, "DELTA") == 0) {
+			if (startDelta(session) == -1) {
+				TRACE(TRACE_COMMANDS, TRACE_COMMAND_ERROR, session, 0);
+				handleRequest(&session->control, "ERROR", "Error: Bad block size or count");
+				countMetric(&workerMetrics->errors, 1);
+				session->state = CLOSING_STATE;
+				return 0;
+			}
+			if (session->delta->received < session->delta->numberBlocks) {
+				TRACE(TRACE_COMMANDS, TRACE_SIGNATURES, session, session->delta->numberBlocks);
+				session->state = SIGNATURE_STATE;
+				return 0;
+			}
+		}
+		return runCommand(engine, session);
+
+	case SIGNATURE_STATE:
+		if (strcmp(tagIn, "SIGS") != 0 || addSignatures(session, dataIn, session->dataInLength) == -1) {
+			fprintf(stderr, "ftserver: Bad block signatures from \"%s\"\n", session->clientIPv4);
+			return -1;
+		}
+		if (session->delta->received < session->delta->numberBlocks) {
+			return 0;
+		}
+		session->state = COMMAND_STATE;
+		return runCommand(engine, session);
+
+	case ACK_STATE:
+		// the client received DONE, close the data connection
+		if (session->data.socket != -1) {
+			close(session->data.socket);
+			session->data.socket = -1;
+			TRACE(TRACE_SESSIONS, TRACE_DATA_CLOSE, session, 0);
+		}
+		session->state = CLOSING_STATE;
+		return 0;
+
+	default:
+		// packets while connecting or transferring are not part of the protocol
+		fprintf(stderr, "ftserver: Unexpected \"%s\" packet from \"%s\"\n", tagIn, session->clientIPv4);
+		return -1;
+	}
+}
+
+/******************************************************************************
+** runCommand()
+** Description: A function that starts the command of the session once it is
+** all in: the next command of a kept session runs on its data connection, the
+** first one is answered with OKAY (or ERROR) and opens the data connection.
+** Used in controlConnection().
+** Parameters: event engine, client session
+** Output: 0 success
+******************************************************************************/
+int runCommand(struct engine *engine, struct session *session){
+	// options accepted by the server, sent back with OKAY
+	char accepted[128];
+	// the next command of a kept session reuses its data connection
+	// (an unknown command is answered there too, with ERROR and an empty transfer)
+	if (session->transfers > 0) {
+		startTransfer(session);
+		if (!session->mux) {
+			updateEvents(engine, &session->data, EPOLLOUT);
+		}
+		return 0;
+	}
+	// check if user entered the command (either -l or -g) correctly
+	if (strcmp(session->userCommand, "LIST") != 0 && strcmp(session->userCommand, "GET") != 0 &&
+		strcmp(session->userCommand, "MGET") != 0 && strcmp(session->userCommand, "DELTA") != 0 &&
+		strcmp(session->userCommand, "PUT") != 0) {
+		TRACE(TRACE_COMMANDS, TRACE_COMMAND_ERROR, session, 0);
+		handleRequest(&session->control, "ERROR", "Command must be either -l, -g, -g --delta, -b or -p");
+		countMetric(&workerMetrics->errors, 1);
+		session->state = CLOSING_STATE;
+		return 0;
+	}
+	// after the above collects the: port, client user command and checks for errors,
+	// open the data connection (where the listing or files are sent)
+	// the OKAY payload lists the options the server accepted,
+	// every packet after it uses the agreed packet format
+	TRACE(TRACE_COMMANDS, TRACE_OKAY, session, 0);
+	accepted[0] = '\0';
+	if (session->streamBody) {
+		strcat(accepted, "stream=1 ");
+	}
+	if (session->keepOpen) {
+		strcat(accepted, "keep=1 ");
+	}
+	if (session->mux) {
+		strcat(accepted, "mux=1 ");
+	}
+	if (session->compressLevel) {
+		sprintf(accepted + strlen(accepted), "z=deflate zlevel=%d ", session->compressLevel);
+	}
+	if (session->checksumType != NO_CHECKSUM) {
+		strcat(accepted, session->checksumType == CRC32C_CHECKSUM ? "sum=crc32c " : "sum=crc32 ");
+	}
+	if (session->version >= 2) {
+		sprintf(accepted + strlen(accepted), "v=2 chunk=%d", session->chunkSize);
+	}
+	handleRequest(&session->control, "OKAY", accepted);
+	session->control.version = session->data.version = session->version;
+	// multiplexed: the transfer follows on the control connection right away
+	if (session->mux) {
+		startTransfer(session);
+		return 0;
+	}
+	openDataConnection(engine, session);
+	return 0;
+}
+
+/******************************************************************************
+** startTransfer()
+** Description: A function that prepares the listing or file once the data
+** connection is established. Errors (file not found, cannot open) are sent on
+** the control connection, and the transfer finishes right away. A kept
+** session calls it again for each of its commands. A GET may ask for a range
+** of the file (offset and length options after the filename); the range
+** sent is confirmed in a RANGE packet after the FILE packet. When the session
+** agreed on compression, a whole hot file is sent from its precompressed copy,
+** anything else is deflated while sending. The checksum of a whole file is
+** taken from the remembered digests when it is there.
+** Parameters: client session
+** Output: none
+******************************************************************************/
+void startTransfer(struct session *session){
+	// index entry of the requested file
+	struct fileEntry file;
+	// file length, sent in the SIZE packet
+	struct stat info;
+	char size[64];
+	session->state = TRANSFER_STATE;
+	session->transferStatus = 0;
+	session->sendChecksum = 0;
+	// the transfer report counts this command only, the counts so far go to the metrics
+	foldCounters(session);
+	session->awaitingFirstByte = 1;
+	// each transfer is a new stream (seen in version 3 packets only)
+	session->data.stream = ++session->transfers;
+	// if client user command to list the filenames, send them one per packet
+	if (strcmp(session->userCommand, "LIST") == 0) {
+		// paging and filter options follow the (empty) first line of the payload
+		char value[32];
+		countMetric(&workerMetrics->lists, 1);
+		session->listSkip = 0;
+		session->listRemaining = -1;
+		if (findOption(session->filename, "offset", value, sizeof(value))) {
+			session->listSkip = strtoll(value, NULL, 10);
+		}
+		if (findOption(session->filename, "limit", value, sizeof(value))) {
+			session->listRemaining = strtoll(value, NULL, 10);
+		}
+		if (!findOption(session->filename, "prefix", session->listPrefix, sizeof(session->listPrefix))) {
+			session->listPrefix[0] = '\0';
+		}
+		// the files in the current directory, from the index snapshot
+		if (directoryIndex.enabled) {
+			session->listing = acquireListing();
+			session->fileIndex = 0;
+			TRACE(TRACE_COMMANDS, TRACE_LIST, session, session->listing->numberFiles);
+			return;
+		}
+		// no index: read the directory while sending, a batch at a time
+		session->dirFd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		session->direntBuffer = malloc(DIRENT_BUFFER_SIZE);
+		if (session->dirFd == -1 || session->direntBuffer == NULL) {
+			perror("open directory");
+			session->transferStatus = -1;
+			return;
+		}
+		session->direntOffset = session->direntEnd = 0;
+		TRACE(TRACE_COMMANDS, TRACE_LIST_STREAM, session, 0);
+		return;
+	}
+	// if client user command to get a file, check that it exists and open it
+	if (strcmp(session->userCommand, "GET") == 0) {
+		// a range of the file: offset and length options follow the filename
+		char value[32];
+		long long offset = 0, length = -1;
+		int ranged = 0;
+		countMetric(&workerMetrics->gets, 1);
+		if (findOption(session->filename, "offset", value, sizeof(value))) {
+			offset = strtoll(value, NULL, 10);
+			ranged = 1;
+		}
+		if (findOption(session->filename, "length", value, sizeof(value))) {
+			length = strtoll(value, NULL, 10);
+			ranged = 1;
+		}
+		session->filename[strcspn(session->filename, "\n")] = '\0';
+		// if the filename is not in the directory, send error
+		if (!lookupFile(session->filename, &file)) {
+			TRACE(TRACE_COMMANDS, TRACE_FILE_ERROR, session, 0);
+			handleRequest(&session->control, "ERROR", "Error: File not found");
+			session->transferStatus = -1;
+			return;
+		}
+		// the checksum of the bytes sent goes in DONE; a whole file is hashed
+		// only when its digest is not remembered
+		session->sentFile = file;
+		session->wholeFile = !ranged;
+		session->checksum = 0;
+		session->checksumming = 0;
+		if (session->checksumType != NO_CHECKSUM) {
+			session->sendChecksum = 1;
+			session->checksumming = !session->wholeFile ||
+				!findDigest(session->filename, &file, session->checksumType, &session->checksum);
+		}
+		// a whole hot file is sent compressed already, from the cache
+		if (session->compressLevel && !ranged) {
+			session->cached = acquireCompressedFile(session->filename, &file, session->compressLevel);
+			// the deflate stream is not the file, its checksum comes from the plain copy
+			if (session->cached != NULL && session->checksumming) {
+				struct cachedFile *plain = acquireCachedFile(session->filename, &file);
+				if (plain != NULL) {
+					updateChecksum(session, plain->data, plain->size);
+					releaseCachedFile(plain);
+					storeDigest(session->filename, &file, session->checksumType, session->checksum);
+					session->checksumming = 0;
+				}
+				else {
+					releaseCachedFile(session->cached);
+					session->cached = NULL;
+				}
+			}
+			if (session->cached != NULL) {
+				session->fileSize = file.size;
+				session->sendingFile = 1;
+				session->bodyOffset = 0;
+				session->bodyEnd = session->cached->size;
+				handleRequest(&session->data, "FILE", session->filename);
+				TRACE(TRACE_COMMANDS, TRACE_GET_PRECOMPRESSED, session, session->cached->size);
+				return;
+			}
+		}
+		// hot files are sent from the cache, without opening them
+		session->cached = acquireCachedFile(session->filename, &file);
+		if (session->cached != NULL) {
+			session->fileSize = session->cached->size;
+		}
+		else {
+			// open file, if file will not open, send error
+			session->infile = fopen(session->filename, "r");
+			if (session->infile == NULL) {
+				TRACE(TRACE_COMMANDS, TRACE_OPEN_ERROR, session, 0);
+				handleRequest(&session->control, "ERROR", "Error: cannot open file");
+				session->transferStatus = -1;
+				return;
+			}
+			if (fstat(fileno(session->infile), &info) == -1) {
+				perror("fstat");
+				TRACE(TRACE_COMMANDS, TRACE_OPEN_ERROR, session, 0);
+				handleRequest(&session->control, "ERROR", "Error: cannot open file");
+				fclose(session->infile);
+				session->infile = NULL;
+				session->transferStatus = -1;
+				return;
+			}
+			session->fileSize = info.st_size;
+		}
+		session->sendingFile = 1;
+		// call handleRequest() to transfer name of file
+		handleRequest(&session->data, "FILE", session->filename);
+		// the range is cut to the file, and confirmed as "offset length file-length"
+		if (offset < 0 || offset > session->fileSize) {
+			offset = offset < 0 ? 0 : session->fileSize;
+		}
+		if (length < 0 || length > session->fileSize - offset) {
+			length = session->fileSize - offset;
+		}
+		session->bodyOffset = offset;
+		session->bodyEnd = offset + length;
+		if (ranged) {
+			snprintf(size, sizeof(size), "%lld %lld %lld", offset, length, (long long) session->fileSize);
+			handleRequest(&session->data, "RANGE", size);
+			if (session->infile != NULL) {
+				fseeko(session->infile, offset, SEEK_SET);
+			}
+		}
+		// compressed: the range goes through a deflate stream
+		if (session->compressLevel) {
+			session->deflater = calloc(1, sizeof(z_stream));
+			session->deflateInput = malloc(DEFLATE_INPUT_SIZE);
+			assert(session->deflater != NULL && session->deflateInput != NULL);
+			if (deflateInit(session->deflater, session->compressLevel) != Z_OK) {
+				fprintf(stderr, "ftserver: Cannot start compression\n");
+				free(session->deflater);
+				session->deflater = NULL;
+				session->transferStatus = -1;
+			}
+			TRACE(TRACE_COMMANDS, TRACE_GET_COMPRESSING, session, length);
+			return;
+		}
+		// announce the length once, the body follows without packets
+		if (session->streamBody) {
+			session->bodyRemaining = length;
+			snprintf(size, sizeof(size), "%lld", length);
+			handleRequest(&session->data, "SIZE", size);
+			TRACE(TRACE_COMMANDS, session->cached != NULL ? TRACE_GET_CACHED : TRACE_GET_ZERO_COPY, session, length);
+			return;
+		}
+		TRACE(TRACE_COMMANDS, session->cached != NULL ? TRACE_GET_CACHED : TRACE_GET, session, length);
+		return;
+	}
+	// a delta GET: the file is scanned for the client's blocks while sending
+	if (strcmp(session->userCommand, "DELTA") == 0) {
+		countMetric(&workerMetrics->deltas, 1);
+		session->filename[strcspn(session->filename, "\n")] = '\0';
+		if (!lookupFile(session->filename, &file)) {
+			TRACE(TRACE_COMMANDS, TRACE_FILE_ERROR, session, 0);
+			handleRequest(&session->control, "ERROR", "Error: File not found");
+			session->transferStatus = -1;
+			return;
+		}
+		// DONE carries the checksum of the whole new file
+		session->sentFile = file;
+		session->wholeFile = 1;
+		session->checksum = 0;
+		session->checksumming = 0;
+		if (session->checksumType != NO_CHECKSUM) {
+			session->sendChecksum = 1;
+			session->checksumming = !findDigest(session->filename, &file, session->checksumType, &session->checksum);
+		}
+		if (openDelta(session, &file) == -1) {
+			TRACE(TRACE_COMMANDS, TRACE_OPEN_ERROR, session, 0);
+			handleRequest(&session->control, "ERROR", "Error: cannot open file");
+			session->transferStatus = -1;
+			return;
+		}
+		handleRequest(&session->data, "PATCH", session->filename);
+		TRACE(TRACE_COMMANDS, TRACE_DELTA, session, session->delta->numberBlocks);
+		return;
+	}
+	// a batch GET: the names and patterns are matched now, the files follow one
+	// another as ENTRY packets and raw bodies, whatever the session agreed on
+	if (strcmp(session->userCommand, "MGET") == 0) {
+		countMetric(&workerMetrics->batches, 1);
+		if (!matchBatch(session)) {
+			TRACE(TRACE_COMMANDS, TRACE_FILE_ERROR, session, 0);
+			handleRequest(&session->control, "ERROR", "Error: No files matched");
+			session->transferStatus = -1;
+			return;
+		}
+		// DONE carries the checksum of all the bodies, one after the other
+		session->wholeFile = 0;
+		session->checksum = 0;
+		session->sendChecksum = session->checksumming = session->checksumType != NO_CHECKSUM;
+		TRACE(TRACE_COMMANDS, TRACE_MGET, session, session->batchCount);
+		return;
+	}
+	// an upload: the client sends the file on the data connection once READY
+	// is out, it is written to a new file that replaces the old one at the end
+	if (strcmp(session->userCommand, "PUT") == 0) {
+		char value[32];
+		countMetric(&workerMetrics->puts, 1);
+		session->uploadSize = -1;
+		if (findOption(session->filename, "size", value, sizeof(value))) {
+			session->uploadSize = strtoll(value, NULL, 10);
+		}
+		session->filename[strcspn(session->filename, "\n")] = '\0';
+		// the body needs a connection of its own
+		if (session->mux) {
+			TRACE(TRACE_COMMANDS, TRACE_COMMAND_ERROR, session, 0);
+			handleRequest(&session->control, "ERROR", "Error: PUT needs a data connection");
+			session->transferStatus = -1;
+			return;
+		}
+		if (session->uploadSize < 0 || !allowedName(session->filename)) {
+			TRACE(TRACE_COMMANDS, TRACE_FILE_ERROR, session, 0);
+			handleRequest(&session->control, "ERROR", "Error: Bad filename or size");
+			session->transferStatus = -1;
+			return;
+		}
+		if (startUpload(session) == -1) {
+			perror("create file");
+			TRACE(TRACE_COMMANDS, TRACE_CREATE_ERROR, session, 0);
+			handleRequest(&session->control, "ERROR", errno == ENOSPC ? "Error: No space for the file" : "Error: cannot create file");
+			session->transferStatus = -1;
+			return;
+		}
+		// DONE carries the checksum of the bytes received
+		session->wholeFile = 1;
+		session->checksum = 0;
+		session->sendChecksum = session->checksumming = session->checksumType != NO_CHECKSUM;
+		snprintf(size, sizeof(size), "%lld", (long long) session->uploadSize);
+		handleRequest(&session->data, "READY", size);
+		TRACE(TRACE_COMMANDS, session->copyBody ? TRACE_PUT : TRACE_PUT_ZERO_COPY, session, session->uploadSize);
+		return;
+	}
+	// if we get here, there is an error in the client user command tag
+	fprintf(stderr, "ftserver: User command must be \"LIST\", "
+		"\"GET\", \"MGET\", \"DELTA\" or \"PUT\"; received \"%s\"\n", session->userCommand);
+	TRACE(TRACE_COMMANDS, TRACE_COMMAND_ERROR, session, 0);
+	handleRequest(&session->control, "ERROR", "Command must be either -l, -g, -g --delta, -b or -p");
+	session->transferStatus = -1;
+}
+
+/******************************************************************************
+** finishTransfer()
+** Description: A function that ends the listing or file transfer: DONE goes
+** on the data connection (with the checksum of a GET when the session agreed
+** on one), and the send system calls are reported once it is out. A kept
+** session then sends NEXT and runs its next command on the same data
+** connection, the others send CLOSE and wait for the client ACK. Used in
+** dataConnection().
+** Parameters: client session
+** Output: none
+******************************************************************************/
+void finishTransfer(struct session *session){
+	// checksum of the file bytes sent, as "crc32c=1a2b3c4d"
+	char sum[32] = "";
+	closeListing(session);
+	closeDelta(session);
+	// the digest of a whole file is remembered for the next GET
+	if (session->sendChecksum) {
+		if (session->checksumming && session->wholeFile && session->transferStatus == 0) {
+			storeDigest(session->filename, &session->sentFile, session->checksumType, session->checksum);
+		}
+		snprintf(sum, sizeof(sum), "%s=%08x", session->checksumType == CRC32C_CHECKSUM ? "crc32c" : "crc32",
+			session->checksum);
+	}
+	// final FT tag must be labeled DONE, so that the client knows transfer is complete
+	handleRequest(&session->data, "DONE", sum);
+	session->reportPending = 1;
+	// the time from the command to DONE
+	if (strcmp(session->userCommand, "GET") == 0) {
+		recordValue(&workerMetrics->getTime, currentMicros() - session->commandStart);
+	}
+	else if (strcmp(session->userCommand, "LIST") == 0) {
+		recordValue(&workerMetrics->listTime, currentMicros() - session->commandStart);
+	}
+	if (session->transferStatus != 0) {
+		countMetric(&workerMetrics->errors, 1);
+	}
+	if (session->keepOpen) {
+		// commands the client sent meanwhile wait in the control input buffer
+		handleRequest(&session->control, "NEXT", "");
+		session->state = COMMAND_STATE;
+		return;
+	}
+	// user (client) is sent close request
+	TRACE(TRACE_COMMANDS, TRACE_CLOSE_SENT, session, 0);
+	handleRequest(&session->control, "CLOSE", "");
+	session->state = ACK_STATE;
+}
+
+/******************************************************************************
+** reportTransfer()
+** Description: A function that reports the packets, bytes and send system
+** calls of the transfer once its last batch (with DONE) is sent, so the
+** final flush is counted. Until then the commands pipelined by a kept
+** session wait, since the next transfer starts the count again. Used after
+** the data connection (or, multiplexed, the control connection) is sent, and
+** when the session closes, with what was sent of it.
+** Parameters: client session, whether the session is closing
+** Output: 1 reported, 0 nothing to report yet
+******************************************************************************/
+int reportTransfer(struct session *session, int closing){
+	if (!session->reportPending || (!closing && pendingOutput(&session->data))) {
+		return 0;
+	}
+	session->reportPending = 0;
+	TRACE(TRACE_COMMANDS, TRACE_DONE, session, session->data.carrier->bytesSent);
+	TRACE(TRACE_COMMANDS, TRACE_PACKETS, session, session->data.packets);
+	TRACE(TRACE_COMMANDS, TRACE_SEND_CALLS, session, session->data.carrier->sendCalls);
+	return 1;
+}
+
+/******************************************************************************
+** closeListing()
+** Description: A function that lets go of the listing of a LIST transfer:
+** the index snapshot, or the directory and buffer of a streamed listing, and
+** of the names of a batch GET.
+** Parameters: client session
+** Output: none
+******************************************************************************/
+void closeListing(struct session *session){
+	// the snapshot is freed with the last transfer using it
+	if (session->listing != NULL) {
+		releaseListing(session->listing);
+		session->listing = NULL;
+	}
+	if (session->dirFd != -1) {
+		close(session->dirFd);
+		session->dirFd = -1;
+	}
+	free(session->direntBuffer);
+	session->direntBuffer = NULL;
+	if (session->batchLines != NULL) {
+		for (int i = 0; i < session->batchCount; i++) {
+			free(session->batchNames[i]);
+		}
+		free(session->batchLines);
+		session->batchLines = NULL;
+	}
+	free(session->batchNames);
+	session->batchNames = NULL;
+	session->batchCount = session->batchNext = session->batchAhead = 0;
+	session->numberLines = session->batchLine = session->batchScanning = 0;
+}
+
+/******************************************************************************
+** findOption()
+** Description: A function that looks up an option in a packet payload. Options
+** follow the first line of the payload as space separated key=value pairs,
+** e.g. "30472\nstream=1". Older clients send no options at all.
+** Parameters: payload, option key, buffer for the value and its size
+** Output: 1 option found (value is changed), 0 not found
+******************************************************************************/
+int findOption(char *payload, char *key, char *value, int size){
+	int keyLength = strlen(key);
+	// options start after the first newline
+	char *option = strchr(payload, '\n');
+	while (option != NULL) {
+		// skip the separator, then compare the key
+		option++;
+		if (strncmp(option, key, keyLength) == 0 &&
+			(option[keyLength] == '=' || option[keyLength] == ' ' || option[keyLength] == '\n' || option[keyLength] == '\0')) {
+			// copy the value up to the next separator
+			int length = 0;
+			char *start = option + keyLength + (option[keyLength] == '=');
+			if (option[keyLength] == '=') {
+				length = strcspn(start, " \n");
+			}
+			if (length >= size) {
+				length = size - 1;
+			}
+			memcpy(value, start, length);
+			value[length] = '\0';
+			return 1;
+		}
+		option = strpbrk(option, " \n");
+	}
+	return 0;
+}
+
+/******************************************************************************
+** nextListedName()
+** Description: A function that finds the next name a LIST sends, from the
+** index snapshot or, without the index, from the directory itself. Directory
+** entries are read in large batches with getdents64() and subdirectories are
+** told apart by their entry type, so a directory of any size is sent with one
+** buffer. Names without the LIST prefix and the first offset names are
+** skipped. Every entry looked at counts against the session budget, so long
+** scans take turns with the other sessions. Used in dataConnection().
+** Parameters: client session, name (changed), bytes queued so far in this turn (changed)
+** Output: 1 name found, 0 listing finished, 2 budget used, -1 error
+** Source: http://man7.org/linux/man-pages/man2/getdents.2.html
+******************************************************************************/
+int nextListedName(struct session *session, char **name, int *budget){
+	size_t prefixLength = strlen(session->listPrefix);
+	char *candidate;
+	while (*budget < DATA_BUDGET) {
+		*budget += LIST_ENTRY_COST;
+		if (session->listing != NULL) {
+			if (session->fileIndex == session->listing->numberFiles) {
+				return 0;
+			}
+			candidate = session->listing->files[session->fileIndex++].name;
+		}
+		else {
+			struct dirent64 *entry;
+			// read the next batch of entries
+			if (session->direntOffset == session->direntEnd) {
+				ssize_t length = getdents64(session->dirFd, session->direntBuffer, DIRENT_BUFFER_SIZE);
+				if (length == -1) {
+					perror("getdents64");
+					return -1;
+				}
+				if (length == 0) {
+					return 0;
+				}
+				session->direntOffset = 0;
+				session->direntEnd = length;
+			}
+			entry = (struct dirent64 *) (session->direntBuffer + session->direntOffset);
+			session->direntOffset += entry->d_reclen;
+			candidate = entry->d_name;
+			// if there are subdirectories, ignore them; stat() only when the
+			// file system does not fill in the entry type
+			if (entry->d_type == DT_DIR) {
+				continue;
+			}
+			if (entry->d_type == DT_UNKNOWN) {
+				struct stat info;
+				if (fstatat(session->dirFd, candidate, &info, 0) == -1 || S_ISDIR(info.st_mode)) {
+					continue;
+				}
+			}
+		}
+		if (strncmp(candidate, session->listPrefix, prefixLength) != 0) {
+			continue;
+		}
+		if (session->listSkip > 0) {
+			session->listSkip--;
+			continue;
+		}
+		*name = candidate;
+		return 1;
+	}
+	return 2;
+}
+
+/******************************************************************************
+** matchBatch()
+** Description: A function that finds the files of a batch GET. The payload
+** holds one name or shell pattern per line, e.g. "a.txt\nlogs-*.txt". A name
+** is looked up in the directory index, a pattern is matched against the
+** index snapshot, so the directory is read once for the whole batch. Without
+** the index, patterns are matched while sending by scanBatch(), so a large
+** directory is not read (and stat()ed) at once on the event loop. The files
+** are sent in the order asked, each once. Used in startTransfer().
+** Parameters: client session
+** Output: number of files found, 1 when they are found while sending
+** Source: http://man7.org/linux/man-pages/man3/fnmatch.3.html
+******************************************************************************/
+int matchBatch(struct session *session){
+	// the lines of the payload, split in place
+	char *patterns[PAYLOAD_LENGTH / 2 + 1];
+	int numberPatterns = 0, numberGlobs = 0;
+	char *line, *next;
+	struct fileEntry file;
+	for (line = strtok_r(session->filename, "\n", &next); line != NULL; line = strtok_r(NULL, "\n", &next)) {
+		numberGlobs += strpbrk(line, "*?[\\") != NULL;
+		patterns[numberPatterns++] = line;
+	}
+	// no index: the directory is streamed a batch of entries at a time, like a LIST
+	if (numberGlobs > 0 && !directoryIndex.enabled) {
+		session->dirFd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		session->direntBuffer = malloc(DIRENT_BUFFER_SIZE);
+		if (session->dirFd == -1 || session->direntBuffer == NULL) {
+			perror("open directory");
+			return 0;
+		}
+		session->batchLines = malloc(numberPatterns * sizeof(char *));
+		assert(session->batchLines != NULL);
+		memcpy(session->batchLines, patterns, numberPatterns * sizeof(char *));
+		session->numberLines = numberPatterns;
+		return 1;
+	}
+	for (int i = 0; i < numberPatterns; i++) {
+		if (strpbrk(patterns[i], "*?[\\") == NULL) {
+			if (lookupFile(patterns[i], &file)) {
+				addBatchName(session, patterns, i, patterns[i]);
+			}
+			continue;
+		}
+		// the first pattern takes the index snapshot
+		if (session->listing == NULL) {
+			session->listing = acquireListing();
+		}
+		for (int j = 0; j < session->listing->numberFiles; j++) {
+			if (fnmatch(patterns[i], session->listing->files[j].name, FNM_PERIOD) == 0) {
+				addBatchName(session, patterns, i, session->listing->files[j].name);
+			}
+		}
+	}
+	return session->batchCount;
+}
+
+/******************************************************************************
+** addBatchName()
+** Description: A function that adds a file to a batch GET, unless one of the
+** names or patterns before the one it matched took it already, or the name is
+** not one allowedName() lets clients use. The list of names grows by
+** doubling. A batch matched while sending keeps a copy of the name, the
+** directory buffer it points into is reused.
+** Parameters: client session, names and patterns of the batch, the one that
+** matched, file name
+** Output: none
+******************************************************************************/
+void addBatchName(struct session *session, char **patterns, int pattern, char *name){
+	if (!allowedName(name)) {
+		return;
+	}
+	for (int i = 0; i < pattern; i++) {
+		if (fnmatch(patterns[i], name, FNM_PERIOD) == 0) {
+			return;
+		}
+	}
+	if ((session->batchCount & (session->batchCount - 1)) == 0) {
+		session->batchNames = realloc(session->batchNames, (session->batchCount ? 2 * session->batchCount : 1) * sizeof(char *));
+		assert(session->batchNames != NULL);
+	}
+	session->batchNames[session->batchCount] = session->batchLines != NULL ? strdup(name) : name;
+	assert(session->batchNames[session->batchCount] != NULL);
+	session->batchCount++;
+}
+
+/******************************************************************************
+** scanBatch()
+** Description: A function that matches the lines of a batch GET without the
+** directory index, in the order asked: a name is looked up, a pattern is
+** matched against the directory read with getdents64() from the start, a
+** batch of entries at a time. Names are added until BATCH_READAHEAD_FILES
+** wait to be sent (the ones sent are freed first). Every entry looked at
+** counts against the session budget, like a streamed LIST, so a large
+** directory takes turns with the other sessions. Used in dataConnection().
+** Parameters: client session, bytes queued so far in this turn (changed)
+** Output: 1 names to send or no lines left, 2 budget used, -1 error
+** Source: http://man7.org/linux/man-pages/man2/getdents.2.html
+******************************************************************************/
+int scanBatch(struct session *session, int *budget){
+	struct fileEntry file;
+	struct dirent64 *entry;
+	char *line;
+	// the names sent are done with, the ones waiting move to the front
+	if (session->batchNext > 0) {
+		for (int i = 0; i < session->batchNext; i++) {
+			free(session->batchNames[i]);
+		}
+		session->batchCount -= session->batchNext;
+		memmove(session->batchNames, session->batchNames + session->batchNext, session->batchCount * sizeof(char *));
+		session->batchAhead = session->batchAhead > session->batchNext ? session->batchAhead - session->batchNext : 0;
+		session->batchNext = 0;
+	}
+	while (session->batchLine < session->numberLines && session->batchCount < BATCH_READAHEAD_FILES &&
+		*budget < DATA_BUDGET) {
+		line = session->batchLines[session->batchLine];
+		*budget += LIST_ENTRY_COST;
+		if (strpbrk(line, "*?[\\") == NULL) {
+			if (lookupFile(line, &file)) {
+				addBatchName(session, session->batchLines, session->batchLine, line);
+			}
+			session->batchLine++;
+			continue;
+		}
+		// each pattern reads the directory from its start
+		if (!session->batchScanning) {
+			if (lseek(session->dirFd, 0, SEEK_SET) == -1) {
+				perror("lseek");
+				return -1;
+			}
+			session->direntOffset = session->direntEnd = 0;
+			session->batchScanning = 1;
+		}
+		if (session->direntOffset == session->direntEnd) {
+			ssize_t length = getdents64(session->dirFd, session->direntBuffer, DIRENT_BUFFER_SIZE);
+			if (length == -1) {
+				perror("getdents64");
+				return -1;
+			}
+			// the directory is done, on to the next line
+			if (length == 0) {
+				session->batchScanning = 0;
+				session->batchLine++;
+				continue;
+			}
+			session->direntOffset = 0;
+			session->direntEnd = length;
+		}
+		entry = (struct dirent64 *) (session->direntBuffer + session->direntOffset);
+		session->direntOffset += entry->d_reclen;
+		if (entry->d_type == DT_DIR || fnmatch(line, entry->d_name, FNM_PERIOD) != 0) {
+			continue;
+		}
+		// stat() only when the file system does not fill in the entry type
+		if (entry->d_type == DT_UNKNOWN) {
+			struct stat info;
+			if (fstatat(session->dirFd, entry->d_name, &info, 0) == -1 || S_ISDIR(info.st_mode)) {
+				continue;
+			}
+		}
+		addBatchName(session, session->batchLines, session->batchLine, entry->d_name);
+	}
+	return session->batchCount > 0 || session->batchLine == session->numberLines ? 1 : 2;
+}
+
+/******************************************************************************
+** readAheadBatch()
+** Description: A function that asks the kernel to read the next files of a
+** batch GET into the page cache, up to BATCH_READAHEAD_FILES files ahead of
+** the one being sent. POSIX_FADV_WILLNEED starts the reads and returns, so
+** the disk works on the next files while the network takes this one, and a
+** small file is read without waiting when its turn comes.
+** Parameters: client session
+** Output: none
+** Source: http://man7.org/linux/man-pages/man2/posix_fadvise.2.html
+******************************************************************************/
+void readAheadBatch(struct session *session){
+	int fd;
+	if (session->batchAhead < session->batchNext) {
+		session->batchAhead = session->batchNext;
+	}
+	while (session->batchAhead < session->batchCount &&
+		session->batchAhead < session->batchNext + BATCH_READAHEAD_FILES) {
+		fd = open(session->batchNames[session->batchAhead++], O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			continue;
+		}
+		posix_fadvise(fd, 0, BATCH_READAHEAD_BYTES, POSIX_FADV_WILLNEED);
+		close(fd);
+	}
+}
+
+/******************************************************************************
+** openBatchFile()
+** Description: A function that opens the next file of a batch GET, from the
+** hot file cache or the directory, and queues its ENTRY packet: the length
+** and the name, e.g. "1024 a.txt". The raw body follows the packet. Files
+** removed since the batch was matched, or that will not open, are skipped.
+** Used in dataConnection().
+** Parameters: client session
+** Output: 1 file opened, 0 no files left
+******************************************************************************/
+int openBatchFile(struct session *session){
+	struct fileEntry file;
+	struct stat info;
+	char entry[PAYLOAD_LENGTH + 1];
+	char *name;
+	while (session->batchNext < session->batchCount) {
+		readAheadBatch(session);
+		name = session->batchNames[session->batchNext++];
+		if (!lookupFile(name, &file)) {
+			continue;
+		}
+		session->cached = acquireCachedFile(name, &file);
+		if (session->cached != NULL) {
+			session->fileSize = session->cached->size;
+		}
+		else {
+			session->infile = fopen(name, "r");
+			if (session->infile == NULL) {
+				continue;
+			}
+			if (fstat(fileno(session->infile), &info) == -1) {
+				perror("fstat");
+				fclose(session->infile);
+				session->infile = NULL;
+				continue;
+			}
+			session->fileSize = info.st_size;
+		}
+		session->sendingFile = 1;
+		session->bodyOffset = 0;
+		session->bodyEnd = session->bodyRemaining = session->fileSize;
+		snprintf(entry, sizeof(entry), "%lld %s", (long long) session->fileSize, name);
+		handleRequest(&session->data, "ENTRY", entry);
+		return 1;
+	}
+	return 0;
+}
+
+/******************************************************************************
+** startDelta()
+** Description: A function that sets up a delta GET from its options: the
+** block size of the client's copy and the number of whole blocks it has, e.g.
+** "big.iso\nblock=65536 blocks=16384". Their signatures follow in SIGS
+** packets, and go in a hash table of twice as many buckets.
+** Parameters: client session
+** Output: 0 success, -1 bad block size or count
+******************************************************************************/
+int startDelta(struct session *session){
+	struct delta *delta;
+	char value[32];
+	int blockSize = 0, numberBlocks = 0;
+	if (findOption(session->filename, "block", value, sizeof(value))) {
+		blockSize = atoi(value);
+	}
+	if (findOption(session->filename, "blocks", value, sizeof(value))) {
+		numberBlocks = atoi(value);
+	}
+	if (blockSize < DELTA_MIN_BLOCK || blockSize > DELTA_MAX_BLOCK || numberBlocks < 0 || numberBlocks > DELTA_MAX_BLOCKS) {
+		return -1;
+	}
+	delta = calloc(1, sizeof(struct delta));
+	assert(delta != NULL);
+	delta->blockSize = blockSize;
+	delta->numberBlocks = numberBlocks;
+	delta->bucketBits = 1;
+	while ((1 << delta->bucketBits) < 2 * numberBlocks) {
+		delta->bucketBits++;
+	}
+	delta->weak = malloc((numberBlocks + 1) * sizeof(uint32_t));
+	delta->strong = malloc((numberBlocks + 1) * sizeof(uint32_t));
+	delta->next = malloc((numberBlocks + 1) * sizeof(int));
+	delta->heads = malloc((1 << delta->bucketBits) * sizeof(int));
+	assert(delta->weak != NULL && delta->strong != NULL && delta->next != NULL && delta->heads != NULL);
+	// every bucket starts empty (-1)
+	memset(delta->heads, 0xFF, (1 << delta->bucketBits) * sizeof(int));
+	delta->matched = -1;
+	session->delta = delta;
+	return 0;
+}
+
+/******************************************************************************
+** addSignatures()
+** Description: A function that adds the block signatures of a SIGS packet to
+** the hash table of a delta GET. Each is SIGNATURE_LENGTH bytes: the adler32
+** and the CRC32 of the block, in network byte order, blocks in file order.
+** Parameters: client session, packet payload, payload length
+** Output: 0 success, -1 malformed or too many signatures
+******************************************************************************/
+int addSignatures(struct session *session, char *data, int dataLength){
+	struct delta *delta = session->delta;
+	uint32_t word;
+	unsigned int bucket;
+	if (dataLength % SIGNATURE_LENGTH != 0 || delta->received + dataLength / SIGNATURE_LENGTH > delta->numberBlocks) {
+		return -1;
+	}
+	for (int i = 0; i < dataLength; i += SIGNATURE_LENGTH) {
+		int block = delta->received++;
+		memcpy(&word, data + i, 4);
+		delta->weak[block] = ntohl(word);
+		memcpy(&word, data + i + 4, 4);
+		delta->strong[block] = ntohl(word);
+		bucket = (delta->weak[block] * 2654435761u) >> (32 - delta->bucketBits);
+		delta->next[block] = delta->heads[bucket];
+		delta->heads[bucket] = block;
+	}
+	return 0;
+}
+
+/******************************************************************************
+** openDelta()
+** Description: A function that opens the file of a delta GET for the scan:
+** a hot file is scanned in its cache copy, any other file through a window
+** buffer that pread() refills as the scan moves on (a mapping would fault if
+** the file got shorter meanwhile).
+** Parameters: client session, directory entry of the file
+** Output: 0 success, -1 cannot open
+******************************************************************************/
+int openDelta(struct session *session, struct fileEntry *file){
+	struct delta *delta = session->delta;
+	struct stat info;
+	session->cached = acquireCachedFile(session->filename, file);
+	if (session->cached != NULL) {
+		session->fileSize = session->cached->size;
+		delta->window = session->cached->data;
+		delta->windowEnd = session->fileSize;
+		return 0;
+	}
+	session->infile = fopen(session->filename, "r");
+	if (session->infile == NULL) {
+		return -1;
+	}
+	if (fstat(fileno(session->infile), &info) == -1) {
+		perror("fstat");
+		fclose(session->infile);
+		session->infile = NULL;
+		return -1;
+	}
+	session->fileSize = info.st_size;
+	// room for a packet of literal bytes, the block after them and a scan step
+	delta->windowSize = INPLACE_CHUNK_SIZE + delta->blockSize + DELTA_SCAN_STEP;
+	delta->buffer = malloc(delta->windowSize);
+	assert(delta->buffer != NULL);
+	delta->window = delta->buffer;
+	posix_fadvise(fileno(session->infile), 0, 0, POSIX_FADV_SEQUENTIAL);
+	return 0;
+}
+
+/******************************************************************************
+** blockAdler()
+** Description: A function that computes the adler32 of a block, the weak
+** checksum of a delta GET (the same value as zlib's adler32()). It runs
+** whenever the scan starts on a new block, so on x86-64 it takes 16 bytes at
+** a time with SSE2: the byte sums with PSADBW, the position weighted sums
+** with PMADDWD, reduced every ADLER_BLOCK bytes before they could overflow.
+** Elsewhere zlib computes it.
+** Parameters: bytes, number of bytes
+** Output: adler32 (second sum in the high 16 bits)
+** Source: https://www.rfc-editor.org/rfc/rfc1950#section-8
+******************************************************************************/
+uint32_t blockAdler(const unsigned char *data, size_t length){
+#if defined(__x86_64__)
+	uint64_t sumA = 1, sumB = 0;
+	const __m128i zero = _mm_setzero_si128();
+	// weight of each byte in the second sum: 16 for the first, 1 for the last
+	const __m128i weightsLow = _mm_set_epi16(9, 10, 11, 12, 13, 14, 15, 16);
+	const __m128i weightsHigh = _mm_set_epi16(1, 2, 3, 4, 5, 6, 7, 8);
+	uint32_t lanes[4];
+	while (length >= 16) {
+		size_t chunks = (length < ADLER_BLOCK ? length : ADLER_BLOCK) / 16;
+		__m128i bytesSum = zero, priorSum = zero, weightedSum = zero;
+		// the first sum so far is added once per byte of the chunks
+		sumB += sumA * chunks * 16;
+		length -= chunks * 16;
+		while (chunks-- > 0) {
+			__m128i bytes = _mm_loadu_si128((const __m128i *) data);
+			priorSum = _mm_add_epi32(priorSum, bytesSum);
+			bytesSum = _mm_add_epi32(bytesSum, _mm_sad_epu8(bytes, zero));
+			weightedSum = _mm_add_epi32(weightedSum, _mm_madd_epi16(_mm_unpacklo_epi8(bytes, zero), weightsLow));
+			weightedSum = _mm_add_epi32(weightedSum, _mm_madd_epi16(_mm_unpackhi_epi8(bytes, zero), weightsHigh));
+			data += 16;
+		}
+		// the bytes of the earlier chunks count 16 times more per later chunk
+		weightedSum = _mm_add_epi32(weightedSum, _mm_slli_epi32(priorSum, 4));
+		_mm_storeu_si128((__m128i *) lanes, bytesSum);
+		sumA += (uint64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+		_mm_storeu_si128((__m128i *) lanes, weightedSum);
+		sumB += (uint64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+		sumA %= ADLER_MOD;
+		sumB %= ADLER_MOD;
+	}
+	while (length-- > 0) {
+		sumA += *data++;
+		sumB += sumA;
+	}
+	return (uint32_t) (sumB % ADLER_MOD) << 16 | (uint32_t) (sumA % ADLER_MOD);
+#else
+	return adler32(1, data, length);
+#endif
+}
+
+/******************************************************************************
+** findBlock()
+** Description: A function that looks up the bytes at the scan position in
+** the client's blocks: the weak checksum picks the candidates, the CRC32
+** (computed once, and only for a candidate) confirms one. The block after the
+** last one found is tried first, so runs of blocks stay together.
+** Parameters: delta GET, adler32 of the bytes, the bytes (one block long)
+** Output: block number, -1 not found
+******************************************************************************/
+int findBlock(struct delta *delta, uint32_t weak, const unsigned char *block){
+	int expected = delta->copyCount > 0 ? delta->copyBlock + delta->copyCount : -1;
+	int strongKnown = 0;
+	uint32_t strong = 0;
+	int candidate = delta->heads[(weak * 2654435761u) >> (32 - delta->bucketBits)];
+	if (expected >= 0 && expected < delta->numberBlocks && delta->weak[expected] == weak) {
+		strong = crc32(0, block, delta->blockSize);
+		strongKnown = 1;
+		if (delta->strong[expected] == strong) {
+			return expected;
+		}
+	}
+	for (; candidate != -1; candidate = delta->next[candidate]) {
+		if (delta->weak[candidate] != weak) {
+			continue;
+		}
+		if (!strongKnown) {
+			strong = crc32(0, block, delta->blockSize);
+			strongKnown = 1;
+		}
+		if (delta->strong[candidate] == strong) {
+			return candidate;
+		}
+	}
+	return -1;
+}
+
+/******************************************************************************
+** fillWindow()
+** Description: A function that makes sure the file bytes up to upTo are in
+** the window of a delta GET. The literal bytes not sent yet move to the front
+** of the buffer, and the rest of it is read from the file.
+** Parameters: client session, file offset the window must reach
+** Output: 0 success, -1 read error or file got shorter
+******************************************************************************/
+int fillWindow(struct session *session, off_t upTo){
+	struct delta *delta = session->delta;
+	ssize_t bytesRead;
+	if (upTo <= delta->windowEnd) {
+		return 0;
+	}
+	memmove(delta->buffer, delta->buffer + (delta->literalStart - delta->windowStart), delta->windowEnd - delta->literalStart);
+	delta->windowStart = delta->literalStart;
+	while (delta->windowEnd < upTo) {
+		off_t room = delta->windowStart + delta->windowSize - delta->windowEnd;
+		if (room > session->fileSize - delta->windowEnd) {
+			room = session->fileSize - delta->windowEnd;
+		}
+		bytesRead = pread(fileno(session->infile), delta->buffer + (delta->windowEnd - delta->windowStart), room, delta->windowEnd);
+		if (bytesRead <= 0) {
+			if (bytesRead == -1) {
+				perror("pread");
+			}
+			return -1;
+		}
+		delta->windowEnd += bytesRead;
+	}
+	return 0;
+}
+
+/******************************************************************************
+** scanDelta()
+** Description: A function that moves the scan of a delta GET along the file
+** until the bytes at its position are one of the client's blocks. The adler32
+** of the first position is computed whole, then it rolls a byte at a time:
+** the byte leaving the block is taken out of both sums and the byte entering
+** it is added. Bytes passed over are literal; the scan stops once a packet of
+** them is ready, or after DELTA_SCAN_STEP bytes so other sessions get a turn.
+** The bytes after the last whole block are literal.
+** Parameters: client session, bytes queued so far in this turn (changed)
+** Output: block found, -1 none yet, -2 read error
+** Source: https://rsync.samba.org/tech_report/node3.html
+******************************************************************************/
+int scanDelta(struct session *session, int *budget){
+	struct delta *delta = session->delta;
+	off_t blockSize = delta->blockSize;
+	// the block size as a multiple of the modulus, for the second sum
+	uint32_t blockWeight = delta->blockSize % ADLER_MOD;
+	const unsigned char *data;
+	int block = -1, scanned = 0;
+	while (delta->offset - delta->literalStart < INPLACE_CHUNK_SIZE && scanned < DELTA_SCAN_STEP) {
+		if (delta->numberBlocks == 0 || delta->offset + blockSize > session->fileSize) {
+			delta->offset = session->fileSize;
+			break;
+		}
+		// the block, and the byte after it when there is one
+		if (fillWindow(session, delta->offset + blockSize + (delta->offset + blockSize < session->fileSize)) == -1) {
+			block = -2;
+			break;
+		}
+		data = (const unsigned char *) delta->window + (delta->offset - delta->windowStart);
+		if (!delta->rolling) {
+			uint32_t adler = blockAdler(data, blockSize);
+			delta->sumA = adler & 0xFFFF;
+			delta->sumB = adler >> 16;
+			delta->rolling = 1;
+			scanned += blockSize;
+		}
+		block = findBlock(delta, delta->sumB << 16 | delta->sumA, data);
+		if (block != -1) {
+			break;
+		}
+		// slide the block one byte
+		if (delta->offset + blockSize < session->fileSize) {
+			delta->sumA = (delta->sumA + ADLER_MOD - data[0] + data[blockSize]) % ADLER_MOD;
+			delta->sumB = (delta->sumB + (uint64_t) blockWeight * (ADLER_MOD - data[0]) + ADLER_MOD - 1 + delta->sumA) % ADLER_MOD;
+		}
+		delta->offset++;
+		scanned++;
+	}
+	*budget += scanned;
+	return block;
+}
+
+/******************************************************************************
+** queueLiteral()
+** Description: A function that queues the next FILE packet of literal bytes,
+** the bytes of the file the client does not have, up to INPLACE_CHUNK_SIZE
+** of them copied from the window behind the packet header.
+** Parameters: client session, bytes queued so far in this turn (changed)
+** Output: 1 queued, -1 read error
+******************************************************************************/
+int queueLiteral(struct session *session, int *budget){
+	struct delta *delta = session->delta;
+	struct connection *conn = &session->data;
+	off_t length = delta->offset - delta->literalStart;
+	char *packet;
+	if (length > INPLACE_CHUNK_SIZE) {
+		length = INPLACE_CHUNK_SIZE;
+	}
+	if (fillWindow(session, delta->literalStart + length) == -1) {
+		return -1;
+	}
+	packet = reserveOutput(conn, headerLength(conn) + length);
+	memcpy(packet + headerLength(conn), delta->window + (delta->literalStart - delta->windowStart), length);
+	updateChecksum(session, packet + headerLength(conn), length);
+	writePacketHeader(conn, packet, "FILE", length);
+	commitOutput(conn, packet, headerLength(conn) + length);
+	delta->literalStart += length;
+	delta->literalBytes += length;
+	*budget += headerLength(conn) + length;
+	return 1;
+}
+
+/******************************************************************************
+** queueCopy()
+** Description: A function that queues a COPY packet for the run of blocks
+** found one after the other: the first block and the number of blocks, e.g.
+** "12 40", which the client copies from its own file.
+** Parameters: client session, bytes queued so far in this turn (changed)
+** Output: none
+******************************************************************************/
+void queueCopy(struct session *session, int *budget){
+	struct delta *delta = session->delta;
+	char run[32];
+	snprintf(run, sizeof(run), "%d %d", delta->copyBlock, delta->copyCount);
+	handleRequest(&session->data, "COPY", run);
+	delta->copiedBlocks += delta->copyCount;
+	delta->copyCount = 0;
+	*budget += LIST_ENTRY_COST;
+}
+
+/******************************************************************************
+** queueDelta()
+** Description: A function that takes the next step of a delta GET: queues a
+** packet of literal bytes (always before the block found after them), adds a
+** block found to the run of the next COPY packet, or scans on. Packets go out
+** in file order, so the client writes the new file front to back. Used in
+** dataConnection().
+** Parameters: client session, bytes queued so far in this turn (changed)
+** Output: 1 more to do, 0 file done, -1 read error
+******************************************************************************/
+int queueDelta(struct session *session, int *budget){
+	struct delta *delta = session->delta;
+	off_t literal = delta->offset - delta->literalStart;
+	if (literal > 0 && (delta->matched != -1 || literal >= INPLACE_CHUNK_SIZE || delta->offset == session->fileSize)) {
+		if (delta->copyCount > 0) {
+			queueCopy(session, budget);
+			return 1;
+		}
+		return queueLiteral(session, budget);
+	}
+	if (delta->matched != -1) {
+		if (delta->copyCount > 0 && delta->matched != delta->copyBlock + delta->copyCount) {
+			queueCopy(session, budget);
+			return 1;
+		}
+		if (delta->copyCount == 0) {
+			delta->copyBlock = delta->matched;
+		}
+		delta->copyCount++;
+		// the block is still in the window, the scan stopped on it
+		updateChecksum(session, delta->window + (delta->offset - delta->windowStart), delta->blockSize);
+		delta->offset += delta->blockSize;
+		delta->literalStart = delta->offset;
+		delta->matched = -1;
+		delta->rolling = 0;
+		return 1;
+	}
+	if (delta->offset == session->fileSize) {
+		if (delta->copyCount > 0) {
+			queueCopy(session, budget);
+			return 1;
+		}
+		return 0;
+	}
+	delta->matched = scanDelta(session, budget);
+	if (delta->matched == -2) {
+		delta->matched = -1;
+		return -1;
+	}
+	return 1;
+}
+
+/******************************************************************************
+** closeDelta()
+** Description: A function that frees the signatures and window of a delta
+** GET. The file itself is closed by closeFile().
+** Parameters: client session
+** Output: none
+******************************************************************************/
+void closeDelta(struct session *session){
+	struct delta *delta = session->delta;
+	if (delta == NULL) {
+		return;
+	}
+	free(delta->weak);
+	free(delta->strong);
+	free(delta->next);
+	free(delta->heads);
+	free(delta->buffer);
+	free(delta);
+	session->delta = NULL;
+}
+
+/******************************************************************************
+** nameUpload()
+** Description: A function that picks a hidden temporary name for a PUT file,
+** unique in the server process.
+** Parameters: client session (uploadTemp is changed)
+** Output: none
+******************************************************************************/
+void nameUpload(struct session *session){
+	static unsigned int uploads;
+	snprintf(session->uploadTemp, sizeof(session->uploadTemp), UPLOAD_PREFIX "%d-%u", (int) getpid(),
+		__atomic_add_fetch(&uploads, 1, __ATOMIC_RELAXED));
+}
+
+/******************************************************************************
+** startUpload()
+** Description: A function that creates the file a PUT receives. It is an
+** unnamed file of the server directory (O_TMPFILE), so a LIST never shows it
+** half written; file systems without unnamed files get a hidden temporary
+** name. The whole length is allocated up front, so the file is laid out in
+** one piece and a full disk shows before any byte is received.
+** Parameters: client session
+** Output: 0 success, -1 error (errno is set)
+** Source: http://man7.org/linux/man-pages/man2/open.2.html
+** http://man7.org/linux/man-pages/man2/fallocate.2.html
+******************************************************************************/
+int startUpload(struct session *session){
+	int error;
+	session->uploadTemp[0] = '\0';
+	session->uploadFd = open(".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0644);
+	if (session->uploadFd == -1 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)) {
+		nameUpload(session);
+		session->uploadFd = open(session->uploadTemp, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0644);
+		if (session->uploadFd == -1) {
+			session->uploadTemp[0] = '\0';
+		}
+	}
+	if (session->uploadFd == -1) {
+		return -1;
+	}
+	// file systems that cannot allocate ahead still take the writes
+	if (session->uploadSize > 0 && fallocate(session->uploadFd, 0, 0, session->uploadSize) == -1 &&
+		errno != EOPNOTSUPP && errno != ENOSYS) {
+		error = errno;
+		closeUpload(session);
+		errno = error;
+		return -1;
+	}
+	// the bytes go from the socket into a pipe and on to the file, the server
+	// never copies them; without a pipe they are received into a buffer
+	session->copyBody = pipe2(session->uploadPipe, O_NONBLOCK | O_CLOEXEC) == -1;
+	if (session->copyBody) {
+		session->uploadPipe[0] = session->uploadPipe[1] = -1;
+	}
+	else {
+		// a larger pipe moves more per splice(), the system limit may refuse it
+		fcntl(session->uploadPipe[1], F_SETPIPE_SZ, UPLOAD_PIPE_SIZE);
+	}
+	session->uploadRemaining = session->uploadSize;
+	return 0;
+}
+
+/******************************************************************************
+** writeUpload()
+** Description: A function that writes received bytes to the PUT file, and
+** adds them to the checksum. Used when the bytes could not be spliced.
+** Parameters: client session, bytes, number of bytes, file offset
+** Output: 0 success, -1 error
+******************************************************************************/
+int writeUpload(struct session *session, const char *data, size_t count, off_t offset){
+	ssize_t written;
+	updateChecksum(session, data, count);
+	while (count > 0) {
+		written = pwrite(session->uploadFd, data, count, offset);
+		if (written == -1 && errno == EINTR) {
+			continue;
+		}
+		if (written <= 0) {
+			perror("pwrite");
+			return -1;
+		}
+		data += written;
+		offset += written;
+		count -= written;
+	}
+	return 0;
+}
+
+/******************************************************************************
+** drainUpload()
+** Description: A function that moves the bytes splice() took from the socket
+** out of the pipe into the PUT file, with splice() again. If the file system
+** cannot splice, the bytes are read out of the pipe and written, and the rest
+** of the upload is received into a buffer. The spliced bytes are read back
+** from the page cache for the checksum.
+** Parameters: client session, file offset and number of the bytes in the pipe
+** Output: 0 success, -1 error
+** Source: http://man7.org/linux/man-pages/man2/splice.2.html
+******************************************************************************/
+int drainUpload(struct session *session, off_t offset, size_t count){
+	loff_t at = offset;
+	ssize_t moved;
+	while (count > 0) {
+		moved = session->copyBody ? -1 : splice(session->uploadPipe[0], NULL, session->uploadFd, &at, count, SPLICE_F_MOVE);
+		if (moved > 0) {
+			checksumFileBytes(session, session->uploadFd, at - moved, moved);
+			count -= moved;
+			continue;
+		}
+		if (moved == -1 && errno == EINTR) {
+			continue;
+		}
+		if (moved == -1 && (session->copyBody || errno == EINVAL || errno == ENOSYS)) {
+			// the output buffer is idle while a PUT runs
+			session->copyBody = 1;
+			moved = read(session->uploadPipe[0], session->data.outBuffer,
+				count < (size_t) session->data.outSize ? count : (size_t) session->data.outSize);
+			if (moved > 0 && writeUpload(session, session->data.outBuffer, moved, at) == 0) {
+				at += moved;
+				count -= moved;
+				continue;
+			}
+		}
+		perror("splice");
+		return -1;
+	}
+	return 0;
+}
+
+/******************************************************************************
+** receiveUpload()
+** Description: A function that receives the body of a PUT on the data
+** connection and writes it to the file at its offset: spliced through the
+** pipe, or received into the output buffer and written with pwrite().
+** Used in dataConnection() once the READY packet is out.
+** Parameters: client session, bytes received so far in this turn (changed)
+** Output: 1 body finished, 0 socket empty or budget used, -1 error
+******************************************************************************/
+int receiveUpload(struct session *session, int *budget){
+	ssize_t moved;
+	size_t count;
+	off_t offset;
+	while (session->uploadRemaining > 0 && *budget < DATA_BUDGET) {
+		count = DATA_BUDGET - *budget;
+		if ((off_t) count > session->uploadRemaining) {
+			count = session->uploadRemaining;
+		}
+		offset = session->uploadSize - session->uploadRemaining;
+		if (!session->copyBody) {
+			moved = splice(session->data.socket, NULL, session->uploadPipe[1], NULL, count,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (moved > 0 && drainUpload(session, offset, moved) == -1) {
+				return -1;
+			}
+		}
+		else {
+			if (count > (size_t) session->data.outSize) {
+				count = session->data.outSize;
+			}
+			moved = recv(session->data.socket, session->data.outBuffer, count, 0);
+			if (moved > 0 && writeUpload(session, session->data.outBuffer, moved, offset) == -1) {
+				return -1;
+			}
+		}
+		if (moved == -1) {
+			// nothing more to read right now, epoll will tell us when there is
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			// a socket that cannot splice: receive into the buffer instead
+			if (!session->copyBody && (errno == EINVAL || errno == ENOSYS)) {
+				session->copyBody = 1;
+				continue;
+			}
+			perror(session->copyBody ? "recv" : "splice");
+			return -1;
+		}
+		// the client hung up before the length it announced
+		if (moved == 0) {
+			fprintf(stderr, "ftserver: Upload of \"%s\" cut short\n", session->filename);
+			return -1;
+		}
+		session->uploadRemaining -= moved;
+		countMetric(&workerMetrics->bytesReceived, moved);
+		TRACE(TRACE_SENDS, TRACE_RECEIVE, session, moved);
+		*budget += moved;
+	}
+	return session->uploadRemaining == 0;
+}
+
+/******************************************************************************
+** finishUpload()
+** Description: A function that gives a received PUT file its name in one
+** step, so a GET sees the old file or the new one, never part of it: an
+** unnamed file is linked in, or, when the name is taken, linked under a
+** temporary name that is renamed over the old file. The index learns of the
+** file at once, the next LIST shows it without waiting for inotify.
+** Parameters: client session
+** Output: 0 success, -1 error
+** Source: http://man7.org/linux/man-pages/man2/linkat.2.html
+******************************************************************************/
+int finishUpload(struct session *session){
+	char path[64];
+	struct stat info;
+	int named = 0;
+	if (session->uploadTemp[0] == '\0') {
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", session->uploadFd);
+		named = linkat(AT_FDCWD, path, AT_FDCWD, session->filename, AT_SYMLINK_FOLLOW) == 0;
+		if (!named && errno == EEXIST) {
+			nameUpload(session);
+			if (linkat(AT_FDCWD, path, AT_FDCWD, session->uploadTemp, AT_SYMLINK_FOLLOW) == -1) {
+				session->uploadTemp[0] = '\0';
+			}
+		}
+		if (!named && session->uploadTemp[0] == '\0') {
+			perror("linkat");
+			return -1;
+		}
+	}
+	if (!named) {
+		if (rename(session->uploadTemp, session->filename) == -1) {
+			perror("rename");
+			return -1;
+		}
+		session->uploadTemp[0] = '\0';
+	}
+	if (fstat(session->uploadFd, &info) == -1) {
+		perror("fstat");
+		session->wholeFile = 0;
+		return 0;
+	}
+	// the digest of the new file is remembered, a GET of it is not hashed again
+	session->sentFile.size = info.st_size;
+	session->sentFile.mtime = info.st_mtim;
+	session->sentFile.ctime = info.st_ctim;
+	session->sentFile.inode = info.st_ino;
+	if (directoryIndex.enabled) {
+		pthread_rwlock_wrlock(&directoryIndex.lock);
+		indexFile(session->filename, &info);
+		pthread_rwlock_unlock(&directoryIndex.lock);
+	}
+	return 0;
+}
+
+/******************************************************************************
+** closeUpload()
+** Description: A function that closes the file and pipe of a PUT. A file that
+** did not get its name is gone with it.
+** Parameters: client session
+** Output: none
+******************************************************************************/
+void closeUpload(struct session *session){
+	if (session->uploadFd != -1) {
+		close(session->uploadFd);
+		session->uploadFd = -1;
+	}
+	if (session->uploadTemp[0] != '\0') {
+		unlink(session->uploadTemp);
+		session->uploadTemp[0] = '\0';
+	}
+	if (session->uploadPipe[0] != -1) {
+		close(session->uploadPipe[0]);
+		close(session->uploadPipe[1]);
+		session->uploadPipe[0] = session->uploadPipe[1] = -1;
+	}
+}
+
+/******************************************************************************
+** readFile()
+** Description: A function that reads the next bytes of the file being sent,
+** from its copy in the hot file cache or from the file, and moves bodyOffset
+** forward. Used to build FILE packets and the copied body.
+** Parameters: client session, buffer, most bytes to read
+** Output: bytes read, 0 end of file, -1 error
+******************************************************************************/
+int readFile(struct session *session, char *buffer, size_t count){
+	ssize_t bytesRead;
+	if (session->cached != NULL) {
+		if ((off_t) count > session->cached->size - session->bodyOffset) {
+			count = session->cached->size - session->bodyOffset;
+		}
+		memcpy(buffer, session->cached->data + session->bodyOffset, count);
+		bytesRead = count;
+	}
+	else {
+		bytesRead = pread(fileno(session->infile), buffer, count, session->bodyOffset);
+	}
+	if (bytesRead > 0) {
+		updateChecksum(session, buffer, bytesRead);
+		session->bodyOffset += bytesRead;
+	}
+	return bytesRead;
+}
+
+/******************************************************************************
+** closeFile()
+** Description: A function that closes the file being sent, or lets go of its
+** copy in the hot file cache, and ends its deflate stream.
+** Parameters: client session
+** Output: none
+******************************************************************************/
+void closeFile(struct session *session){
+	if (session->infile != NULL) {
+		fclose(session->infile);
+		session->infile = NULL;
+	}
+	if (session->cached != NULL) {
+		releaseCachedFile(session->cached);
+		session->cached = NULL;
+	}
+	if (session->deflater != NULL) {
+		deflateEnd(session->deflater);
+		free(session->deflater);
+		session->deflater = NULL;
+	}
+	free(session->deflateInput);
+	session->deflateInput = NULL;
+	// the fixed file slots let go of the file and socket
+	if (session->uringFiles) {
+		setUringFiles(session, -1, -1);
+	}
+	session->sendingFile = 0;
+}
+
+/******************************************************************************
+** sendFileBody()
+** Description: A function that streams the file body to the client with
+** sendfile(), so the kernel moves page cache pages straight to the socket and
+** no byte is copied through the server. If the file system does not support
+** sendfile(), the body is read into the output buffer and sent instead.
+** Files from the hot file cache are sent straight from their copy. With the
+** io_uring backend the body is read and sent by linked operations instead.
+** Used in dataConnection() once the FILE and SIZE packets are out.
+** Parameters: client session, bytes sent so far in this turn (changed)
+** Output: 1 body finished, 0 socket full or budget used, -1 error
+** Source: http://man7.org/linux/man-pages/man2/sendfile.2.html
+******************************************************************************/
+int sendFileBody(struct session *session, int *budget){
+	ssize_t sent;
+	size_t count;
+	// with io_uring the kernel reads and sends the next piece, and its
+	// completion runs the transfer on (not for multiplexed transfers)
+	if (session->uringOps > 0) {
+		return 0;
+	}
+	if (session->uring != NULL && session->cached == NULL && session->data.carrier == &session->data &&
+		session->bodyRemaining > 0 && submitFileBody(session)) {
+		return 0;
+	}
+	while (session->bodyRemaining > 0 && *budget < DATA_BUDGET) {
+		count = DATA_BUDGET - *budget;
+		if ((off_t) count > session->bodyRemaining) {
+			count = session->bodyRemaining;
+		}
+		if (session->cached != NULL) {
+			// the copy is already in memory, no file to read
+			sent = send(session->data.carrier->socket, session->cached->data + session->bodyOffset, count, MSG_NOSIGNAL);
+			session->data.carrier->sendCalls++;
+			if (sent > 0) {
+				updateChecksum(session, session->cached->data + session->bodyOffset, sent);
+				session->bodyOffset += sent;
+				session->data.carrier->bytesSent += sent;
+				TRACE(TRACE_SENDS, TRACE_SEND, session, sent);
+			}
+		}
+		else if (!session->copyBody) {
+			// sendfile() moves bodyOffset forward by the bytes sent
+			sent = sendfile(session->data.carrier->socket, fileno(session->infile), &session->bodyOffset, count);
+			session->data.carrier->sendCalls++;
+			if (sent == -1 && (errno == EINVAL || errno == ENOSYS)) {
+				session->copyBody = 1;
+				continue;
+			}
+			if (sent > 0) {
+				checksumFileBytes(session, fileno(session->infile), session->bodyOffset - sent, sent);
+				session->data.carrier->bytesSent += sent;
+				TRACE(TRACE_SENDS, TRACE_SEND, session, sent);
+			}
+		}
+		else {
+			// read the next piece into the (empty) output buffer and send it
+			char *piece;
+			if ((int) count > session->data.carrier->outSize) {
+				count = session->data.carrier->outSize;
+			}
+			piece = reserveOutput(&session->data, count);
+			sent = readFile(session, piece, count);
+			if (sent > 0) {
+				commitOutput(&session->data, piece, sent);
+				if (sendData(&session->data) == -1) {
+					return -1;
+				}
+			}
+		}
+		if (sent == -1) {
+			// socket buffer is full, epoll will tell us when it drains
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			perror(session->cached != NULL ? "send" : session->copyBody ? "pread" : "sendfile");
+			return -1;
+		}
+		// the file got shorter than the SIZE we announced
+		if (sent == 0) {
+			fprintf(stderr, "ftserver: File \"%s\" changed while sending\n", session->filename);
+			return -1;
+		}
+		session->bodyRemaining -= sent;
+		*budget += sent;
+		// bytes copied but not sent yet go out first on the next turn
+		if (pendingOutput(&session->data)) {
+			return 0;
+		}
+	}
+	return session->bodyRemaining == 0;
+}
+
+/******************************************************************************
+** queueFileChunk()
+** Description: A function that queues the next version 2 FILE packet, with up
+** to the agreed chunk size of the file. Small payloads are read straight into
+** the output buffer behind their header. For large payloads only the header
+** is queued, and dataConnection() sends the payload with sendFileBody(). The
+** last packet is empty, like in version 1.
+** Parameters: client session, bytes queued so far in this turn (changed)
+** Output: none
+******************************************************************************/
+void queueFileChunk(struct session *session, int *budget){
+	struct connection *conn = &session->data;
+	// bytes of the file for this packet
+	off_t chunk = session->bodyEnd - session->bodyOffset;
+	ssize_t bytesRead;
+	char *packet;
+	if (chunk > session->chunkSize) {
+		chunk = session->chunkSize;
+	}
+	// payload too big for the buffer: header now, payload from the page cache
+	if (chunk > INPLACE_CHUNK_SIZE) {
+		handlePacketHeader(conn, "FILE", chunk);
+		session->bodyRemaining = chunk;
+		*budget += headerLength(conn);
+		return;
+	}
+	// read the payload into place, then put the header in front of it
+	packet = reserveOutput(conn, headerLength(conn) + chunk);
+	bytesRead = 0;
+	if (chunk > 0) {
+		bytesRead = readFile(session, packet + headerLength(conn), chunk);
+		if (bytesRead == -1) {
+			perror("pread");
+			session->transferStatus = -1;
+			bytesRead = 0;
+		}
+	}
+	writePacketHeader(conn, packet, "FILE", bytesRead);
+	commitOutput(conn, packet, headerLength(conn) + bytesRead);
+	*budget += headerLength(conn) + bytesRead;
+	// the empty packet ends the file (also when it got shorter while sending)
+	if (bytesRead == 0) {
+		closeFile(session);
+	}
+}
+
+/******************************************************************************
+** queueCompressedChunk()
+** Description: A function that queues the next FILE packet of a file being
+** compressed while sending. File bytes are read into the deflate input buffer
+** and deflated straight into the output buffer behind the packet header,
+** until the packet is full (up to the agreed chunk size) or the session used
+** its budget. An empty packet ends the file once the stream is finished.
+** Parameters: client session, bytes queued so far in this turn (changed)
+** Output: none
+** Source: https://zlib.net/zlib_how.html
+******************************************************************************/
+void queueCompressedChunk(struct session *session, int *budget){
+	struct connection *conn = &session->data;
+	z_stream *deflater = session->deflater;
+	int room = session->chunkSize < INPLACE_CHUNK_SIZE ? session->chunkSize : INPLACE_CHUNK_SIZE;
+	int status = Z_OK;
+	int produced;
+	ssize_t bytesRead;
+	char *packet = reserveOutput(conn, headerLength(conn) + room);
+	deflater->next_out = (Bytef *) packet + headerLength(conn);
+	deflater->avail_out = room;
+	while (deflater->avail_out > 0 && *budget < DATA_BUDGET) {
+		// refill the input, up to the end of the file or range
+		if (deflater->avail_in == 0 && session->bodyOffset < session->bodyEnd) {
+			size_t count = session->bodyEnd - session->bodyOffset < DEFLATE_INPUT_SIZE ?
+				session->bodyEnd - session->bodyOffset : DEFLATE_INPUT_SIZE;
+			bytesRead = readFile(session, session->deflateInput, count);
+			if (bytesRead <= 0) {
+				// the file got shorter while sending: end the stream here
+				if (bytesRead == -1) {
+					perror("pread");
+				}
+				session->transferStatus = -1;
+				session->bodyEnd = session->bodyOffset;
+			}
+			else {
+				deflater->next_in = (Bytef *) session->deflateInput;
+				deflater->avail_in = bytesRead;
+				*budget += bytesRead;
+			}
+		}
+		status = deflate(deflater, session->bodyOffset == session->bodyEnd ? Z_FINISH : Z_NO_FLUSH);
+		if (status == Z_STREAM_END || status == Z_STREAM_ERROR) {
+			break;
+		}
+	}
+	produced = room - deflater->avail_out;
+	writePacketHeader(conn, packet, "FILE", produced);
+	commitOutput(conn, packet, headerLength(conn) + produced);
+	*budget += headerLength(conn) + produced;
+	if (status == Z_STREAM_ERROR) {
+		fprintf(stderr, "ftserver: Compression failed\n");
+		session->transferStatus = -1;
+		closeFile(session);
+		return;
+	}
+	// the stream is finished: the empty packet ends the file
+	if (status == Z_STREAM_END && produced == 0) {
+		TRACE(TRACE_COMMANDS, TRACE_COMPRESSED, session, deflater->total_out);
+		closeFile(session);
+	}
+}
+
+/******************************************************************************
+** dataConnection()
+** Description: A function that runs the client file transfer connection. Each
+** call queues packets until the output buffer is full or the session used its
+** budget, then sends them, so that all sessions share the server fairly.
+** When the listing or file is done, finishTransfer() sends DONE.
+** Used in handleData().
+** Parameters: client session
+** Output: 0 success, -1 error
+******************************************************************************/
+int dataConnection(struct session *session){
+	// bytes queued during this call, from the part the scheduler holds back
+	int budget = session->heldBudget;
+	// number of bytes in file (use fread() to get)
+	int bytesRead;
+	char *packet;
+	while (session->state == TRANSFER_STATE && budget < DATA_BUDGET) {
+		// make room for the next packet, or wait for the socket to drain
+		if (outputSpace(&session->data) < PACKET_ROOM) {
+			if (sendData(&session->data) == -1) {
+				return -1;
+			}
+			if (outputSpace(&session->data) < PACKET_ROOM) {
+				return 0;
+			}
+		}
+		// a delta GET: literal bytes in FILE packets and COPY packets for the
+		// blocks the client has, one packet a step, then DONE
+		if (session->transferStatus == 0 && strcmp(session->userCommand, "DELTA") == 0) {
+			int status = queueDelta(session, &budget);
+			if (status == -1) {
+				fprintf(stderr, "ftserver: File \"%s\" changed while sending\n", session->filename);
+				return -1;
+			}
+			if (status == 0) {
+				TRACE(TRACE_COMMANDS, TRACE_DELTA_COPIED, session, session->delta->copiedBlocks);
+				TRACE(TRACE_COMMANDS, TRACE_DELTA_LITERAL, session, session->delta->literalBytes);
+				closeFile(session);
+				finishTransfer(session);
+			}
+			continue;
+		}
+		// an upload: the body comes in once READY is out, then DONE goes back
+		if (session->transferStatus == 0 && strcmp(session->userCommand, "PUT") == 0) {
+			int status;
+			if (sendData(&session->data) == -1) {
+				return -1;
+			}
+			if (pendingOutput(&session->data)) {
+				return 0;
+			}
+			status = receiveUpload(session, &budget);
+			if (status != 1) {
+				return status;
+			}
+			TRACE(TRACE_COMMANDS, TRACE_RECEIVED, session, session->uploadSize);
+			if (finishUpload(session) == -1) {
+				TRACE(TRACE_COMMANDS, TRACE_SAVE_ERROR, session, 0);
+				handleRequest(&session->control, "ERROR", "Error: cannot save file");
+				session->transferStatus = -1;
+			}
+			closeUpload(session);
+			finishTransfer(session);
+			continue;
+		}
+		// a batch GET: each file is an ENTRY packet and its raw body, then the next
+		if (session->transferStatus == 0 && strcmp(session->userCommand, "MGET") == 0) {
+			int status;
+			if (!session->sendingFile) {
+				// without the index, the names are matched while sending
+				if (session->batchLines != NULL) {
+					status = scanBatch(session, &budget);
+					if (status == -1) {
+						session->transferStatus = -1;
+						continue;
+					}
+					if (status == 2) {
+						continue;
+					}
+				}
+				if (!openBatchFile(session)) {
+					// the names matched so far are gone, the rest are still to be matched
+					if (session->batchLines != NULL && session->batchLine < session->numberLines) {
+						continue;
+					}
+					finishTransfer(session);
+					continue;
+				}
+				// a small body is read in behind its ENTRY packet, so many
+				// small files go out in one system call
+				if (session->bodyRemaining <= INPLACE_CHUNK_SIZE && outputSpace(&session->data) >= session->bodyRemaining) {
+					if (session->bodyRemaining > 0) {
+						char *body = reserveOutput(&session->data, session->bodyRemaining);
+						if (readFile(session, body, session->bodyRemaining) != session->bodyRemaining) {
+							fprintf(stderr, "ftserver: File \"%s\" changed while sending\n", session->batchNames[session->batchNext - 1]);
+							return -1;
+						}
+						commitOutput(&session->data, body, session->bodyRemaining);
+						budget += session->bodyRemaining;
+						session->bodyRemaining = 0;
+					}
+					budget += LIST_ENTRY_COST;
+					closeFile(session);
+					continue;
+				}
+			}
+			// a larger body goes like the one after SIZE, the header must be out first
+			if (sendData(&session->data) == -1) {
+				return -1;
+			}
+			if (pendingOutput(&session->data)) {
+				return 0;
+			}
+			status = sendFileBody(session, &budget);
+			if (status != 1) {
+				return status;
+			}
+			closeFile(session);
+			continue;
+		}
+		// transfer each name in it's own packet, until the limit
+		if (session->transferStatus == 0 && strcmp(session->userCommand, "LIST") == 0 &&
+			session->listRemaining != 0) {
+			char *name;
+			int status = nextListedName(session, &name, &budget);
+			if (status == 1) {
+				handleRequest(&session->data, "FNAME", name);
+				budget += MAX_PACKET_LENGTH;
+				if (session->listRemaining > 0) {
+					session->listRemaining--;
+				}
+			}
+			else if (status == 0) {
+				session->listRemaining = 0;
+			}
+			else if (status == -1) {
+				session->transferStatus = -1;
+			}
+			continue;
+		}
+		// stream the file body after the SIZE packet, or the payload of a large
+		// version 2 FILE packet; the header must be out first
+		if (session->sendingFile && (session->streamBody || session->bodyRemaining > 0)) {
+			int status;
+			if (sendData(&session->data) == -1) {
+				return -1;
+			}
+			if (pendingOutput(&session->data)) {
+				return 0;
+			}
+			status = sendFileBody(session, &budget);
+			if (status != 1) {
+				return status;
+			}
+			if (!session->streamBody) {
+				continue;
+			}
+			closeFile(session);
+		}
+		// compressed while sending: the next FILE packet of deflate output
+		if (session->sendingFile && session->deflater != NULL) {
+			queueCompressedChunk(session, &budget);
+			continue;
+		}
+		// version 2: the next FILE packet of the agreed chunk size
+		if (session->sendingFile && session->data.version >= 2) {
+			queueFileChunk(session, &budget);
+			continue;
+		}
+		// transfer the actual file, the last packet is empty
+		// source: http://stackoverflow.com/questions/8589425/how-does-fread-really-work
+		// the payload is read into place behind its header
+		if (session->sendingFile) {
+			// up to the end of the file or range
+			int count = session->bodyEnd - session->bodyOffset < PAYLOAD_LENGTH ?
+				session->bodyEnd - session->bodyOffset : PAYLOAD_LENGTH;
+			packet = reserveOutput(&session->data, headerLength(&session->data) + PAYLOAD_LENGTH);
+			if (session->cached != NULL) {
+				bytesRead = readFile(session, packet + headerLength(&session->data), count);
+			}
+			else {
+				bytesRead = fread(packet + headerLength(&session->data), sizeof(char), count, session->infile);
+				updateChecksum(session, packet + headerLength(&session->data), bytesRead);
+				session->bodyOffset += bytesRead;
+			}
+			writePacketHeader(&session->data, packet, "FILE", bytesRead);
+			commitOutput(&session->data, packet, headerLength(&session->data) + bytesRead);
+			budget += MAX_PACKET_LENGTH;
+			if (bytesRead > 0) {
+				continue;
+			}
+			if (session->infile != NULL && ferror(session->infile)) {
+				perror("fread");
+				session->transferStatus = -1;
+			}
+			closeFile(session);
+		}
+		finishTransfer(session);
+	}
+	if (sendData(&session->data) == -1) {
+		return -1;
+	}
+	reportTransfer(session, 0);
+	return 0;
+}
+
+/******************************************************************************
+** outputSpace()
+** Description: A function that finds the largest block a packet can be built
+** in, at the end of the output ring or, once that is too small, at its front.
+** Nothing is moved, queued packets stay where they were built.
+** Parameters: connection with the output buffer
+** Output: number of free bytes in one block
+******************************************************************************/
+int outputSpace(struct connection *conn){
+	int atEnd;
+	conn = conn->carrier;
+	atEnd = conn->outSize - conn->outEnd;
+	if (conn->wrapped) {
+		return conn->outStart - conn->wrapEnd;
+	}
+	return atEnd > conn->outStart ? atEnd : conn->outStart;
+}
+
+/******************************************************************************
+** pendingOutput()
+** Description: A function that tells whether queued bytes wait to be sent.
+** Parameters: connection with the output buffer
+** Output: 1 bytes queued, 0 output buffer empty
+******************************************************************************/
+int pendingOutput(struct connection *conn){
+	conn = conn->carrier;
+	return conn->outStart < conn->outEnd || (conn->wrapped && conn->wrapEnd > 0);
+}
+
+/******************************************************************************
+** reserveOutput()
+** Description: A function that finds where the next length bytes of output
+** are built, so that packets are written in place. commitOutput() queues them.
+** The output ring functions work on the carrier of the connection, so the
+** packets of a multiplexed data connection line up with the control packets.
+** Parameters: connection with the output buffer, number of bytes
+** Output: start of the block
+******************************************************************************/
+char *reserveOutput(struct connection *conn, int length){
+	// callers make room first, packets are never split
+	assert(outputSpace(conn) >= length);
+	conn = conn->carrier;
+	if (!conn->wrapped && conn->outSize - conn->outEnd >= length) {
+		return conn->outBuffer + conn->outEnd;
+	}
+	return conn->outBuffer + (conn->wrapped ? conn->wrapEnd : 0);
+}
+
+/******************************************************************************
+** commitOutput()
+** Description: A function that queues bytes built in a block from
+** reserveOutput(). Fewer bytes than reserved may be queued.
+** Parameters: connection with the output buffer, start of the block, number
+** of bytes built
+** Output: none
+******************************************************************************/
+void commitOutput(struct connection *conn, char *start, int length){
+	conn = conn->carrier;
+	if (!conn->wrapped && start == conn->outBuffer + conn->outEnd) {
+		conn->outEnd += length;
+	}
+	else {
+		conn->wrapped = 1;
+		conn->wrapEnd = (start - conn->outBuffer) + length;
+	}
+}
+
+/******************************************************************************
+** sendData()
+** Description: A function that uses sendmsg() to transfer the queued bytes of
+** the output ring to the client, both parts of the ring in one system call,
+** until the socket cannot take any more. While a transfer is running, MSG_MORE
+** tells the kernel more packets follow, so it sends full segments.
+** Used in controlConnection() and dataConnection().
+** Parameters: connection with the socket endpoint and output buffer
+** Output: 0 success (bytes may still be queued), -1 error
+** Source: http://man7.org/linux/man-pages/man2/send.2.html
+******************************************************************************/
+int sendData(struct connection *conn){
+	// set up variables for sendmsg(); ret return val
+	int ret;
+	struct iovec parts[2];
+	struct msghdr message;
+	int flags = MSG_NOSIGNAL;
+	// a multiplexed data connection is sent with the control connection
+	conn = conn->carrier;
+	// more packets of the transfer follow this batch
+	if ((conn->type == DATA_CONNECTION || conn->session->mux) && conn->session->state == TRANSFER_STATE) {
+		flags |= MSG_MORE;
+	}
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = parts;
+	while (pendingOutput(conn)) {
+		// the bytes at the end of the ring go first, then the ones at its front
+		message.msg_iovlen = 0;
+		if (conn->outStart < conn->outEnd) {
+			parts[message.msg_iovlen].iov_base = conn->outBuffer + conn->outStart;
+			parts[message.msg_iovlen].iov_len = conn->outEnd - conn->outStart;
+			message.msg_iovlen++;
+		}
+		if (conn->wrapped && conn->wrapEnd > 0) {
+			parts[message.msg_iovlen].iov_base = conn->outBuffer;
+			parts[message.msg_iovlen].iov_len = conn->wrapEnd;
+			message.msg_iovlen++;
+		}
+		// MSG_NOSIGNAL: a client that hangs up must not kill the server with SIGPIPE
+		ret = sendmsg(conn->socket, &message, flags);
+		conn->sendCalls++;
+		if (ret == -1) {
+			// socket buffer is full, epoll will tell us when it drains
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("sendmsg");
+			return -1;
+		}
+		conn->bytesSent += ret;
+		TRACE(TRACE_SENDS, TRACE_SEND, conn->session, ret);
+		// the first bytes of a transfer end its time to first byte
+		if (conn->session->awaitingFirstByte && conn == conn->session->data.carrier && ret > 0) {
+			conn->session->awaitingFirstByte = 0;
+			recordValue(&workerMetrics->firstByteTime, currentMicros() - conn->session->commandStart);
+		}
+		// take the bytes sent off the end part, then off the front part
+		if (ret >= conn->outEnd - conn->outStart) {
+			ret -= conn->outEnd - conn->outStart;
+			conn->outStart = conn->outEnd = 0;
+			if (conn->wrapped) {
+				conn->outEnd = conn->wrapEnd;
+				conn->wrapped = conn->wrapEnd = 0;
+			}
+		}
+		conn->outStart += ret;
+	}
+	conn->outStart = conn->outEnd = 0;
+	return 0;
+}
+
+/******************************************************************************
+** writePacketHeader()
+** Description: A function that writes the header of a packet (length field and
+** tag) at the start of a block from reserveOutput(). Version 1 packets have a
+** 16 bit length, version 2 packets a 32 bit length, and version 3 packets a
+** 32 bit length followed by the 32 bit stream ID of the connection.
+** Parameters: connection to send on, start of the packet, the tag and the
+** payload length
+** Output: none
+******************************************************************************/
+void writePacketHeader(struct connection *conn, char *packet, char *tag, int dataLength){
+	// number of bytes in packet
+	unsigned int packetLength;
+	unsigned short shortLength;
+	unsigned int stream;
+	int header = headerLength(conn);
+	// the packet length
+	if (conn->version >= 2) {
+		packetLength = htonl(header + dataLength);
+		memcpy(packet, &packetLength, PACKET_SIZE_V2);
+	}
+	if (conn->version == 3) {
+		stream = htonl(conn->stream);
+		memcpy(packet + PACKET_SIZE_V2, &stream, STREAM_ID_LENGTH);
+	}
+	if (conn->version == 1) {
+		shortLength = htons(header + dataLength);
+		memcpy(packet, &shortLength, PACKET_SIZE);
+	}
+	// the tag (set at 8 bytes)
+	memset(packet + header - TAG_LENGTH, '\0', TAG_LENGTH);
+	strncpy(packet + header - TAG_LENGTH, tag, TAG_LENGTH);
+	conn->packets++;
+}
+
+/******************************************************************************
+** handlePacketHeader()
+** Description: A function that queues only the header of a packet on the
+** connection output buffer. The payload is sent by the caller.
+** Parameters: connection to send on, the tag and the payload length
+** Output: none
+******************************************************************************/
+void handlePacketHeader(struct connection *conn, char *tag, int dataLength){
+	char *packet = reserveOutput(conn, headerLength(conn));
+	writePacketHeader(conn, packet, tag, dataLength);
+	commitOutput(conn, packet, headerLength(conn));
+}
+
+/******************************************************************************
+** handlePacket()
+** Description: A function that queues a packet from the server to the client
+** on the connection output buffer. sendData() transfers it. The payload is
+** copied with its length, so it may hold any bytes.
+** Parameters: connection to send on, the tag, the data buffer and its length
+** Output: none
+******************************************************************************/
+void handlePacket(struct connection *conn, char *tag, char *data, int dataLength){
+	char *packet = reserveOutput(conn, headerLength(conn) + dataLength);
+	writePacketHeader(conn, packet, tag, dataLength);
+	// finally, the list/files
+	memcpy(packet + headerLength(conn), data, dataLength);
+	commitOutput(conn, packet, headerLength(conn) + dataLength);
+}
+
+/******************************************************************************
+** handleRequest()
+** Description: A function that queues a packet with a text payload from the
+** server to the client. Used in controlConnection() and dataConnection().
+** Parameters: connection to send on, the tag and the data string
+** Output: none
+******************************************************************************/
+void handleRequest(struct connection *conn, char *tag, char *data){
+	handlePacket(conn, tag, data, strlen(data));
+}
+
+/******************************************************************************
+** setupUring()
+** Description: A function that sets up the io_uring of a worker with raw
+** system calls: the rings are mapped, the buffers file bodies are read into
+** are registered (the kernel pins them once, not on every read), the fixed
+** file table gets two empty slots per session, and an eventfd is registered
+** so that completions wake epoll. The kernel must support the operations
+** used; otherwise, or when io_uring is turned off, the worker keeps to epoll
+** and sendfile(). Used in runWorker().
+** Parameters: io_uring of the worker
+** Output: 0 success, -1 not available (errno tells why)
+** Source: https://kernel.dk/io_uring.pdf
+******************************************************************************/
+int setupUring(struct uring *ring){
+	struct io_uring_params params;
+	struct io_uring_probe *probe;
+	struct iovec buffers;
+	size_t ringSize;
+	char *rings;
+	int *files;
+	int status, savedErrno;
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (ring->fd == -1) {
+		return -1;
+	}
+	// one mapping for both rings, and the entries
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+		errno = ENOSYS;
+		goto fail;
+	}
+	ringSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	if (params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe) > ringSize) {
+		ringSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	}
+	rings = mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (rings == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		goto fail;
+	}
+	ring->sqHead = (unsigned *) (rings + params.sq_off.head);
+	ring->sqTail = (unsigned *) (rings + params.sq_off.tail);
+	ring->sqMask = (unsigned *) (rings + params.sq_off.ring_mask);
+	ring->sqArray = (unsigned *) (rings + params.sq_off.array);
+	ring->cqHead = (unsigned *) (rings + params.cq_off.head);
+	ring->cqTail = (unsigned *) (rings + params.cq_off.tail);
+	ring->cqMask = (unsigned *) (rings + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (rings + params.cq_off.cqes);
+	ring->entries = params.sq_entries;
+	ring->queued = 0;
+	// the operations used must all be there
+	probe = calloc(1, sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+	assert(probe != NULL);
+	status = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256);
+	if (status == -1 || probe->last_op < IORING_OP_SEND ||
+		!(probe->ops[IORING_OP_READ_FIXED].flags & IO_URING_OP_SUPPORTED) ||
+		!(probe->ops[IORING_OP_POLL_ADD].flags & IO_URING_OP_SUPPORTED) ||
+		!(probe->ops[IORING_OP_ASYNC_CANCEL].flags & IO_URING_OP_SUPPORTED) ||
+		!(probe->ops[IORING_OP_SEND].flags & IO_URING_OP_SUPPORTED)) {
+		free(probe);
+		errno = ENOSYS;
+		goto fail;
+	}
+	free(probe);
+	// buffers: registered as one block, each read uses a piece of it
+	ring->buffers = mmap(NULL, URING_BUFFERS * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->buffers == MAP_FAILED) {
+		goto fail;
+	}
+	buffers.iov_base = ring->buffers;
+	buffers.iov_len = URING_BUFFERS * URING_BUFFER_SIZE;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &buffers, 1) == -1) {
+		goto fail;
+	}
+	for (int i = 0; i < URING_BUFFERS; i++) {
+		ring->freeBuffers[i] = i;
+	}
+	ring->numberFree = URING_BUFFERS;
+	// fixed file table: empty slots, set while a session sends a file
+	files = malloc(2 * settings.maxSessions * sizeof(int));
+	assert(files != NULL);
+	for (int i = 0; i < 2 * settings.maxSessions; i++) {
+		files[i] = -1;
+	}
+	status = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, files, 2 * settings.maxSessions);
+	free(files);
+	if (status == -1) {
+		goto fail;
+	}
+	// completions signal the eventfd, which epoll watches
+	ring->notifier.socket = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ring->notifier.socket == -1) {
+		goto fail;
+	}
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_EVENTFD, &ring->notifier.socket, 1) == -1) {
+		savedErrno = errno;
+		close(ring->notifier.socket);
+		errno = savedErrno;
+		goto fail;
+	}
+	ring->notifier.type = URING_CONNECTION;
+	return 0;
+
+fail:
+	// closing the ring also drops what was registered with it
+	savedErrno = errno;
+	close(ring->fd);
+	ring->fd = -1;
+	errno = savedErrno;
+	return -1;
+}
+
+/******************************************************************************
+** queueOperation()
+** Description: A function that takes the next free submission queue entry.
+** The entries are handed to the kernel together by submitOperations(), once
+** per event loop pass; a full queue is handed over right away.
+** Parameters: io_uring of the worker
+** Output: cleared submission queue entry
+******************************************************************************/
+struct io_uring_sqe *queueOperation(struct uring *ring){
+	unsigned tail = *ring->sqTail;
+	unsigned index;
+	struct io_uring_sqe *sqe;
+	if (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->entries) {
+		submitOperations(ring);
+	}
+	index = tail & *ring->sqMask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sqArray[index] = index;
+	// the kernel sees the entry once the tail moves past it
+	__atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+	ring->queued++;
+	return sqe;
+}
+
+/******************************************************************************
+** submitOperations()
+** Description: A function that hands the queued entries to the kernel in one
+** io_uring_enter() call, without waiting for any of them.
+** Parameters: io_uring of the worker
+** Output: none
+** Source: http://man7.org/linux/man-pages/man2/io_uring_enter.2.html
+******************************************************************************/
+void submitOperations(struct uring *ring){
+	int submitted;
+	while (ring->queued > 0) {
+		submitted = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 0, 0, NULL, 0);
+		if (submitted == -1) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+				continue;
+			}
+			perror("io_uring_enter");
+			exit(1);
+		}
+		ring->queued -= submitted;
+	}
+}
+
+/******************************************************************************
+** setUringFiles()
+** Description: A function that puts the file and data socket of a session in
+** its two fixed file slots (-1 empties them). Fixed files are looked up once,
+** not on every operation.
+** Parameters: client session, file descriptor, socket descriptor
+** Output: 0 success, -1 error
+******************************************************************************/
+int setUringFiles(struct session *session, int fileFd, int socketFd){
+	int fds[2] = { fileFd, socketFd };
+	struct io_uring_files_update update;
+	memset(&update, 0, sizeof(update));
+	update.offset = 2 * session->uringSlot;
+	update.fds = (unsigned long) fds;
+	if (syscall(__NR_io_uring_register, session->uring->fd, IORING_REGISTER_FILES_UPDATE, &update, 2) != 2) {
+		perror("io_uring_register");
+		return -1;
+	}
+	session->uringFiles = fileFd != -1;
+	return 0;
+}
+
+/******************************************************************************
+** submitFileBody()
+** Description: A function that queues the next piece of a file body: a read
+** into a registered buffer, linked to the send of that buffer, so the kernel
+** runs both without the worker waiting for the disk. The completions continue
+** the transfer, in completeOperations().
+** Parameters: client session
+** Output: 1 queued, 0 no buffer or slot free (the caller sends the piece itself)
+******************************************************************************/
+int submitFileBody(struct session *session){
+	struct uring *ring = session->uring;
+	struct io_uring_sqe *sqe;
+	size_t count = session->bodyRemaining < URING_BUFFER_SIZE ? session->bodyRemaining : URING_BUFFER_SIZE;
+	if (ring->numberFree == 0) {
+		return 0;
+	}
+	if (!session->uringFiles && setUringFiles(session, fileno(session->infile), session->data.socket) == -1) {
+		return 0;
+	}
+	session->uringBuffer = ring->freeBuffers[--ring->numberFree];
+	session->uringRead = session->uringSent = 0;
+	// read the piece, and only when all of it is read, send it
+	sqe = queueOperation(ring);
+	sqe->opcode = IORING_OP_READ_FIXED;
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+	sqe->fd = 2 * session->uringSlot;
+	sqe->off = session->bodyOffset;
+	sqe->addr = (unsigned long) (ring->buffers + (size_t) session->uringBuffer * URING_BUFFER_SIZE);
+	sqe->len = count;
+	sqe->buf_index = 0;
+	sqe->user_data = (unsigned long) session | URING_READ;
+	session->uringOps++;
+	session->uringRead = count;
+	queueSend(session, 0);
+	return 1;
+}
+
+/******************************************************************************
+** queueSend()
+** Description: A function that queues the send of the rest of the piece in
+** the session buffer. After a send found the socket full, a poll for room is
+** linked in front of it.
+** Parameters: client session, whether to wait for room in the socket first
+** Output: none
+******************************************************************************/
+void queueSend(struct session *session, int afterPoll){
+	struct uring *ring = session->uring;
+	struct io_uring_sqe *sqe;
+	if (afterPoll) {
+		sqe = queueOperation(ring);
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+		sqe->fd = 2 * session->uringSlot + 1;
+		sqe->poll32_events = POLLOUT;
+		sqe->user_data = (unsigned long) session | URING_POLL;
+		session->uringOps++;
+	}
+	sqe = queueOperation(ring);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = 2 * session->uringSlot + 1;
+	sqe->addr = (unsigned long) (ring->buffers + (size_t) session->uringBuffer * URING_BUFFER_SIZE + session->uringSent);
+	sqe->len = session->uringRead - session->uringSent;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (unsigned long) session | URING_SEND;
+	session->uringOps++;
+}
+
+/******************************************************************************
+** completeOperations()
+** Description: A function that handles the io_uring completions, when epoll
+** reports the eventfd. A short read breaks the link, and the bytes read are
+** sent on their own; a short send sends the rest, and a full socket is
+** polled for room. Once the operations of a session are done, its transfer
+** goes on. Used in runWorker().
+** Parameters: event engine
+** Output: none
+******************************************************************************/
+void completeOperations(struct engine *engine){
+	struct uring *ring = &engine->uring;
+	unsigned head, tail;
+	uint64_t signals;
+	// clear the eventfd before reading the ring, so no completion is missed
+	if (read(ring->notifier.socket, &signals, sizeof(signals)) == -1 && errno != EAGAIN) {
+		perror("read eventfd");
+	}
+	head = *ring->cqHead;
+	tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+		unsigned long userData = cqe->user_data;
+		int result = cqe->res;
+		struct session *session = (struct session *) (userData & ~(unsigned long) URING_OPERATION);
+		char *buffer;
+		head++;
+		__atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+		// cancel requests have no session
+		if (session == NULL) {
+			continue;
+		}
+		session->uringOps--;
+		buffer = ring->buffers + (size_t) session->uringBuffer * URING_BUFFER_SIZE;
+		switch (userData & URING_OPERATION) {
+		case URING_READ:
+			// the checksum is taken from the buffer, on its way out
+			if (result > 0) {
+				session->uringRead = result;
+				updateChecksum(session, buffer, result);
+			}
+			else {
+				if (result == 0) {
+					fprintf(stderr, "ftserver: File \"%s\" changed while sending\n", session->filename);
+				}
+				else if (result != -ECANCELED && session->state != CLOSED_STATE) {
+					fprintf(stderr, "ftserver: io_uring read: %s\n", strerror(-result));
+				}
+				session->uringFailed = 1;
+			}
+			break;
+		case URING_POLL:
+			if (result < 0) {
+				session->uringFailed = 1;
+			}
+			break;
+		case URING_SEND:
+			if (result > 0) {
+				session->uringSent += result;
+				session->bodyOffset += result;
+				session->bodyRemaining -= result;
+				session->data.bytesSent += result;
+				TRACE(TRACE_SENDS, TRACE_SEND, session, result);
+			}
+			else if (result != -EAGAIN && result != -ECANCELED) {
+				if (session->state != CLOSED_STATE) {
+					fprintf(stderr, "ftserver: io_uring send: %s\n", strerror(-result));
+				}
+				session->uringFailed = 1;
+			}
+			// the rest of the piece: after a short send, a full socket, or a short read
+			if (session->state != CLOSED_STATE && !session->uringFailed && session->uringSent < session->uringRead) {
+				queueSend(session, result == -EAGAIN);
+			}
+			break;
+		}
+		if (session->uringOps == 0) {
+			finishOperations(engine, session);
+		}
+	}
+}
+
+/******************************************************************************
+** finishOperations()
+** Description: A function that runs after the last operation of a session
+** completed: the buffer goes back, and the transfer goes on (or the session
+** closes on an error). A closed session goes back to the pool.
+** Parameters: event engine, client session
+** Output: none
+******************************************************************************/
+void finishOperations(struct engine *engine, struct session *session){
+	struct uring *ring = &engine->uring;
+	ring->freeBuffers[ring->numberFree++] = session->uringBuffer;
+	session->uringBuffer = -1;
+	session->uringRead = session->uringSent = 0;
+	if (session->state == CLOSED_STATE) {
+		if (session->draining) {
+			session->nextClosed = engine->freeSessions;
+			engine->freeSessions = session;
+		}
+		return;
+	}
+	if (session->uringFailed) {
+		closeSession(engine, session);
+		return;
+	}
+	handleData(engine, session, 0);
+}
+
+/******************************************************************************
+** cancelOperations()
+** Description: A function that cancels the sends and polls of a session that
+** closes: a send to a client that stopped reading would never complete. A
+** read completes on its own.
+** Parameters: client session
+** Output: none
+******************************************************************************/
+void cancelOperations(struct session *session){
+	struct io_uring_sqe *sqe;
+	unsigned long operations[] = { URING_POLL, URING_SEND };
+	for (int i = 0; i < 2; i++) {
+		sqe = queueOperation(session->uring);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = (unsigned long) session | operations[i];
+		sqe->user_data = 0;
+	}
+}
+
+/******************************************************************************
+** createSessionPool()
+** Description: A function that preallocates the session slots of a worker.
+** Each slot holds a session followed by its control and data buffers, so no
+** memory is allocated while clients are served. Used in runWorker().
+** Parameters: event engine
+** Output: none
+******************************************************************************/
+void createSessionPool(struct engine *engine){
+	// bytes of one slot, rounded up so that each slot starts on a new page
+	size_t slotSize = sizeof(struct session) + 2 * MAX_PACKET_LENGTH + CONTROL_BUFFER_SIZE + DATA_BUFFER_SIZE;
+	slotSize = (slotSize + SLOT_ALIGNMENT - 1) / SLOT_ALIGNMENT * SLOT_ALIGNMENT;
+	engine->slotSize = slotSize;
+	// source: http://man7.org/linux/man-pages/man3/posix_memalign.3.html
+	if (posix_memalign((void **) &engine->sessionSlab, SLOT_ALIGNMENT, slotSize * settings.maxSessions) != 0) {
+		fprintf(stderr, "ftserver: Cannot allocate %d sessions\n", settings.maxSessions);
+		exit(1);
+	}
+	// carve the slab into slots and chain them on the free list
+	engine->freeSessions = NULL;
+	for (int i = settings.maxSessions - 1; i >= 0; i--) {
+		char *slot = engine->sessionSlab + i * slotSize;
+		struct session *session = (struct session *) slot;
+		session->control.inBuffer = slot + sizeof(struct session);
+		session->control.inSize = 2 * MAX_PACKET_LENGTH;
+		session->control.outBuffer = session->control.inBuffer + session->control.inSize;
+		session->control.outSize = CONTROL_BUFFER_SIZE;
+		session->data.outBuffer = session->control.outBuffer + session->control.outSize;
+		session->data.outSize = DATA_BUFFER_SIZE;
+		session->nextClosed = engine->freeSessions;
+		engine->freeSessions = session;
+	}
+}
+
+/******************************************************************************
+** openSession()
+** Description: A function that sets up a session from the worker pool for a
+** newly accepted control connection and registers it with epoll. When the
+** pool is empty the client is turned away. Used in acceptClients().
+** Parameters: event engine, control socket endpoint, client address
+** Output: none
+******************************************************************************/
+void openSession(struct engine *engine, int controlSocket, struct sockaddr_in *clientAddress){
+	struct session *session = engine->freeSessions;
+	// buffers are set up once by createSessionPool(), keep them
+	char *inBuffer, *controlBuffer, *dataBuffer;
+	if (session == NULL) {
+		fprintf(stderr, "ftserver: Worker %d is full, closing connection\n", engine->worker);
+		close(controlSocket);
+		return;
+	}
+	engine->freeSessions = session->nextClosed;
+	inBuffer = session->control.inBuffer;
+	controlBuffer = session->control.outBuffer;
+	dataBuffer = session->data.outBuffer;
+	memset(session, 0, sizeof(struct session));
+	session->state = DPORT_STATE;
+	session->clientAddress = *clientAddress;
+	inet_ntop(AF_INET, &clientAddress->sin_addr, session->clientIPv4, sizeof(session->clientIPv4));
+	// control connection: small packets both ways
+	session->control.socket = controlSocket;
+	session->control.type = CONTROL_CONNECTION;
+	session->control.session = session;
+	session->control.inBuffer = inBuffer;
+	session->control.inSize = 2 * MAX_PACKET_LENGTH;
+	session->control.outBuffer = controlBuffer;
+	session->control.outSize = CONTROL_BUFFER_SIZE;
+	session->control.version = 1;
+	session->control.carrier = &session->control;
+	// data connection: opened after the command, sends only
+	session->data.socket = -1;
+	session->data.type = DATA_CONNECTION;
+	session->data.session = session;
+	session->data.outBuffer = dataBuffer;
+	session->data.outSize = DATA_BUFFER_SIZE;
+	session->data.version = 1;
+	session->data.carrier = &session->data;
+	session->version = 1;
+	session->dirFd = -1;
+	session->uploadFd = -1;
+	session->uploadPipe[0] = session->uploadPipe[1] = -1;
+	// clients whose addresses hash alike share a bucket
+	if (settings.clientRate) {
+		session->clientBucket = &clientBuckets[(clientAddress->sin_addr.s_addr * 2654435761u) % CLIENT_BUCKETS];
+	}
+	// file bodies go through the worker's io_uring, from the slots of the session's pool slot
+	if (engine->uring.fd != -1) {
+		session->uring = &engine->uring;
+		session->uringSlot = ((char *) session - engine->sessionSlab) / engine->slotSize;
+	}
+	session->uringBuffer = -1;
+	watchConnection(engine, &session->control, EPOLLIN);
+	engine->activeSessions++;
+	countMetric(&engine->metrics.sessions, 1);
+	session->traceId = ++engine->traceSessions;
+	TRACE(TRACE_SESSIONS, TRACE_CONNECT, session, clientAddress->sin_addr.s_addr);
+}
+
+/******************************************************************************
+** closeSession()
+** Description: A function that closes both connections of a session. The
+** session memory is freed at the end of the event loop pass, since other
+** events of the same pass may still point at it.
+** Parameters: event engine, client session
+** Output: none
+******************************************************************************/
+void closeSession(struct engine *engine, struct session *session){
+	struct session **link = &engine->retryList;
+	if (session->state == CLOSED_STATE) {
+		return;
+	}
+	// a session waiting to retry its data connection leaves the retry list
+	while (*link != NULL) {
+		if (*link == session) {
+			*link = session->nextRetry;
+			break;
+		}
+		link = &(*link)->nextRetry;
+	}
+	// and a transfer waiting for its turn leaves the queue
+	unthrottleSession(engine, session, currentMicros());
+	// closing a socket also removes it from epoll
+	close(session->control.socket);
+	if (session->data.socket != -1) {
+		close(session->data.socket);
+	}
+	if (session->uringOps > 0) {
+		cancelOperations(session);
+	}
+	closeFile(session);
+	closeListing(session);
+	closeDelta(session);
+	closeUpload(session);
+	// a transfer whose DONE never went out is reported with what was sent
+	reportTransfer(session, 1);
+	TRACE(TRACE_SESSIONS, TRACE_CLOSE, session, session->data.carrier->bytesSent);
+	foldCounters(session);
+	session->state = CLOSED_STATE;
+	session->nextClosed = engine->closedList;
+	engine->closedList = session;
+	engine->activeSessions--;
+}
+
+/******************************************************************************
+** freeClosedSessions()
+** Description: A function that returns the sessions closed during an event
+** loop pass to the worker pool, except those with io_uring operations in
+** flight (finishOperations() returns them). Used in runWorker().
+** Parameters: event engine
+** Output: none
+******************************************************************************/
+void freeClosedSessions(struct engine *engine){
+	struct session *session;
+	while (engine->closedList != NULL) {
+		session = engine->closedList;
+		engine->closedList = session->nextClosed;
+		// io_uring operations still point at it, their completion frees it
+		if (session->uringOps > 0) {
+			session->draining = 1;
+			continue;
+		}
+		session->nextClosed = engine->freeSessions;
+		engine->freeSessions = session;
+	}
+}
+
+/******************************************************************************
+** openDataConnection()
+** Description: A function that starts a non-blocking connect() to the client
+** data port. epoll reports when it completes, in handleData().
+** Parameters: event engine, client session
+** Output: none
+******************************************************************************/
+void openDataConnection(struct engine *engine, struct session *session){
+	int status;
+	// set server side endpoint for data connection
+	session->data.socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (session->data.socket == -1) {
+		perror("socket");
+		closeSession(engine, session);
+		return;
+	}
+	// start data connection with client user, timed from the first attempt
+	if (session->connectionAttempts == 0) {
+		session->connectStart = currentMicros();
+	}
+	session->clientAddress.sin_port = htons(session->dataPort);
+	session->state = CONNECT_STATE;
+	status = connect(session->data.socket, (struct sockaddr *) &session->clientAddress, sizeof(session->clientAddress));
+	if (status == -1 && errno != EINPROGRESS) {
+		// the client may not be listening yet, try again shortly
+		retryDataConnection(engine, session);
+		return;
+	}
+	watchConnection(engine, &session->data, EPOLLOUT);
+}
+
+/******************************************************************************
+** retryDataConnection()
+** Description: A function that closes a failed data connection attempt and
+** schedules the next one, up to CONNECT_ATTEMPTS attempts. The first retry
+** comes after 1 ms and each later one waits twice as long, up to a cap, so a
+** client that listens a moment late is not kept waiting.
+** Parameters: event engine, client session
+** Output: none
+******************************************************************************/
+void retryDataConnection(struct engine *engine, struct session *session){
+	long long delay;
+	close(session->data.socket);
+	session->data.socket = -1;
+	session->connectionAttempts++;
+	// max number of connection attempts is set at CONNECT_ATTEMPTS
+	if (session->connectionAttempts >= CONNECT_ATTEMPTS) {
+		fprintf(stderr, "ftserver: Cannot connect to data port %d of \"%s\"\n",
+			session->dataPort, session->clientIPv4);
+		closeSession(engine, session);
+		return;
+	}
+	// a client binding its port after OKAY is usually there by the first retry
+	delay = CONNECT_RETRY_MS << (session->connectionAttempts - 1);
+	session->retryTime = currentTime() + (delay < CONNECT_RETRY_MAX_MS ? delay : CONNECT_RETRY_MAX_MS);
+	session->nextRetry = engine->retryList;
+	engine->retryList = session;
+}
+
+/******************************************************************************
+** retryConnections()
+** Description: A function that restarts the data connections whose retry time
+** has come, and finds how long epoll may sleep until the next one.
+** Parameters: event engine
+** Output: epoll timeout in milliseconds, -1 when no retries are waiting
+******************************************************************************/
+int retryConnections(struct engine *engine){
+	long long now = currentTime();
+	int timeout = -1;
+	struct session **link = &engine->retryList;
+	while (*link != NULL) {
+		struct session *session = *link;
+		// not yet, keep it in the list
+		if (session->retryTime > now) {
+			if (timeout == -1 || session->retryTime - now < timeout) {
+				timeout = session->retryTime - now;
+			}
+			link = &session->nextRetry;
+			continue;
+		}
+		*link = session->nextRetry;
+		openDataConnection(engine, session);
+	}
+	return timeout;
+}
+
+/******************************************************************************
+** replyRoom()
+** Description: A function that makes sure the reply to the next command (the
+** largest is STATS) fits in the control output buffer, sending the queued
+** replies first when it does not. Used in handleControl().
+** Parameters: control connection
+** Output: 1 room for the reply, 0 the client has to read the replies first
+******************************************************************************/
+int replyRoom(struct connection *conn){
+	if (outputSpace(conn) >= STATS_TEXT_SIZE + MAX_PACKET_LENGTH) {
+		return 1;
+	}
+	return sendData(conn) == 0 && outputSpace(conn) >= STATS_TEXT_SIZE + MAX_PACKET_LENGTH;
+}
+
+/******************************************************************************
+** handleControl()
+** Description: A function that handles epoll events on a control connection:
+** receives and runs client packets, and sends queued replies. Also called
+** after each data connection event, to run pipelined commands.
+** Parameters: event engine, client session, epoll events
+** Output: none
+******************************************************************************/
+void handleControl(struct engine *engine, struct session *session, unsigned int events){
+	int status = 0;
+	int waiting;
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+		if (receiveData(&session->control) == -1) {
+			closeSession(engine, session);
+			return;
+		}
+	}
+	// a multiplexed transfer ends on this connection: its report waits for DONE to go out
+	if (session->reportPending && session->mux) {
+		if (sendData(&session->control) == -1) {
+			closeSession(engine, session);
+			return;
+		}
+		reportTransfer(session, 0);
+	}
+	// packets are only read between transfers: commands pipelined by a kept
+	// session wait in the input buffer until the transfer before them is done
+	// and reported
+	waiting = !session->reportPending && (session->state == DPORT_STATE || session->state == COMMAND_STATE ||
+		session->state == SIGNATURE_STATE || session->state == ACK_STATE);
+	do {
+		// a command is only read when its reply fits in the control output buffer
+		// (pipelined STATS replies wait for the ones before them to go out)
+		while (waiting && replyRoom(&session->control) &&
+			(status = receivePacket(&session->control, session->tagIn, session->dataIn, &session->dataInLength)) == 1) {
+			if (controlConnection(engine, session, session->tagIn, session->dataIn) == -1) {
+				closeSession(engine, session);
+				return;
+			}
+			if (session->state == CLOSED_STATE) {
+				return;
+			}
+			waiting = !session->reportPending &&
+				(session->state == COMMAND_STATE || session->state == SIGNATURE_STATE || session->state == ACK_STATE);
+		}
+		if (status == -1) {
+			fprintf(stderr, "ftserver: Malformed packet from \"%s\"\n", session->clientIPv4);
+			closeSession(engine, session);
+			return;
+		}
+		// a multiplexed transfer runs on this connection; once it is done,
+		// the commands pipelined after it are next
+		if (!session->mux || session->state != TRANSFER_STATE) {
+			break;
+		}
+		if (runTransfer(engine, session) == -1) {
+			closeSession(engine, session);
+			return;
+		}
+		if (session->reportPending) {
+			if (sendData(&session->control) == -1) {
+				closeSession(engine, session);
+				return;
+			}
+			reportTransfer(session, 0);
+		}
+		waiting = !session->reportPending &&
+			(session->state == COMMAND_STATE || session->state == SIGNATURE_STATE || session->state == ACK_STATE);
+	} while (waiting);
+	// send the replies, the session ends once the last one is out
+	if (sendData(&session->control) == -1) {
+		closeSession(engine, session);
+		return;
+	}
+	if (!pendingOutput(&session->control) && session->state == CLOSING_STATE) {
+		closeSession(engine, session);
+		return;
+	}
+	// stop reading while a transfer runs, or while replies wait to go out,
+	// epoll still reports a hang up; a multiplexed transfer keeps writing
+	waiting = waiting && outputSpace(&session->control) >= STATS_TEXT_SIZE + MAX_PACKET_LENGTH;
+	updateEvents(engine, &session->control, (waiting ? EPOLLIN : 0) |
+		(pendingOutput(&session->control) || (session->mux && session->state == TRANSFER_STATE && !session->throttled) ?
+		EPOLLOUT : 0));
+}
+
+/******************************************************************************
+** handleData()
+** Description: A function that handles epoll events on a data connection:
+** completes the connect() to the client, then sends the listing or file.
+** Parameters: event engine, client session, epoll events
+** Output: none
+******************************************************************************/
+void handleData(struct engine *engine, struct session *session, unsigned int events){
+	int error;
+	socklen_t errorLength = sizeof(error);
+	if (session->state == CONNECT_STATE) {
+		// find out whether the connect() succeeded
+		if (getsockopt(session->data.socket, SOL_SOCKET, SO_ERROR, &error, &errorLength) == -1 || error != 0) {
+			retryDataConnection(engine, session);
+			return;
+		}
+		recordValue(&engine->metrics.connectTime, currentMicros() - session->connectStart);
+		TRACE(TRACE_SESSIONS, TRACE_DATA_OPEN, session, currentMicros() - session->connectStart);
+		startTransfer(session);
+	}
+	else if (events & (EPOLLHUP | EPOLLERR)) {
+		// client hung up in the middle of the transfer, or a kept session lost
+		// the data connection its next commands need
+		if (session->state == TRANSFER_STATE || session->keepOpen) {
+			closeSession(engine, session);
+			return;
+		}
+		// client hung up after DONE, the ACK on the control connection ends the session
+		close(session->data.socket);
+		session->data.socket = -1;
+		return;
+	}
+	if (runTransfer(engine, session) == -1) {
+		closeSession(engine, session);
+		return;
+	}
+	// errors and CLOSE may have been queued on the control connection
+	handleControl(engine, session, 0);
+	if (session->state == CLOSED_STATE || session->data.socket == -1) {
+		return;
+	}
+	// keep writing while there is something to send (io_uring is sending),
+	// or reading while an upload comes in; a transfer waiting for its turn
+	// is run by the scheduler
+	if (session->throttled) {
+		updateEvents(engine, &session->data, 0);
+	}
+	else if ((session->state == TRANSFER_STATE && session->uringOps == 0 && session->uploadFd == -1) ||
+		pendingOutput(&session->data)) {
+		updateEvents(engine, &session->data, EPOLLOUT);
+	}
+	else if (session->state == TRANSFER_STATE && session->uploadFd != -1) {
+		updateEvents(engine, &session->data, EPOLLIN);
+	}
+	else {
+		updateEvents(engine, &session->data, 0);
+	}
+}
+
+/******************************************************************************
+** acceptClients()
+** Description: A function that accepts all waiting control connections and
+** opens a session for each one.
+** Parameters: event engine
+** Output: none
+******************************************************************************/
+void acceptClients(struct engine *engine){
+	// server side socket endpoint
+	int controlSocket;
+	// address struct length
+	// http://pubs.opengroup.org/onlinepubs/7908799/xns/syssocket.h.html
+	socklen_t addrLen;
+	struct sockaddr_in clientAddress;
+	while (1) {
+		addrLen = sizeof(struct sockaddr_in);
+		controlSocket = accept4(engine->listener.socket, (struct sockaddr *) &clientAddress, &addrLen, SOCK_NONBLOCK);
+		if (controlSocket == -1) {
+			// no more waiting connections
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return;
+			}
+			// the client gave up before we got to it
+			if (errno == ECONNABORTED || errno == EINTR) {
+				continue;
+			}
+			// out of descriptors: keep serving the sessions we have
+			perror("accept");
+			return;
+		}
+		openSession(engine, controlSocket, &clientAddress);
+	}
+}
+
+/******************************************************************************
+** openListener()
+** Description: A function that opens a non-blocking socket listening on the
+** inputed port. Every worker opens its own, with SO_REUSEPORT, and the kernel
+** spreads new connections between them. Used in runWorker().
+** Parameters: port that server user enters
+** Output: listening socket endpoint
+** Source: http://man7.org/linux/man-pages/man7/socket.7.html
+******************************************************************************/
+int openListener(int port){
+	// endpoint socket that receives requests
+	int serverSocket;
+	int status;
+	int optionValue = 1;
+	// get server address
+	struct sockaddr_in serverAddress;
+	memset(&serverAddress, 0, sizeof(serverAddress));
+	// specify what type of socket addressing used (IPv4)
+	serverAddress.sin_family = AF_INET;
+	// convert address host to network short
+	serverAddress.sin_port = htons(port);
+	// bind socket to INNADD_ANY (all available interfaces, not just localhost)
+	// source: http://stackoverflow.com/questions/16508685/understanding-inaddr-any-for-socket-programming-c
+	serverAddress.sin_addr.s_addr = INADDR_ANY;
+	// set the server side socket
+	serverSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (serverSocket == -1) {
+		perror("socket");
+		exit(1);
+	}
+	// allow restarting the server while old connections are in TIME_WAIT,
+	// and let every worker bind the same port
+	setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &optionValue, sizeof(optionValue));
+	if (setsockopt(serverSocket, SOL_SOCKET, SO_REUSEPORT, &optionValue, sizeof(optionValue)) == -1) {
+		perror("setsockopt");
+		exit(1);
+	}
+	// bind the new server socket with the port
+	status = bind(serverSocket, (struct sockaddr*) &serverAddress, sizeof(serverAddress));
+	if (status == -1) {
+		perror("bind");
+		exit(1);
+	}
+	// listen for client user connections, as many as the kernel allows
+	status = listen(serverSocket, SOMAXCONN);
+	if (status == -1) {
+		perror("listen");
+		exit(1);
+	}
+	return serverSocket;
+}
+
+/******************************************************************************
+** runWorker()
+** Description: A function that runs one worker: its own listener, session
+** pool and epoll event loop. Workers share nothing, so there is no lock on
+** the path that serves clients. Started by startServer().
+** Parameters: event engine of the worker
+** Output: none, runs until the server is stopped
+** Source: http://man7.org/linux/man-pages/man7/epoll.7.html
+******************************************************************************/
+void *runWorker(void *arg){
+	struct engine *engine = arg;
+	struct epoll_event events[MAX_EVENTS];
+	// the counters of this worker, written from the code that serves its sessions
+	workerMetrics = &engine->metrics;
+	workerTrace = engine->trace;
+	// pin the worker to one core, so that its sessions stay in that core's caches
+	// source: http://man7.org/linux/man-pages/man3/pthread_setaffinity_np.3.html
+	if (settings.pinWorkers) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(engine->worker % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+			fprintf(stderr, "ftserver: Cannot pin worker %d\n", engine->worker);
+		}
+	}
+	// the session pool is allocated by the worker thread, so that its pages
+	// come from the memory next to the worker's core
+	createSessionPool(engine);
+	// set up the event engine, the listener is watched like any connection
+	engine->epollFd = epoll_create1(0);
+	if (engine->epollFd == -1) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	engine->listener.socket = openListener(settings.port);
+	engine->listener.type = LISTEN_CONNECTION;
+	watchConnection(engine, &engine->listener, EPOLLIN);
+	// the io_uring completions are watched like a connection too
+	engine->uring.fd = -1;
+	if (settings.useUring) {
+		if (setupUring(&engine->uring) == -1) {
+			fprintf(stderr, "ftserver: Worker %d cannot use io_uring (%s), using epoll and sendfile\n",
+				engine->worker, strerror(errno));
+		}
+		else {
+			watchConnection(engine, &engine->uring.notifier, EPOLLIN);
+		}
+	}
+	while (1) {
+		int numberEvents, timeout, throttleTimeout;
+		// the transfers waiting for tokens take their turns
+		throttleTimeout = serveThrottled(engine);
+		// hand the io_uring operations queued in the last pass (and by the
+		// turns just taken) to the kernel at once
+		if (engine->uring.fd != -1) {
+			submitOperations(&engine->uring);
+		}
+		freeClosedSessions(engine);
+		// sleep until a socket is ready, a data connection retry is due or
+		// tokens come in for a waiting transfer
+		timeout = retryConnections(engine);
+		if (throttleTimeout != -1 && (timeout == -1 || throttleTimeout < timeout)) {
+			timeout = throttleTimeout;
+		}
+		numberEvents = epoll_wait(engine->epollFd, events, MAX_EVENTS, timeout);
+		if (numberEvents == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			exit(1);
+		}
+		for (int i = 0; i < numberEvents; i++) {
+			struct connection *conn = events[i].data.ptr;
+			if (conn->type == LISTEN_CONNECTION) {
+				acceptClients(engine);
+			}
+			else if (conn->type == URING_CONNECTION) {
+				completeOperations(engine);
+			}
+			// skip events for sessions closed earlier in this pass
+			else if (conn->session->state == CLOSED_STATE) {
+				continue;
+			}
+			else if (conn->type == CONTROL_CONNECTION) {
+				handleControl(engine, conn->session, events[i].events);
+			}
+			else {
+				handleData(engine, conn->session, events[i].events);
+			}
+		}
+		freeClosedSessions(engine);
+	}
+	return NULL;
+}
+
+/******************************************************************************
+** startServer()
+** Description: A function that starts the worker threads on the inputed port.
+** Each worker serves many client sessions at once from its own event loop,
+** and the server remains open after each session for more client users. Used
+** in main function.
+** Parameters: none, the port and number of workers are in settings
+** Output: none
+******************************************************************************/
+void startServer(void){
+	int status;
+	// set up signal for handling ctrl c exit
+	struct sigaction interrupt;
+	// ready stopServer() to catch any interrupt signals
+	interrupt.sa_handler = &stopServer;
+	interrupt.sa_flags = 0;
+	sigemptyset(&interrupt.sa_mask);
+	status = sigaction(SIGINT, &interrupt, 0);
+	if (status == -1) {
+		perror("sigaction");
+		exit(1);
+	}
+	// read the directory once, requests use the index from now on
+	startDirectoryIndex();
+	fileCache.budget = (size_t) settings.cacheMegabytes * 1048576;
+	startRateLimits();
+	engines = calloc(settings.workers, sizeof(struct engine));
+	assert(engines != NULL);
+	if (settings.metricsPort) {
+		startMetricsEndpoint();
+	}
+	startTracing();
+	// start running on port, waiting for client user connections (data or control)
+	printf("ftserver: Server open on port %d with %d worker%s\n", settings.port,
+		settings.workers, settings.workers == 1 ? "" : "s");
+	// worker 0 runs on the main thread
+	for (int i = 1; i < settings.workers; i++) {
+		engines[i].worker = i;
+		status = pthread_create(&engines[i].thread, NULL, runWorker, &engines[i]);
+		if (status != 0) {
+			fprintf(stderr, "ftserver: Cannot start worker %d\n", i);
+			exit(1);
+		}
+	}
+	engines[0].thread = pthread_self();
+	runWorker(&engines[0]);
+}